@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+
+#include "addr_table.h"
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib.h"
+#include "logger.h"
+
+/* Private functions */
+
+static void normalize_addr(struct sockaddr_storage *dst,
+                           const struct sockaddr *addr, socklen_t len) {
+        memset(dst, 0, sizeof(struct sockaddr_storage));
+        memcpy(dst, addr, len);
+        // sin_zero is padding, it must not make two addresses different.
+        if (addr->sa_family == AF_INET && len >= sizeof(struct sockaddr_in))
+                memset(((struct sockaddr_in *)dst)->sin_zero, 0,
+                       sizeof(((struct sockaddr_in *)dst)->sin_zero));
+}
+
+static uint32_t hash_addr(const struct sockaddr_storage *addr, socklen_t len) {
+        // FNV-1a
+        const unsigned char *bytes = (const unsigned char *)addr;
+        uint32_t hash = 2166136261u;
+        for (socklen_t i = 0; i < len; i++) {
+                hash ^= bytes[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+static int find_bucket(const AddrTable *table,
+                       const struct sockaddr_storage *addr, socklen_t len) {
+        int mask = table->buckets_size - 1;
+        int i = hash_addr(addr, len) & mask;
+        while (table->buckets[i]) {
+                const AddrEntry *entry = &table->entries[table->buckets[i]];
+                if (entry->len == len &&
+                    !memcmp(&entry->sockaddr_sto, addr, len))
+                        break;
+                i = (i + 1) & mask;
+        }
+        return i;
+}
+
+static void rehash(AddrTable *table, int new_buckets_size) {
+        free(table->buckets);
+        table->buckets =
+            (uint16_t *)my_calloc(sizeof(uint16_t) * new_buckets_size);
+        table->buckets_size = new_buckets_size;
+        for (int id = 1; id < table->count; id++) {
+                const AddrEntry *entry = &table->entries[id];
+                int i = find_bucket(table, &entry->sockaddr_sto, entry->len);
+                table->buckets[i] = id;
+        }
+}
+
+static void init(AddrTable *table) {
+        table->entries =
+            (AddrEntry *)my_calloc(sizeof(AddrEntry) * ADDR_TABLE_INIT_SIZE);
+        table->size = ADDR_TABLE_INIT_SIZE;
+        table->count = 1;  // Id 0 is reserved.
+        table->buckets = NULL;
+        rehash(table, ADDR_TABLE_INIT_SIZE * 2);
+}
+
+static void double_size(AddrTable *table) {
+        int new_size = table->size * 2;
+        AddrEntry *new_entries =
+            (AddrEntry *)my_calloc(sizeof(AddrEntry) * new_size);
+        memcpy(new_entries, table->entries, sizeof(AddrEntry) * table->size);
+        free(table->entries);
+        table->entries = new_entries;
+        table->size = new_size;
+        rehash(table, new_size * 2);
+}
+
+/* Public functions */
+
+uint16_t addr_table_intern(AddrTable *table, const struct sockaddr *addr,
+                           socklen_t len) {
+        if (!addr || !len) return 0;
+        if (len > sizeof(struct sockaddr_storage))
+                len = sizeof(struct sockaddr_storage);
+        if (!table->entries) init(table);
+
+        struct sockaddr_storage key;
+        normalize_addr(&key, addr, len);
+
+        int i = find_bucket(table, &key, len);
+        if (table->buckets[i]) return table->buckets[i];
+
+        if (table->count > ADDR_TABLE_MAX_ID) goto error;
+        if (table->count == table->size) {
+                double_size(table);
+                i = find_bucket(table, &key, len);
+        }
+
+        uint16_t id = table->count++;
+        AddrEntry *entry = &table->entries[id];
+        memcpy(&entry->sockaddr_sto, &key, sizeof(key));
+        entry->len = len;
+        entry->dumped = false;
+        table->buckets[i] = id;
+        return id;
+error:
+        if (!table->full)
+                LOG(WARN, "Address table full. New addresses are dropped.");
+        table->full = true;
+        return 0;
+}
+
+AddrEntry *addr_table_get(const AddrTable *table, uint16_t id) {
+        if (!id || id >= table->count) return NULL;
+        return &table->entries[id];
+}
+
+void addr_table_free(AddrTable *table) {
+        free(table->entries);
+        free(table->buckets);
+        memset(table, 0, sizeof(AddrTable));
+}
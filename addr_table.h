@@ -0,0 +1,35 @@
+#ifndef ADDR_TABLE_H
+#define ADDR_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Per-socket dictionary of peer addresses. Events only store the index of
+ * their address, so that a UDP socket talking to the same peers does not copy
+ * a full sockaddr_storage into every event. Index 0 means "no address". */
+
+#define ADDR_TABLE_INIT_SIZE 8
+#define ADDR_TABLE_MAX_ID UINT16_MAX
+
+typedef struct {
+        struct sockaddr_storage sockaddr_sto;
+        socklen_t len;
+        bool dumped;  // Full address already written in the trace file.
+} AddrEntry;
+
+typedef struct {
+        AddrEntry *entries;  // entries[0] is unused.
+        int count;           // Number of ids handed out, including 0.
+        int size;
+        uint16_t *buckets;  // Open addressing on the address bytes.
+        int buckets_size;   // Power of 2, at least twice count.
+        bool full;
+} AddrTable;
+
+uint16_t addr_table_intern(AddrTable *table, const struct sockaddr *addr,
+                           socklen_t len);
+AddrEntry *addr_table_get(const AddrTable *table, uint16_t id);
+void addr_table_free(AddrTable *table);
+
+#endif
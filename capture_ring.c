@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+
+#include "capture_ring.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if_arp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "fd_table.h"
+#include "lib.h"
+#include "logger.h"
+
+#define RING_SIZE ((size_t)RING_BLOCK_SIZE * RING_BLOCKS)
+
+/* Private functions */
+
+static int setup_ring(int fd) {
+        int version = TPACKET_V3;
+        if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                       sizeof(version)))
+                goto error;
+        struct tpacket_req3 req;
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = RING_BLOCK_SIZE;
+        req.tp_block_nr = RING_BLOCKS;
+        req.tp_frame_size = RING_FRAME_SIZE;
+        req.tp_frame_nr = RING_SIZE / RING_FRAME_SIZE;
+        req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+        if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)))
+                goto error;
+        return 0;
+error:
+        LOG(ERROR, "setsockopt() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+/* Over the loopback, each packet is seen twice: once sent and once received.
+ * The sent copy is skipped, as libpcap does. */
+static bool is_loopback_copy(const struct tpacket3_hdr *hdr) {
+        const struct sockaddr_ll *sll =
+            (const struct sockaddr_ll *)((const uint8_t *)hdr +
+                                         TPACKET_ALIGN(sizeof(*hdr)));
+        return sll->sll_pkttype == PACKET_OUTGOING &&
+               sll->sll_hatype == ARPHRD_LOOPBACK;
+}
+
+static int read_block(struct tpacket_block_desc *block, RingCallback callback,
+                      void *arg) {
+        int count = block->hdr.bh1.num_pkts;
+        const uint8_t *ptr =
+            (const uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+        for (int i = 0; i < count; i++) {
+                const struct tpacket3_hdr *hdr =
+                    (const struct tpacket3_hdr *)ptr;
+                if (!is_loopback_copy(hdr)) {
+                        RingPacket packet = {ptr + hdr->tp_net,
+                                             hdr->tp_snaplen, hdr->tp_len,
+                                             hdr->tp_sec, hdr->tp_nsec};
+                        callback(&packet, arg);
+                }
+                ptr += hdr->tp_next_offset;
+        }
+        return count;
+}
+
+/* Public functions */
+
+/* The filter is attached before the socket is bound, so that no packet gets
+ * in unfiltered. Returns NULL on error. */
+CaptureRing *ring_open(int ifindex, const struct sock_fprog *filter) {
+        // Bound to no protocol until bind() below, so that nothing is queued.
+        int fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) goto error1;
+        // Spare the overrides, and survive fd table resets.
+        fd_table_set(fd, FD_UNTRACED | FD_OWN);
+        if (setup_ring(fd)) goto error2;
+        uint8_t *map = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) goto error3;
+
+        CaptureRing *ring = (CaptureRing *)my_calloc(sizeof(CaptureRing));
+        ring->ifindex = ifindex;
+        ring->fd = fd;
+        ring->map = map;
+        if (ring_set_filter(ring, filter)) goto error4;
+
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = htons(ETH_P_ALL);
+        addr.sll_ifindex = ifindex;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) goto error5;
+        LOG(INFO, "Capture ring open on interface %d.", ifindex);
+        return ring;
+error5:
+        LOG(ERROR, "bind() failed. %s.", strerror(errno));
+error4:
+        free(ring);
+        munmap(map, RING_SIZE);
+        goto error2;
+error3:
+        LOG(ERROR, "mmap() failed. %s.", strerror(errno));
+error2:
+        close(fd);
+        goto error_out;
+error1:
+        LOG(ERROR, "socket() failed. %s.", strerror(errno));
+error_out:
+        LOG_FUNC_ERROR;
+        return NULL;
+}
+
+/* Packets already in the ring were taken with the previous filter. */
+int ring_set_filter(CaptureRing *ring, const struct sock_fprog *filter) {
+        if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, filter,
+                       sizeof(*filter)))
+                goto error;
+        return 0;
+error:
+        LOG(ERROR, "setsockopt() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+// Reads the retired blocks, without blocking. Returns the number of packets.
+int ring_read(CaptureRing *ring, RingCallback callback, void *arg) {
+        int count = 0;
+        while (true) {
+                struct tpacket_block_desc *block =
+                    (struct tpacket_block_desc *)(ring->map +
+                                                  (size_t)ring->block *
+                                                      RING_BLOCK_SIZE);
+                uint32_t status = __atomic_load_n(&block->hdr.bh1.block_status,
+                                                  __ATOMIC_ACQUIRE);
+                if (!(status & TP_STATUS_USER)) break;
+                count += read_block(block, callback, arg);
+                __atomic_store_n(&block->hdr.bh1.block_status,
+                                 TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+                ring->block = (ring->block + 1) % RING_BLOCKS;
+        }
+        return count;
+}
+
+/* Whether the block being filled by the kernel has packets, which are read
+ * once it is retired. */
+bool ring_has_pending(const CaptureRing *ring) {
+        const struct tpacket_block_desc *block =
+            (const struct tpacket_block_desc *)(ring->map +
+                                                (size_t)ring->block *
+                                                    RING_BLOCK_SIZE);
+        uint32_t status =
+            __atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+        return !(status & TP_STATUS_USER) &&
+               __atomic_load_n(&block->hdr.bh1.num_pkts, __ATOMIC_RELAXED);
+}
+
+void ring_close(CaptureRing *ring) {
+        munmap(ring->map, RING_SIZE);
+        close(ring->fd);
+        free(ring);
+}
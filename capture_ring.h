@@ -0,0 +1,44 @@
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+#include <linux/filter.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Packet capture on an AF_PACKET socket with a TPACKET_V3 PACKET_RX_RING,
+ * bound to one interface, or to all of them. The kernel writes packets to
+ * blocks of a mapping shared with us, and retires a block once full or after
+ * RING_BLOCK_TIMEOUT_MS. poll() on the socket wakes up on retired blocks.
+ * Packets are read in place, then their block is handed back to the kernel:
+ * there is neither a copy nor a syscall per packet. The socket is SOCK_DGRAM,
+ * packets thus start at their network header. */
+
+#define RING_BLOCK_SIZE (1 << 20)   // A power of 2, multiple of the page size.
+#define RING_BLOCKS 8               // 8MB per ring.
+#define RING_FRAME_SIZE 2048        // Only used to size the ring.
+#define RING_BLOCK_TIMEOUT_MS 100
+
+typedef struct {
+        const uint8_t *data;  // In the ring, valid during the callback only.
+        uint32_t caplen;
+        uint32_t len;
+        uint32_t sec;
+        uint32_t nsec;
+} RingPacket;
+
+typedef void (*RingCallback)(const RingPacket *packet, void *arg);
+
+typedef struct {
+        int ifindex;  // 0 for all interfaces.
+        int fd;
+        uint8_t *map;
+        int block;  // Next block to read.
+} CaptureRing;
+
+CaptureRing *ring_open(int ifindex, const struct sock_fprog *filter);
+int ring_set_filter(CaptureRing *ring, const struct sock_fprog *filter);
+int ring_read(CaptureRing *ring, RingCallback callback, void *arg);
+bool ring_has_pending(const CaptureRing *ring);
+void ring_close(CaptureRing *ring);
+
+#endif
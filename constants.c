@@ -70,3 +70,10 @@ char *alloc_fcntl_cmd_str(int cmd) { MAP_GET(FCNTL_CMDS, cmd); }
 char *alloc_ioctl_request_str(int request) { MAP_GET(IOCTL_REQUESTS, request); }
 
 char *alloc_errno_str(int err) { MAP_GET(ERRNOS, err); }
+
+// Reverse of alloc_errno_str(), 0 if unknown.
+int errno_from_str(const char *str) {
+        for (size_t i = 0; i < sizeof(ERRNOS) / sizeof(IntStrPair); i++)
+                if (!strcmp(ERRNOS[i].str, str)) return ERRNOS[i].cons;
+        return 0;
+}
@@ -54,6 +54,7 @@ typedef struct {
 #include "constants/sol_raw_options.h"
 
 char *alloc_errno_str(int err);
+int errno_from_str(const char *str);
 char *alloc_fcntl_cmd_str(int cmd);
 char *alloc_ioctl_request_str(int request);
 char *alloc_sockopt_name(int level, int optname);
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include "control.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "dormant.h"
+#include "fd_table.h"
+#include "governor.h"
+#include "init.h"
+#include "lib.h"
+#include "logger.h"
+#ifndef TCPSNITCH_LEAN
+#include "packet_sniffer.h"
+#endif
+#include "sock_events.h"
+#include "sock_filter.h"
+#include "string_builders.h"
+#include "tcp_sampler.h"
+
+#define CONTROL_SOCK_NAME "control.sock"
+#define CONTROL_BACKLOG 4
+#define CONTROL_LINE_MAX 512
+#define CONTROL_TIMEOUT_SEC 1  // A stuck client must not block the others.
+
+typedef struct {
+        char name;
+        long *val;
+} LongOpt;
+
+static LongOpt long_opts[] = {
+    {'b', &conf_opt_b},
+#ifndef TCPSNITCH_LEAN
+    {'c', &conf_opt_c},
+#endif
+    {'e', &conf_opt_e},
+    {'g', &conf_opt_g},
+#ifndef TCPSNITCH_LEAN
+    {'q', &conf_opt_q},
+#endif
+    {'s', &conf_opt_s},
+    {'t', &conf_opt_t},
+    {'u', &conf_opt_u},
+};
+
+static char *control_path;  // NULL when the control socket is not up.
+static int control_fd = -1;
+
+/* Private functions */
+
+static void reply(int fd, const char *msg) {
+        // MSG_NOSIGNAL: a client going away must not kill the traced process.
+        if (send(fd, msg, strlen(msg), MSG_NOSIGNAL) < 0)
+                LOG(WARN, "Control reply failed. %s.", strerror(errno));
+}
+
+static void reply_options(int fd) {
+        char buf[CONTROL_LINE_MAX];
+        snprintf(buf, sizeof(buf),
+                 "ok dormant=%d level=%s b=%ld c=%ld e=%ld g=%ld q=%ld s=%ld "
+                 "t=%ld u=%ld j=%s m=%s w=%s\n",
+                 IS_DORMANT(), string_from_gov_level(GOVERNOR_LEVEL()),
+                 conf_opt_b, conf_opt_c, conf_opt_e, conf_opt_g, conf_opt_q,
+                 conf_opt_s, conf_opt_t, conf_opt_u,
+                 conf_opt_j ? conf_opt_j : "", conf_opt_m ? conf_opt_m : "",
+                 conf_opt_w ? conf_opt_w : "");
+        reply(fd, buf);
+}
+
+static bool set_long_opt(char name, const char *val) {
+        for (size_t i = 0; i < sizeof(long_opts) / sizeof(LongOpt); i++) {
+                if (long_opts[i].name != name) continue;
+                long l = parse_long(val);
+                if (l < 0) return false;
+                __atomic_store_n(long_opts[i].val, l, __ATOMIC_RELAXED);
+                if (name == 't' && l) start_json_dumper_thread();
+                if (name == 'g' && l) start_governor_thread();
+                if ((name == 'b' || name == 'u') && l)
+                        start_tcp_sampler_thread();
+                return true;
+        }
+        return false;
+}
+
+// The previous string is freed, nobody else reads it after init.
+static void replace_str_opt(char **opt, const char *val) {
+        char *old = *opt;
+        *opt = *val ? strdup(val) : NULL;
+        free(old);
+}
+
+static bool set_opt(const char *name, const char *val) {
+        if (strlen(name) != 1) return false;
+        switch (name[0]) {
+                case 'j':
+                        if (!filter_triggers_compile(*val ? val : NULL))
+                                return false;
+                        replace_str_opt(&conf_opt_j, val);
+                        return true;
+                case 'm':
+                        if (!filter_compile(*val ? val : NULL)) return false;
+                        replace_str_opt(&conf_opt_m, val);
+                        return true;
+                case 'w':
+                        if (!filter_events_compile(*val ? val : NULL))
+                                return false;
+                        replace_str_opt(&conf_opt_w, val);
+                        return true;
+                default:
+                        return set_long_opt(name[0], val);
+        }
+}
+
+static void run_command(int fd, char *line) {
+        char *saveptr, *cmd = strtok_r(line, " ", &saveptr);
+        if (!cmd) return;  // Empty line.
+        LOG(INFO, "Control command: %s %s.", cmd, saveptr);
+
+        if (!strcmp(cmd, "get")) {
+                reply_options(fd);
+        } else if (!strcmp(cmd, "dormant") || !strcmp(cmd, "activate")) {
+                set_dormant(!strcmp(cmd, "dormant"));
+                reply(fd, "ok\n");
+        } else if (!strcmp(cmd, "flush")) {
+                dump_all_sock_events();
+                reply(fd, "ok\n");
+#ifndef TCPSNITCH_LEAN
+        } else if (!strcmp(cmd, "record")) {
+                capture_trigger_all("control command");
+                sock_ev_trigger_all("control command");
+                reply(fd, "ok\n");
+#endif
+        } else if (!strcmp(cmd, "set")) {
+                char *name = strtok_r(NULL, " ", &saveptr);
+                if (name && set_opt(name, saveptr ? saveptr : ""))
+                        reply(fd, "ok\n");
+                else
+                        reply(fd, "error invalid option or value\n");
+        } else
+                reply(fd, "error unknown command\n");
+}
+
+static void serve_client(int fd) {
+        struct timeval timeout = {CONTROL_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        char buf[CONTROL_LINE_MAX];
+        size_t len = 0;
+        ssize_t n;
+        while ((n = recv(fd, buf + len, sizeof(buf) - len - 1, 0)) > 0) {
+                len += n;
+                buf[len] = '\0';
+                char *line = buf, *end;
+                while ((end = strpbrk(line, "\r\n"))) {
+                        *end = '\0';
+                        run_command(fd, line);
+                        line = end + 1;
+                }
+                // Keep the unterminated tail for the next read.
+                len = strlen(line);
+                memmove(buf, line, len + 1);
+                if (len == sizeof(buf) - 1) {
+                        reply(fd, "error line too long\n");
+                        len = 0;
+                }
+        }
+        if (len) run_command(fd, buf);  // Last line without newline.
+}
+
+static void *control_thread(void *arg) {
+        UNUSED(arg);
+        LOG_FUNC_INFO;
+        int client_fd;
+        while (true) {
+                if ((client_fd = accept(control_fd, NULL, NULL)) < 0) {
+                        if (errno == EINTR) continue;
+                        goto error;
+                }
+                fd_table_set(client_fd, FD_UNTRACED | FD_OWN);
+                serve_client(client_fd);
+                close(client_fd);
+        }
+error:
+        LOG(ERROR, "accept() failed. %s.", strerror(errno));
+        LOG(ERROR, "Control socket is down.");
+        return NULL;
+}
+
+/* Public functions */
+
+void start_control_thread(const char *logs_dir) {
+        struct sockaddr_un addr;
+        char *path;
+
+        if (!(path = alloc_concat_path(logs_dir, CONTROL_SOCK_NAME)))
+                goto error_out;
+        if (strlen(path) >= sizeof(addr.sun_path)) goto error1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        if ((control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+                goto error2;
+        // Spare the overrides, and survive fd table resets.
+        fd_table_set(control_fd, FD_UNTRACED | FD_OWN);
+        if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)))
+                goto error3;
+        if (listen(control_fd, CONTROL_BACKLOG)) goto error3;
+
+        control_path = path;
+        pthread_t thread;
+        my_pthread_create(&thread, NULL, control_thread, NULL);
+        return;
+error3:
+        LOG(ERROR, "bind() or listen() failed. %s.", strerror(errno));
+        close(control_fd);
+        control_fd = -1;
+        goto error_out1;
+error2:
+        LOG(ERROR, "socket() failed. %s.", strerror(errno));
+        goto error_out1;
+error1:
+        LOG(WARN, "Path too long for control socket: %s.", path);
+error_out1:
+        free(path);
+error_out:
+        LOG_FUNC_ERROR;
+        LOG(WARN, "No control socket.");
+}
+
+void stop_control(void) {
+        if (!control_path) return;
+        unlink(control_path);
+}
+
+/* In a forked child, the socket is the parent's: it is closed, and its path
+ * forgotten, so that the child does not unlink it at exit. The child gets its
+ * own at init. */
+void reset_control(void) {
+        if (control_fd >= 0) {
+                close(control_fd);
+                fd_table_clear(control_fd);
+                control_fd = -1;
+        }
+        free(control_path);
+        control_path = NULL;
+}
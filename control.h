@@ -0,0 +1,20 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/* Control socket, to reconfigure a traced process without restarting it. A
+ * unix stream socket is created at <logs_dir>/control.sock, and served by a
+ * background thread. It accepts one command per line:
+ *  - get: print the current options.
+ *  - set <opt> <val>: change option b, c, e, g, q, s, t or u. Option j, m or w
+ *    takes the rest of the line, which may be empty to remove the filter.
+ *  - flush: dump the events of all sockets now.
+ *  - record: write the packet flight recorders to pcap (see packet_sniffer.h)
+ *    and trigger the event recorders (see sock_events.h).
+ *  - dormant, activate: stop or resume tracing (see dormant.h).
+ * Each command is answered by a single line, starting with "ok" or "error". */
+
+void start_control_thread(const char *logs_dir);
+void stop_control(void);
+void reset_control(void);
+
+#endif
@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+
+#include "dormant.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include "fd_sweep.h"
+#include "fd_table.h"
+#include "lib.h"
+#include "logger.h"
+#include "sock_events.h"
+
+bool dormant_flag = false;
+
+static bool dormancy_initialized = false;  // Kept across fork().
+
+/* Private functions */
+
+/* Sampling and filter decisions were taken on fds that may have been closed
+ * and reused while dormant. Only plain stores, safe in a signal handler. */
+static void activate(void) {
+        fd_table_reset(FD_OWN);
+        request_fd_sweep();
+        __atomic_store_n(&dormant_flag, false, __ATOMIC_RELAXED);
+}
+
+static void activation_handler(int sig) {
+        UNUSED(sig);
+        if (IS_DORMANT()) activate();
+}
+
+/* Public functions */
+
+void init_dormancy(long sig) {
+        if (dormancy_initialized || sig < 0) return;
+        dormancy_initialized = true;
+        if (sig >= NSIG) goto error1;
+        if (sig) {
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = activation_handler;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                if (sigaction(sig, &sa, NULL)) goto error2;
+        }
+        __atomic_store_n(&dormant_flag, true, __ATOMIC_RELAXED);
+        LOG(INFO, "Dormant until signal %ld or control command.", sig);
+        return;
+error2:
+        LOG(ERROR, "sigaction() failed. %s.", strerror(errno));
+        goto error_out;
+error1:
+        LOG(ERROR, "Invalid signal %ld.", sig);
+error_out:
+        LOG_FUNC_ERROR;
+        LOG(WARN, "Not dormant, tracing right away.");
+}
+
+void set_dormant(bool enable) {
+        if (enable == IS_DORMANT()) return;
+        if (!enable) {
+                activate();
+                run_requested_fd_sweep();  // Off the application threads.
+                LOG(INFO, "Tracing activated.");
+                return;
+        }
+        // New calls take the fast path from now on. A call already past the
+        // check may still leave a socket behind, as when close() races with
+        // another call on the same fd.
+        __atomic_store_n(&dormant_flag, true, __ATOMIC_RELAXED);
+        sock_ev_forget_all();
+        LOG(INFO, "Tracing is dormant.");
+}
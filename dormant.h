@@ -0,0 +1,19 @@
+#ifndef DORMANT_H
+#define DORMANT_H
+
+#include <stdbool.h>
+
+/* Dormant mode, set with -i. The lib stays preloaded but traces nothing: the
+ * libc overrides only load this flag before calling the original function.
+ * Tracing is activated by the signal given to -i, or through the control
+ * socket. Sockets opened meanwhile are then found by a sweep, see fd_sweep.h.
+ * Going dormant again dumps and forgets all sockets. */
+
+extern bool dormant_flag;
+
+#define IS_DORMANT() __atomic_load_n(&dormant_flag, __ATOMIC_RELAXED)
+
+void init_dormancy(long sig);
+void set_dormant(bool enable);
+
+#endif
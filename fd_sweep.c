@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+
+#include "fd_sweep.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "dormant.h"
+#include "fd_table.h"
+#include "lib.h"
+#include "logger.h"
+#include "overhead.h"
+#include "sock_diag.h"
+#include "timestamp.h"
+
+typedef struct {
+        SweptFd *fds;  // Sorted by inode.
+        int count;
+} SweptFds;
+
+static SweptFd *load_fds = NULL;  // Listed at load, taken at init.
+static int load_count = 0;
+static int load_others = 0;  // Fds flagged FD_NOT_INET at load.
+static bool sweep_requested = false;
+
+/* Private functions */
+
+static int compare_inodes(const void *a, const void *b) {
+        ino_t ia = ((const SweptFd *)a)->inode;
+        ino_t ib = ((const SweptFd *)b)->inode;
+        return (ia > ib) - (ia < ib);
+}
+
+static bool add_fd(SweptFd **fds, int *count, int *size, int fd, ino_t ino) {
+        if (*count == *size) {
+                int new_size = *size ? *size * 2 : 16;
+                SweptFd *new_fds = realloc(*fds, new_size * sizeof(SweptFd));
+                if (!new_fds) return false;
+                *fds = new_fds;
+                *size = new_size;
+        }
+        SweptFd *swept = &(*fds)[(*count)++];
+        memset(swept, 0, sizeof(SweptFd));
+        swept->fd = fd;
+        swept->inode = ino;
+        return true;
+}
+
+/* Sockets open in the process, but unknown to the fd table. Other fds are
+ * flagged on the way, and counted in *others. Returns -1 on error, with *fds
+ * to be freed anyway. */
+static int list_socket_fds(SweptFd **fds, int *others) {
+        int count = 0, size = 0;
+        *fds = NULL;
+        *others = 0;
+        DIR *dir = opendir("/proc/self/fd");
+        if (!dir) goto error1;
+        int dir_fd = dirfd(dir);
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+                char *end;
+                long fd = strtol(entry->d_name, &end, 10);
+                if (*end || end == entry->d_name || fd == dir_fd) continue;
+                if (fd_table_get(fd)) continue;  // Known already.
+                struct stat st;
+                if (fstatat(dir_fd, entry->d_name, &st, 0)) continue;  // Gone.
+                if (!S_ISSOCK(st.st_mode)) {
+                        fd_table_set(fd, FD_NOT_INET);
+                        (*others)++;
+                } else if (!add_fd(fds, &count, &size, fd, st.st_ino))
+                        goto error2;
+        }
+        closedir(dir);
+        return count;
+error2:
+        closedir(dir);
+        LOG(ERROR, "realloc() failed.");
+        goto error_out;
+error1:
+        LOG(ERROR, "opendir() failed. %s.", strerror(errno));
+error_out:
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+static void classify_from_sock_diag(const SockDiagEntry *entry, void *arg) {
+        SweptFds *swept = (SweptFds *)arg;
+        SweptFd key = {.inode = entry->inode};
+        SweptFd *fd = (SweptFd *)bsearch(&key, swept->fds, swept->count,
+                                         sizeof(SweptFd), compare_inodes);
+        if (!fd || fd->sock_info.filled) return;
+        fd->sock_info.domain = entry->family;
+        fd->sock_info.type =
+            entry->protocol == IPPROTO_TCP ? SOCK_STREAM : SOCK_DGRAM;
+        fd->sock_info.protocol = entry->protocol;
+        fd->sock_info.filled = true;
+}
+
+// Fds closed or reused since listed are dropped.
+static int drop_stale_fds(SweptFd *fds, int count) {
+        int kept = 0;
+        struct stat st;
+        for (int i = 0; i < count; i++)
+                if (!fstat(fds[i].fd, &st) && st.st_ino == fds[i].inode)
+                        fds[kept++] = fds[i];
+        return kept;
+}
+
+static void ghost_sockets(SweptFd *fds, int count, int others) {
+        uint64_t start = get_time_ns();
+        count = drop_stale_fds(fds, count);
+        if (count >= FD_SWEEP_DIAG_MIN) {
+                SweptFds swept = {fds, count};
+                qsort(fds, count, sizeof(SweptFd), compare_inodes);
+                sock_diag_dump(IPPROTO_TCP, classify_from_sock_diag, &swept);
+                sock_diag_dump(IPPROTO_UDP, classify_from_sock_diag, &swept);
+        }
+        sock_ev_ghost_sockets(fds, count);
+        LOG(INFO, "%d sockets found open, %d other fds.", count, others);
+        overhead_add(OVERHEAD_CLASSIFY, get_time_ns() - start);
+}
+
+/* Public functions */
+
+// Called before tracing is initialized, sockets are thus only listed.
+void fd_sweep_at_load(void) {
+        int count = list_socket_fds(&load_fds, &load_others);
+        if (count > 0) {
+                load_count = count;
+                return;
+        }
+        free(load_fds);
+        load_fds = NULL;
+}
+
+void fd_sweep_at_init(void) {
+        SweptFd *fds = load_fds;
+        int count = load_count;
+        load_fds = NULL;
+        load_count = 0;
+        // Once activated, sockets are listed again, see request_fd_sweep().
+        if (count && !IS_DORMANT()) ghost_sockets(fds, count, load_others);
+        free(fds);
+}
+
+/* Called when tracing is activated. Only a plain store, safe in a signal
+ * handler. The sweep is run by the first call to find a ghost socket. */
+void request_fd_sweep(void) {
+        __atomic_store_n(&sweep_requested, true, __ATOMIC_RELAXED);
+}
+
+// Returns true if a sweep was requested and run.
+bool run_requested_fd_sweep(void) {
+        if (!__atomic_load_n(&sweep_requested, __ATOMIC_RELAXED)) return false;
+        if (!__atomic_exchange_n(&sweep_requested, false, __ATOMIC_ACQ_REL))
+                return false;  // Run by another thread.
+        SweptFd *fds;
+        int others;
+        int count = list_socket_fds(&fds, &others);
+        if (count > 0) ghost_sockets(fds, count, others);
+        free(fds);
+        return true;
+}
@@ -0,0 +1,29 @@
+#ifndef FD_SWEEP_H
+#define FD_SWEEP_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "sock_events.h"
+
+/* Sockets opened before tracing, i.e. inherited, received before the first
+ * call, or opened while dormant, are otherwise found one at a time as ghost
+ * sockets on their first call, which then pays for their classification.
+ * Instead, /proc/self/fd is listed at load, and again when tracing is
+ * activated. The sockets are classified in one batch, with sock_diag dumps
+ * when there are many of them (see sock_diag.h), and added as ghosts. Other
+ * fds are flagged FD_NOT_INET in the fd table. */
+
+#define FD_SWEEP_DIAG_MIN 32  // Fewer sockets are classified with getsockopt().
+
+struct SweptFd {
+        int fd;
+        ino_t inode;
+        SockInfo sock_info;  // Filled if found by sock_diag.
+};
+
+void fd_sweep_at_load(void);
+void fd_sweep_at_init(void);
+void request_fd_sweep(void);
+bool run_requested_fd_sweep(void);
+
+#endif
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+
+#include "fd_table.h"
+#include <stdlib.h>
+#include "lib.h"
+
+#define CHUNKS (FD_TABLE_MAX / FD_TABLE_SIZE)
+
+typedef struct {
+        unsigned char flags[FD_TABLE_SIZE];
+        int ids[FD_TABLE_SIZE];  // Valid if FD_TRACED is set.
+} FdChunk;
+
+static FdChunk first_chunk;
+static FdChunk *chunks[CHUNKS] = {&first_chunk};  // Never freed.
+
+/* Chunk of fd, allocated on its first flag if [alloc]. NULL if not allocated,
+ * in which case the fd has no flag. */
+static FdChunk *get_chunk(int fd, bool alloc) {
+        if (fd >= 0 && fd < FD_TABLE_SIZE) return &first_chunk;
+        if (fd < 0 || fd >= FD_TABLE_MAX) return NULL;
+        FdChunk **slot = &chunks[fd / FD_TABLE_SIZE];
+        FdChunk *chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (chunk || !alloc) return chunk;
+        FdChunk *new_chunk = (FdChunk *)my_calloc(sizeof(FdChunk));
+        if (!new_chunk) return NULL;
+        if (__atomic_compare_exchange_n(slot, &chunk, new_chunk, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return new_chunk;
+        free(new_chunk);  // Allocated by another thread.
+        return chunk;
+}
+
+/* Public functions */
+
+void fd_table_set(int fd, unsigned char flags) {
+        FdChunk *chunk = get_chunk(fd, true);
+        if (!chunk) return;
+        __atomic_or_fetch(&chunk->flags[fd % FD_TABLE_SIZE], flags,
+                          __ATOMIC_RELAXED);
+}
+
+void fd_table_clear(int fd) {
+        FdChunk *chunk = get_chunk(fd, false);
+        if (!chunk) return;
+        __atomic_store_n(&chunk->flags[fd % FD_TABLE_SIZE], 0,
+                         __ATOMIC_RELAXED);
+}
+
+unsigned char fd_table_get(int fd) {
+        FdChunk *chunk = get_chunk(fd, false);
+        if (!chunk) return 0;
+        return __atomic_load_n(&chunk->flags[fd % FD_TABLE_SIZE],
+                               __ATOMIC_RELAXED);
+}
+
+// Clear all fds, except those flagged with one of the [keep] flags.
+void fd_table_reset(unsigned char keep) {
+        for (int fd = 0; fd < fd_table_end(); fd++)
+                if (!(fd_table_get(fd) & keep)) fd_table_clear(fd);
+}
+
+// Fds from there have no flag, for the loops over the table.
+int fd_table_end(void) {
+        int end = FD_TABLE_MAX;
+        while (end > FD_TABLE_SIZE &&
+               !__atomic_load_n(&chunks[end / FD_TABLE_SIZE - 1],
+                                __ATOMIC_ACQUIRE))
+                end -= FD_TABLE_SIZE;
+        return end;
+}
+
+bool is_fd_untraced(int fd) { return fd_table_get(fd) & FD_UNTRACED; }
+
+void fd_table_set_traced(int fd, int id) {
+        FdChunk *chunk = get_chunk(fd, true);
+        if (!chunk) return;
+        __atomic_store_n(&chunk->ids[fd % FD_TABLE_SIZE], id,
+                         __ATOMIC_RELAXED);
+        __atomic_or_fetch(&chunk->flags[fd % FD_TABLE_SIZE], FD_TRACED,
+                          __ATOMIC_RELEASE);
+}
+
+void fd_table_clear_traced(int fd) {
+        FdChunk *chunk = get_chunk(fd, false);
+        if (!chunk) return;
+        __atomic_and_fetch(&chunk->flags[fd % FD_TABLE_SIZE], ~FD_TRACED,
+                           __ATOMIC_RELAXED);
+}
+
+// Id of the socket traced on fd, -1 if not cached.
+int fd_table_get_id(int fd) {
+        FdChunk *chunk = get_chunk(fd, false);
+        if (!chunk) return -1;
+        if (!(__atomic_load_n(&chunk->flags[fd % FD_TABLE_SIZE],
+                              __ATOMIC_ACQUIRE) &
+              FD_TRACED))
+                return -1;
+        return __atomic_load_n(&chunk->ids[fd % FD_TABLE_SIZE],
+                               __ATOMIC_RELAXED);
+}
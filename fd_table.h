@@ -0,0 +1,36 @@
+#ifndef FD_TABLE_H
+#define FD_TABLE_H
+
+#include <stdbool.h>
+
+/* Lock-free per-fd flags, checked by the libc overrides before anything else.
+ * A flagged fd is skipped at the cost of a single load. The table holds the
+ * first FD_TABLE_SIZE fds, the others are held in chunks of as many fds,
+ * allocated on their first flag. Fds above FD_TABLE_MAX, the default limit of
+ * the kernel, are never flagged and always take the normal path.
+ *
+ * The table also caches the classification of fds: traced sockets are flagged
+ * FD_TRACED along with their socket id, other fds FD_NOT_INET. Both are
+ * cleared when the fd is closed by close(), fclose(), close_range() or
+ * closefrom(), or reused through an override. A traced fd closed by a raw
+ * syscall is only dropped once a call on it fails with EBADF or ENOTSOCK. */
+
+#define FD_TABLE_SIZE 65536
+#define FD_TABLE_MAX (16 * FD_TABLE_SIZE)
+
+#define FD_UNTRACED 0x1  // Socket not sampled, filtered out or our own.
+#define FD_OWN 0x2       // Our own fd, kept when the table is reset.
+#define FD_TRACED 0x4    // Traced socket, see fd_table_get_id().
+#define FD_NOT_INET 0x8  // Not an AF_INET/AF_INET6 socket.
+
+void fd_table_set(int fd, unsigned char flags);
+void fd_table_clear(int fd);
+unsigned char fd_table_get(int fd);
+void fd_table_reset(unsigned char keep);
+int fd_table_end(void);
+bool is_fd_untraced(int fd);
+void fd_table_set_traced(int fd, int id);
+void fd_table_clear_traced(int fd);
+int fd_table_get_id(int fd);
+
+#endif
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+
+#include "governor.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dormant.h"
+#include "init.h"
+#include "lib.h"
+#include "logger.h"
+#include "overhead.h"
+#include "string_builders.h"
+#include "timestamp.h"
+
+#define GOVERNOR_FILE "governor.txt"
+
+GovLevel governor_level = GOV_FULL;
+
+static bool governor_started = false;
+
+/* Private functions */
+
+static uint64_t get_cpu_time_ns(void) {
+        struct timespec ts;
+        if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts)) goto error;
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+error:
+        LOG(ERROR, "clock_gettime() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return 0;
+}
+
+static uint64_t get_overhead_ns(void) {
+        return overhead_get_ns(OVERHEAD_CLASSIFY) +
+               overhead_get_ns(OVERHEAD_HOOK) +
+               overhead_get_ns(OVERHEAD_TCP_INFO);
+}
+
+static void record_transition(GovLevel from, GovLevel to, long permille) {
+        char *path, buf[256];
+        LOG(WARN, "Governor: %s to %s, overhead at %ld permille.",
+            string_from_gov_level(from), string_from_gov_level(to), permille);
+        if (!logs_dir_path) return;
+        if (!(path = alloc_concat_path(logs_dir_path, GOVERNOR_FILE)))
+                goto error;
+        snprintf(buf, sizeof(buf),
+                 "{\"timestamp_ns\": %llu, \"from\": \"%s\", \"to\": \"%s\", "
+                 "\"overhead_permille\": %ld}\n",
+                 (unsigned long long)get_time_ns(), string_from_gov_level(from),
+                 string_from_gov_level(to), permille);
+        append_string_to_file(buf, path);
+        free(path);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+static GovLevel step(GovLevel level, bool down) {
+        GovLevel next = down ? level + 1 : level - 1;
+#ifdef TCPSNITCH_LEAN
+        if (next == GOV_COUNTERS) next = down ? GOV_DORMANT : GOV_SAMPLED;
+#endif
+        return next;
+}
+
+static void set_level(GovLevel level, long permille) {
+        GovLevel old = GOVERNOR_LEVEL();
+        if (level == old) return;
+        __atomic_store_n(&governor_level, level, __ATOMIC_RELAXED);
+        if (level == GOV_DORMANT) set_dormant(true);
+        if (old == GOV_DORMANT) set_dormant(false);
+        record_transition(old, level, permille);
+}
+
+/* opt_g may be changed at runtime through the control socket, it is thus read
+ * at each window. 0 restores full tracing and idles the governor. */
+static void *governor_thread(void *arg) {
+        UNUSED(arg);
+        LOG_FUNC_INFO;
+        struct timespec window = {GOVERNOR_WINDOW_MS / 1000,
+                                  (GOVERNOR_WINDOW_MS % 1000) * 1000000};
+        uint64_t cpu = get_cpu_time_ns(), overhead = get_overhead_ns();
+        int calm_windows = 0;
+        while (true) {
+                nanosleep(&window, NULL);
+                uint64_t new_cpu = get_cpu_time_ns();
+                uint64_t new_overhead = get_overhead_ns();
+                uint64_t cpu_ns = new_cpu - cpu;
+                long permille =
+                    cpu_ns ? (new_overhead - overhead) * 1000 / cpu_ns : 0;
+                cpu = new_cpu;
+                overhead = new_overhead;
+
+                long budget = __atomic_load_n(&conf_opt_g, __ATOMIC_RELAXED);
+                GovLevel level = GOVERNOR_LEVEL();
+                if (!budget) {
+                        set_level(GOV_FULL, permille);
+                        calm_windows = 0;
+                } else if (permille > budget * 10) {
+                        if (level != GOV_DORMANT)
+                                set_level(step(level, true), permille);
+                        calm_windows = 0;
+                } else if (permille < budget * 5 && level != GOV_FULL) {
+                        // Also when dormant, to find out whether load dropped.
+                        if (++calm_windows < GOVERNOR_CALM_WINDOWS) continue;
+                        set_level(step(level, false), permille);
+                        calm_windows = 0;
+                } else
+                        calm_windows = 0;
+        }
+        // Unreachable
+        return NULL;
+}
+
+/* Public functions */
+
+void start_governor_thread(void) {
+        if (__atomic_exchange_n(&governor_started, true, __ATOMIC_ACQ_REL))
+                return;  // Already running.
+        pthread_t thread;
+        my_pthread_create(&thread, NULL, governor_thread, NULL);
+}
+
+void reset_governor(void) {
+        governor_started = false;  // Threads do not survive fork().
+}
+
+const char *string_from_gov_level(GovLevel level) {
+        static const char *strings[] = {"full", "sampled", "counters",
+                                        "dormant"};
+        return strings[level];
+}
@@ -0,0 +1,32 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stdbool.h>
+
+/* Overhead governor, set with -g <pct>. A background thread compares, over
+ * windows of GOVERNOR_WINDOW_MS, the time spent in the lib (see overhead.h) to
+ * the CPU time of the process. Over <pct> percent, tracing steps down one
+ * level. Under half of it for GOVERNOR_CALM_WINDOWS windows in a row, it steps
+ * back up. Transitions are written to governor.txt, one JSON object per line.
+ * The lean build only counts events and thus skips GOV_COUNTERS. */
+
+#define GOVERNOR_WINDOW_MS 1000
+#define GOVERNOR_CALM_WINDOWS 5
+#define GOVERNOR_SAMPLING 10  // 1 new socket in 10 is traced, at least.
+
+typedef enum {
+        GOV_FULL,      // As configured.
+        GOV_SAMPLED,   // New sockets sampled, see GOVERNOR_SAMPLING.
+        GOV_COUNTERS,  // Only structural events, bytes & dropped counters.
+        GOV_DORMANT    // See dormant.h.
+} GovLevel;
+
+extern GovLevel governor_level;
+
+#define GOVERNOR_LEVEL() __atomic_load_n(&governor_level, __ATOMIC_RELAXED)
+
+void start_governor_thread(void);
+void reset_governor(void);
+const char *string_from_gov_level(GovLevel level);
+
+#endif
@@ -12,19 +12,44 @@
 #include <android/log.h>
 #include <sys/system_properties.h>
 #endif
+#include "control.h"
+#include "dormant.h"
+#include "fd_sweep.h"
+#include "governor.h"
 #include "lib.h"
 #include "logger.h"
+#include "loop_lag.h"
+#include "mux_events.h"
+#include "overhead.h"
+#ifndef TCPSNITCH_LEAN
+#include "packet_sniffer.h"
+#endif
+#include "sock_diag.h"
 #include "sock_events.h"
+#include "sock_filter.h"
 #include "string_builders.h"
+#include "tcp_sampler.h"
+#include "timestamp.h"
 
 long conf_opt_b;
 long conf_opt_c;
 char *conf_opt_d;
+long conf_opt_e;
 long conf_opt_f;
+long conf_opt_g;
+long conf_opt_i;
+char *conf_opt_j;
 long conf_opt_l;
+char *conf_opt_m;
+char *conf_opt_o;
+long conf_opt_q;
+long conf_opt_r;
+long conf_opt_s;
 long conf_opt_u;
 long conf_opt_t;
 long conf_opt_v;
+char *conf_opt_w;
+char *conf_opt_x;
 
 char *logs_dir_path;
 
@@ -34,6 +59,7 @@ FILE *_stderr;
 #endif
 
 static bool initialized = false;
+static bool dumper_started = false;
 
 #ifdef __ANDROID__
 static pthread_mutex_t init_mutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER;
@@ -89,14 +115,16 @@ error_out:
 
 static void tcpsnitch_free(void) {
         free(conf_opt_d);
+        free(conf_opt_j);
+        free(conf_opt_m);
+        free(conf_opt_o);
+        free(conf_opt_w);
+        free(conf_opt_x);
         free(logs_dir_path);
 #ifndef __ANDROID__
-        if (_stdout) fclose(_stdout);
-        if (_stderr) fclose(_stderr);
+        if (_stdout) my_fclose(_stdout);
+        if (_stderr) my_fclose(_stderr);
 #endif
-        // We don't check for errors on this one. This is called after fork()
-        // will logically fail if the mutex was locked at the time of forking.
-        pthread_mutex_destroy(&init_mutex);
 }
 
 #ifndef __ANDROID__
@@ -109,6 +137,15 @@ static void open_std_streams(void) {
 }
 #endif
 
+/* -i is usually unset. Unlike other options, this does not warn about it. */
+static long get_signal_opt(void) {
+        char *str = alloc_optional_str_opt(OPT_I);
+        if (!str) return -1;  // Not dormant.
+        long sig = parse_long(str);
+        free(str);
+        return sig;
+}
+
 static void get_options(void) {
         conf_opt_b = get_long_opt_or_defaultval(OPT_B, 4096);
 #ifdef __ANDROID__
@@ -116,12 +153,31 @@ static void get_options(void) {
 #else
         conf_opt_c = get_long_opt_or_defaultval(OPT_C, 0);
         conf_opt_d = alloc_str_opt(OPT_D);
+        conf_opt_o = alloc_optional_str_opt(OPT_O);
+        conf_opt_x = alloc_optional_str_opt(OPT_X);
 #endif
+        conf_opt_e = get_long_opt_or_defaultval(OPT_E, 0);
         conf_opt_f = get_long_opt_or_defaultval(OPT_F, WARN);
+        conf_opt_g = get_long_opt_or_defaultval(OPT_G, 0);
+        conf_opt_i = get_signal_opt();
+        conf_opt_j = alloc_optional_str_opt(OPT_J);
         conf_opt_l = get_long_opt_or_defaultval(OPT_L, WARN);
+        conf_opt_m = alloc_optional_str_opt(OPT_M);
+        conf_opt_q = get_long_opt_or_defaultval(OPT_Q, 0);
+        conf_opt_r = get_long_opt_or_defaultval(OPT_R, 0);
+        conf_opt_s = get_long_opt_or_defaultval(OPT_S, 0);
         conf_opt_t = get_long_opt_or_defaultval(OPT_T, 1000);
         conf_opt_u = get_long_opt_or_defaultval(OPT_U, 0);
         conf_opt_v = get_long_opt_or_defaultval(OPT_V, 0);
+        conf_opt_w = alloc_optional_str_opt(OPT_W);
+#ifdef TCPSNITCH_LEAN
+        if (conf_opt_c || conf_opt_q || conf_opt_v)
+                LOG(WARN, "No capture, event recorder nor verbose mode in the "
+                          "lean build.");
+        conf_opt_c = 0;
+        conf_opt_q = 0;
+        conf_opt_v = 0;
+#endif
 }
 
 static void log_options(void) {
@@ -130,11 +186,26 @@ static void log_options(void) {
         LOG(INFO, "Option c: %lu.", conf_opt_c);
 #endif
         LOG(INFO, "Option d: %s", conf_opt_d);
+        LOG(INFO, "Option e: %lu.", conf_opt_e);
         LOG(INFO, "Option f: %lu.", conf_opt_f);
+        LOG(INFO, "Option g: %lu.", conf_opt_g);
+        LOG(INFO, "Option i: %ld.", conf_opt_i);
+        LOG(INFO, "Option j: %s", conf_opt_j ? conf_opt_j : "none");
         LOG(INFO, "Option l: %lu.", conf_opt_l);
+        LOG(INFO, "Option m: %s", conf_opt_m ? conf_opt_m : "none");
+#ifndef __ANDROID__
+        LOG(INFO, "Option o: %s", conf_opt_o ? conf_opt_o : "none");
+#endif
+        LOG(INFO, "Option q: %lu.", conf_opt_q);
+        LOG(INFO, "Option r: %lu.", conf_opt_r);
+        LOG(INFO, "Option s: %lu.", conf_opt_s);
         LOG(INFO, "Option t: %lu.", conf_opt_t);
         LOG(INFO, "Option u: %lu.", conf_opt_u);
         LOG(INFO, "Option v: %lu.", conf_opt_v);
+        LOG(INFO, "Option w: %s", conf_opt_w ? conf_opt_w : "all");
+#ifndef __ANDROID__
+        LOG(INFO, "Option x: %s", conf_opt_x ? conf_opt_x : "none");
+#endif
 }
 
 static void init_logs(void) {
@@ -149,16 +220,21 @@ error:
         LOG(ERROR, "No logs to file.");
 }
 
+/* opt_t may be changed at runtime through the control socket, it is thus read
+ * again after each dump. 0 suspends dumping. */
 static void *json_dumper_thread(void *arg) {
         UNUSED(arg);
         LOG_FUNC_INFO;
 
         struct timespec time;
-        time.tv_sec = conf_opt_t / 1000;
-        time.tv_nsec = (conf_opt_t % 1000) * 1000 * 1000;  // opt_t is in ms
-
         while (true) {
-                dump_all_sock_events();
+                long period = __atomic_load_n(&conf_opt_t, __ATOMIC_RELAXED);
+                if (period)
+                        dump_all_sock_events();
+                else
+                        period = 1000;
+                time.tv_sec = period / 1000;
+                time.tv_nsec = (period % 1000) * 1000 * 1000;  // opt_t is in ms
                 nanosleep(&time, NULL);
         }
         // Unreachable
@@ -166,10 +242,48 @@ static void *json_dumper_thread(void *arg) {
 }
 
 void start_json_dumper_thread(void) {
+        if (__atomic_exchange_n(&dumper_started, true, __ATOMIC_ACQ_REL))
+                return;  // Already running.
         pthread_t thread;
         my_pthread_create(&thread, NULL, json_dumper_thread, NULL);
 }
 
+/* fork() handlers, see pthread_atfork(). Unlike the fork() override, they also
+ * run for the forks made within the libc, such as daemon(). Locks are taken in
+ * the order they nest in: sock_diag dumps lock the sockets, which are locked
+ * around the sampler queue, mux list, lag stats and filters. */
+static void prepare_fork(void) {
+        mutex_lock(&init_mutex);
+        sock_diag_prepare_fork();
+        sock_ev_prepare_fork();
+#ifndef TCPSNITCH_LEAN
+        capture_prepare_fork();
+#endif
+        tcp_sampler_prepare_fork();
+        mux_ev_prepare_fork();
+        loop_lag_prepare_fork();
+        filter_prepare_fork();
+        // Buffered output would otherwise be written by both processes.
+        logger_flush();
+#ifndef __ANDROID__
+        if (_stdout) fflush(_stdout);
+        if (_stderr) fflush(_stderr);
+#endif
+}
+
+static void parent_after_fork(void) {
+        filter_parent_after_fork();
+        loop_lag_parent_after_fork();
+        mux_ev_parent_after_fork();
+        tcp_sampler_parent_after_fork();
+#ifndef TCPSNITCH_LEAN
+        capture_parent_after_fork();
+#endif
+        sock_ev_parent_after_fork();
+        sock_diag_parent_after_fork();
+        mutex_unlock(&init_mutex);
+}
+
 /* Public functions */
 
 /*  This function is used to reset the library after a fork() call. If a fork()
@@ -177,12 +291,24 @@ void start_json_dumper_thread(void) {
  *  However, we would like to distinguish the traces by process. */
 
 void reset_tcpsnitch(void) {
-        if (!initialized) return;  // Nothing to do.
+        // Held across fork(), see prepare_fork().
+        mutex_init(&init_mutex);
+        sock_ev_reset();
+#ifndef TCPSNITCH_LEAN
+        reset_packet_sniffer();
+#endif
+        // Also held across fork(), even before init.
+        mux_ev_reset();
+        loop_lag_reset();
+        reset_tcp_sampler();
+        filter_reset();
+        if (!initialized) return;  // Nothing else to do.
         tcpsnitch_free();
         logger_init(NULL, WARN, WARN);
         initialized = false;
-        mutex_init(&init_mutex);
-        sock_ev_reset();
+        dumper_started = false;  // Threads do not survive fork().
+        reset_governor();
+        reset_control();
 }
 
 void init_tcpsnitch(void) {
@@ -193,11 +319,29 @@ void init_tcpsnitch(void) {
         open_std_streams();
 #endif
         get_options();
+        init_timestamps(conf_opt_r);
+        init_dormancy(conf_opt_i);
         if (!conf_opt_d) goto exit1;
         if (!(logs_dir_path = create_logs_dir_at_path(conf_opt_d))) goto exit1;
         init_logs();
         log_options();
+        filter_compile(conf_opt_m);
+        filter_events_compile(conf_opt_w);
+        filter_triggers_compile(conf_opt_j);
+#ifndef TCPSNITCH_LEAN
+        // The flight recorder is a capture, which writes on triggers only.
+        if (conf_opt_x && capture_set_recorder(conf_opt_x)) conf_opt_c = 1;
+        if (conf_opt_c) {
+                capture_set_budgets(conf_opt_o);
+                capture_prewarm();
+        }
+#endif
+        dump_clock_anchor(logs_dir_path);
         if (conf_opt_t) start_json_dumper_thread();
+        if (conf_opt_g) start_governor_thread();
+        if (conf_opt_b || conf_opt_u) start_tcp_sampler_thread();
+        start_control_thread(logs_dir_path);
+        fd_sweep_at_init();
         goto exit;
 exit1:
         LOG(ERROR, "Nothing will be written to file (log, pcap, json).");
@@ -207,9 +351,26 @@ exit:
         return;
 }
 
+/* Tracing is initialized on the first call on a socket. The sockets already
+ * open are however listed right away, see fd_sweep.h. A dormant process must
+ * also set up its signal handler and control socket. */
+__attribute__((constructor)) static void init_at_load(void) {
+        pthread_atfork(prepare_fork, parent_after_fork, reset_tcpsnitch);
+        fd_sweep_at_load();
+        if (get_signal_opt() >= 0) init_tcpsnitch();
+}
+
 __attribute__((destructor)) static void cleanup(void) {
         LOG(INFO, "Performing library cleanup before end of process.");
+        stop_control();
+#ifndef TCPSNITCH_LEAN
+        capture_flush();
+#endif
         dump_all_sock_events();
+        sock_ev_log_stats();
+        mux_ev_log_stats();
+        sock_ev_dump_overhead();
+        dump_overhead_summary(logs_dir_path);
         // tcp_free();
         // tcpsnitch_free();
 }
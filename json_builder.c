@@ -10,6 +10,7 @@
 #include "logger.h"
 #include "string.h"
 #include "string_builders.h"
+#include "timestamp.h"
 #include "sys/epoll.h"
 
 static json_t *my_json_object(void) {
@@ -65,13 +66,12 @@ static json_t *build_sock_info(const SockInfo *sock_info) {
         return json_si;
 }
 
-static json_t *build_addr(const Addr *addr) {
-        if (!addr->len) return NULL;
+static json_t *build_sockaddr(const struct sockaddr *sockaddr,
+                              socklen_t len) {
+        if (!len) return NULL;
 
         json_t *json_addr = my_json_object();
 
-        const struct sockaddr *sockaddr =
-            (const struct sockaddr *)&addr->sockaddr_sto;
         if (sockaddr->sa_family == AF_INET)
                 add(json_addr, "sa_family", json_string("AF_INET"));
         else if (sockaddr->sa_family == AF_INET6)
@@ -85,7 +85,7 @@ static json_t *build_addr(const Addr *addr) {
         free(port);
 
         // char *hostname, *service;
-        // alloc_name_str(sockaddr, addr->len, &hostname, &service);
+        // alloc_name_str(sockaddr, len, &hostname, &service);
         // add(json_addr, "hostname", json_string(hostname));
         // add(json_addr, "service", json_string(service));
         // free(hostname);
@@ -94,6 +94,25 @@ static json_t *build_addr(const Addr *addr) {
         return json_addr;
 }
 
+static json_t *build_addr(const Addr *addr) {
+        return build_sockaddr((const struct sockaddr *)&addr->sockaddr_sto,
+                              addr->len);
+}
+
+/* Interned addresses are written in full by the first event referencing them
+ * in the trace file. Later events only carry the addr_id. */
+static void add_addr_ref(json_t *json_details, AddrTable *addrs,
+                         uint16_t addr_id) {
+        AddrEntry *entry = addr_table_get(addrs, addr_id);
+        if (!entry) return;
+        add(json_details, "addr_id", json_integer(addr_id));
+        if (entry->dumped) return;
+        add(json_details, "addr",
+            build_sockaddr((const struct sockaddr *)&entry->sockaddr_sto,
+                           entry->len));
+        entry->dumped = true;
+}
+
 static json_t *build_send_flags(int flags) {
         json_t *json_flags = my_json_object();
         add(json_flags, "MSG_CONFIRM", json_boolean(flags & MSG_CONFIRM));
@@ -132,26 +151,6 @@ static json_t *build_timeout(const Timeout *timeout) {
         return json_timeout;
 }
 
-static json_t *build_poll_events(const PollEvents *events) {
-        json_t *json_events = my_json_object();
-        add(json_events, "POLLIN", json_boolean(events->pollin));
-        add(json_events, "POLLPRI", json_boolean(events->pollpri));
-        add(json_events, "POLLOUT", json_boolean(events->pollout));
-        add(json_events, "POLLRDHUP", json_boolean(events->pollrdhup));
-        add(json_events, "POLLERR", json_boolean(events->pollerr));
-        add(json_events, "POLLHUP", json_boolean(events->pollhup));
-        add(json_events, "POLLNVAL", json_boolean(events->pollnval));
-        return json_events;
-}
-
-static json_t *build_select_events(const SelectEvents *events) {
-        json_t *json_events = my_json_object();
-        add(json_events, "READ", json_boolean(events->read));
-        add(json_events, "WRITE", json_boolean(events->write));
-        add(json_events, "EXCEPT", json_boolean(events->except));
-        return json_events;
-}
-
 static json_t *build_epoll_events(uint32_t events) {
         json_t *json_events = my_json_object();
         add(json_events, "EPOLLIN", json_boolean(events & EPOLLIN));
@@ -177,30 +176,43 @@ static json_t *build_iovec(const Iovec *iovec) {
         return json_iovec;
 }
 
-static json_t *build_control_data(struct msghdr *msgh) {
-        json_t *json_cd_list = my_json_array();
-        // TODO: Can't find where the problem is... Can't properly extract the
-        // ancillary data.
-        struct cmsghdr *cmsg;
-        cmsg = CMSG_FIRSTHDR(msgh);
-        if (cmsg) {
-                json_t *json_cd = my_json_object();
-                add(json_cd, "cmsg_level", json_integer(cmsg->cmsg_level));
-                add(json_cd, "cmsg_type", json_integer(cmsg->cmsg_type));
-                json_array_append_new(json_cd_list, json_cd);
+static json_t *build_pktinfo(const CmsgSummary *cmsg) {
+        json_t *json_pktinfo = my_json_object();
+        add(json_pktinfo, "ifindex", json_integer(cmsg->pktinfo_ifindex));
+        char str[INET6_ADDRSTRLEN];
+        if (inet_ntop(cmsg->pktinfo_family, cmsg->pktinfo_addr, str,
+                      sizeof(str)))
+                add(json_pktinfo, "addr", json_string(str));
+        return json_pktinfo;
+}
+
+static json_t *build_control_data(const CmsgSummary *cmsg) {
+        json_t *json_cd = my_json_object();
+        add(json_cd, "cmsg_count", json_integer(cmsg->cmsg_count));
+        if (cmsg->rights_fds)
+                add(json_cd, "SCM_RIGHTS", json_integer(cmsg->rights_fds));
+        if (cmsg->udp_segment)
+                add(json_cd, "UDP_SEGMENT", json_integer(cmsg->udp_segment));
+        if (cmsg->udp_gro)
+                add(json_cd, "UDP_GRO", json_integer(cmsg->udp_gro));
+        if (cmsg->timestamping) {
+                json_t *json_ts = my_json_object();
+                add(json_ts, "software", build_timeout(&cmsg->ts_software));
+                add(json_ts, "hardware", build_timeout(&cmsg->ts_hardware));
+                add(json_cd, "SO_TIMESTAMPING", json_ts);
         }
-        //        cmsg = CMSG_NXTHDR(msgh, cmsg);
-        //        for (cmsg = CMSG_FIRSTHDR(msgh); cmsg != NULL;
-        //           cmsg = CMSG_NXTHDR(msgh, cmsg)) {
-        //              json_t *json_cd = my_json_object();
-        //              add(json_cd, "cmsg_level",
-        // json_integer(cmsg->cmsg_level));
-        //              add(json_cd, "cmsg_type",
-        // json_integer(cmsg->cmsg_type));
-        //              json_array_append_new(json_cd_list, json_cd);
-        //      }
-
-        return json_cd_list;
+        if (cmsg->pktinfo_family == AF_INET)
+                add(json_cd, "IP_PKTINFO", build_pktinfo(cmsg));
+        else if (cmsg->pktinfo_family == AF_INET6)
+                add(json_cd, "IPV6_PKTINFO", build_pktinfo(cmsg));
+        if (cmsg->zerocopy) {
+                json_t *json_zc = my_json_object();
+                add(json_zc, "lo", json_integer(cmsg->zerocopy_lo));
+                add(json_zc, "hi", json_integer(cmsg->zerocopy_hi));
+                add(json_zc, "copied", json_boolean(cmsg->zerocopy_copied));
+                add(json_cd, "zerocopy", json_zc);
+        }
+        return json_cd;
 }
 
 static json_t *build_msghdr(const Msghdr *msg) {
@@ -209,8 +221,8 @@ static json_t *build_msghdr(const Msghdr *msg) {
         if (msg->flags) add(json_msghdr, "flags", build_recv_flags(msg->flags));
         add(json_msghdr, "iovec", build_iovec(&msg->iovec));
         add(json_msghdr, "control_data_len",
-            json_integer(msg->msghdr->msg_controllen));
-        add(json_msghdr, "control_data", build_control_data(msg->msghdr));
+            json_integer(msg->control_data_len));
+        add(json_msghdr, "control_data", build_control_data(&msg->cmsg));
         return json_msghdr;
 }
 
@@ -417,7 +429,9 @@ static void add_fl_flags(json_t *details, int flags) {
 static void build_shared_fields(json_t *json_ev, const SockEvent *ev) {
         const char *type_str = string_from_sock_event_type(ev->type);
         add(json_ev, "type", json_string(type_str));
-        add(json_ev, "timestamp_usec", json_integer(ev->timestamp_usec));
+        add(json_ev, "timestamp_usec",
+            json_integer(wall_micros_from_ns(ev->timestamp_ns)));
+        add(json_ev, "timestamp_ns", json_integer(ev->timestamp_ns));
         add(json_ev, "return_value", json_integer(ev->return_value));
         add(json_ev, "success", json_boolean(ev->success));
         if (!ev->success) {
@@ -536,21 +550,23 @@ static json_t *build_sock_ev_recv(const SockEvRecv *ev) {
         return json_ev;
 }
 
-static json_t *build_sock_ev_sendto(const SockEvSendto *ev) {
+static json_t *build_sock_ev_sendto(const SockEvSendto *ev,
+                                    AddrTable *addrs) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
                             // *json_details
         add(json_details, "bytes", json_integer(ev->bytes));
         add(json_details, "flags", build_send_flags(ev->flags));
-        add(json_details, "addr", build_addr(&ev->addr));
+        add_addr_ref(json_details, addrs, ev->addr_id);
         return json_ev;
 }
 
-static json_t *build_sock_ev_recvfrom(const SockEvRecvfrom *ev) {
+static json_t *build_sock_ev_recvfrom(const SockEvRecvfrom *ev,
+                                      AddrTable *addrs) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
                             // *json_details
         add(json_details, "bytes", json_integer(ev->bytes));
         add(json_details, "flags", build_recv_flags(ev->flags));
-        add(json_details, "addr", build_addr(&ev->addr));
+        add_addr_ref(json_details, addrs, ev->addr_id);
         return json_ev;
 }
 
@@ -597,17 +613,19 @@ static json_t *build_sock_ev_recvmmsg(const SockEvRecvmmsg *ev) {
 }
 #endif
 
-static json_t *build_sock_ev_getsockname(const SockEvGetsockname *ev) {
+static json_t *build_sock_ev_getsockname(const SockEvGetsockname *ev,
+                                         AddrTable *addrs) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
                             // *json_details
-        add(json_details, "addr", build_addr(&ev->addr));
+        add_addr_ref(json_details, addrs, ev->addr_id);
         return json_ev;
 }
 
-static json_t *build_sock_ev_getpeername(const SockEvGetpeername *ev) {
+static json_t *build_sock_ev_getpeername(const SockEvGetpeername *ev,
+                                         AddrTable *addrs) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
                             // *json_details
-        add(json_details, "addr", build_addr(&ev->addr));
+        add_addr_ref(json_details, addrs, ev->addr_id);
         return json_ev;
 }
 
@@ -700,50 +718,6 @@ static json_t *build_sock_ev_sendfile(const SockEvSendfile *ev) {
         return json_ev;
 }
 
-static json_t *build_sock_ev_poll(const SockEvPoll *ev) {
-        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
-                            // *json_details
-        add(json_details, "timeout", build_timeout(&ev->timeout));
-        add(json_details, "requested_events",
-            build_poll_events(&ev->requested_events));
-        add(json_details, "returned_events",
-            build_poll_events(&ev->returned_events));
-        return json_ev;
-}
-
-static json_t *build_sock_ev_ppoll(const SockEvPpoll *ev) {
-        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
-                            // *json_details
-        add(json_details, "timeout", build_timeout(&ev->timeout));
-        add(json_details, "requested_events",
-            build_poll_events(&ev->requested_events));
-        add(json_details, "returned_events",
-            build_poll_events(&ev->returned_events));
-        return json_ev;
-}
-
-static json_t *build_sock_ev_select(const SockEvSelect *ev) {
-        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
-                            // *json_details
-        add(json_details, "timeout", build_timeout(&ev->timeout));
-        add(json_details, "requested_events",
-            build_select_events(&ev->requested_events));
-        add(json_details, "returned_events",
-            build_select_events(&ev->returned_events));
-        return json_ev;
-}
-
-static json_t *build_sock_ev_pselect(const SockEvPselect *ev) {
-        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
-                            // *json_details
-        add(json_details, "timeout", build_timeout(&ev->timeout));
-        add(json_details, "requested_events",
-            build_select_events(&ev->requested_events));
-        add(json_details, "returned_events",
-            build_select_events(&ev->returned_events));
-        return json_ev;
-}
-
 static json_t *build_sock_ev_fcntl(const SockEvFcntl *ev) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t
                             // *json_details
@@ -884,11 +858,23 @@ static json_t *build_sock_ev_tcp_info(const SockEvTcpInfo *ev) {
 
         add(json_details, "total_retrans", json_integer(i.tcpi_total_retrans));
 
+        add(json_details, "source",
+            json_string(ev->from_sock_diag ? "sock_diag" : "getsockopt"));
+        if (!ev->from_sock_diag) return json_ev;
+
+        /* Queues & memory, see sock_diag.h */
+        add(json_details, "rqueue", json_integer(ev->rqueue));
+        add(json_details, "wqueue", json_integer(ev->wqueue));
+        add(json_details, "rmem", json_integer(ev->meminfo.idiag_rmem));
+        add(json_details, "wmem", json_integer(ev->meminfo.idiag_wmem));
+        add(json_details, "fmem", json_integer(ev->meminfo.idiag_fmem));
+        add(json_details, "tmem", json_integer(ev->meminfo.idiag_tmem));
+
         return json_ev;
 }
 
-static json_t *build_sock_ev(const SockEvent *ev) {
-        json_t *r;
+static json_t *build_sock_ev(const SockEvent *ev, AddrTable *addrs) {
+        json_t *r = NULL;
         switch (ev->type) {
                 case SOCK_EV_SOCKET:
                         r = build_sock_ev_socket((const SockEvSocket *)ev);
@@ -934,10 +920,12 @@ static json_t *build_sock_ev(const SockEvent *ev) {
                         r = build_sock_ev_recv((const SockEvRecv *)ev);
                         break;
                 case SOCK_EV_SENDTO:
-                        r = build_sock_ev_sendto((const SockEvSendto *)ev);
+                        r = build_sock_ev_sendto((const SockEvSendto *)ev,
+                                                 addrs);
                         break;
                 case SOCK_EV_RECVFROM:
-                        r = build_sock_ev_recvfrom((const SockEvRecvfrom *)ev);
+                        r = build_sock_ev_recvfrom((const SockEvRecvfrom *)ev,
+                                                   addrs);
                         break;
                 case SOCK_EV_SENDMSG:
                         r = build_sock_ev_sendmsg((const SockEvSendmsg *)ev);
@@ -955,11 +943,11 @@ static json_t *build_sock_ev(const SockEvent *ev) {
 #endif
                 case SOCK_EV_GETSOCKNAME:
                         r = build_sock_ev_getsockname(
-                            (const SockEvGetsockname *)ev);
+                            (const SockEvGetsockname *)ev, addrs);
                         break;
                 case SOCK_EV_GETPEERNAME:
                         r = build_sock_ev_getpeername(
-                            (const SockEvGetpeername *)ev);
+                            (const SockEvGetpeername *)ev, addrs);
                         break;
                 case SOCK_EV_SOCKATMARK:
                         r = build_sock_ev_sockatmark(
@@ -998,18 +986,6 @@ static json_t *build_sock_ev(const SockEvent *ev) {
                 case SOCK_EV_SENDFILE:
                         r = build_sock_ev_sendfile((const SockEvSendfile *)ev);
                         break;
-                case SOCK_EV_POLL:
-                        r = build_sock_ev_poll((const SockEvPoll *)ev);
-                        break;
-                case SOCK_EV_PPOLL:
-                        r = build_sock_ev_ppoll((const SockEvPpoll *)ev);
-                        break;
-                case SOCK_EV_SELECT:
-                        r = build_sock_ev_select((const SockEvSelect *)ev);
-                        break;
-                case SOCK_EV_PSELECT:
-                        r = build_sock_ev_pselect((const SockEvPselect *)ev);
-                        break;
                 case SOCK_EV_FCNTL:
                         r = build_sock_ev_fcntl((const SockEvFcntl *)ev);
                         break;
@@ -1030,14 +1006,19 @@ static json_t *build_sock_ev(const SockEvent *ev) {
                 case SOCK_EV_TCP_INFO:
                         r = build_sock_ev_tcp_info((const SockEvTcpInfo *)ev);
                         break;
+                case SOCK_EV_POLL:
+                case SOCK_EV_PPOLL:
+                case SOCK_EV_SELECT:
+                case SOCK_EV_PSELECT:
+                        break;  // Recorded per call, see mux_events.h.
         }
         return r;
 }
 
 /* Public functions */
 
-char *alloc_sock_ev_json(const SockEvent *ev) {
-        json_t *json_ev = build_sock_ev(ev);
+char *alloc_sock_ev_json(const SockEvent *ev, AddrTable *addrs) {
+        json_t *json_ev = build_sock_ev(ev, addrs);
         if (!json_ev) goto error;
         char *json_string = json_dumps(json_ev, 0);
         json_decref(json_ev);
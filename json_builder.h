@@ -3,6 +3,6 @@
 
 #include "sock_events.h"
 
-char *alloc_sock_ev_json(const SockEvent *ev);
+char *alloc_sock_ev_json(const SockEvent *ev, AddrTable *addrs);
 
 #endif
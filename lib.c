@@ -17,9 +17,11 @@
 #ifdef __ANDROID__
 #include <sys/system_properties.h>
 #endif
+#include "fd_table.h"
 #include "init.h"
 #include "lib.h"
 #include "logger.h"
+#include "overhead.h"
 #include "string_builders.h"
 
 // We don't want to call the getsockopt we defined as it would be intercepted.
@@ -42,6 +44,40 @@ error:
         return ret;
 }
 
+// Same for getsockname() & getpeername(), which share the same signature.
+typedef int (*orig_getname_type)(int sockfd, struct sockaddr *addr,
+                                 socklen_t *addrlen);
+
+static orig_getname_type orig_getsockname;
+static orig_getname_type orig_getpeername;
+
+int my_getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+        if (!orig_getsockname)
+                orig_getsockname =
+                    (orig_getname_type)dlsym(RTLD_NEXT, "getsockname");
+        int ret = orig_getsockname(sockfd, addr, addrlen);
+        if (ret) goto error;
+        return ret;
+error:
+        LOG(ERROR, "getsockname() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return ret;
+}
+
+// Fails with ENOTCONN on unconnected sockets, which is not an error for us.
+int my_getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+        if (!orig_getpeername)
+                orig_getpeername =
+                    (orig_getname_type)dlsym(RTLD_NEXT, "getpeername");
+        int ret = orig_getpeername(sockfd, addr, addrlen);
+        if (ret && errno != ENOTCONN) goto error;
+        return ret;
+error:
+        LOG(ERROR, "getpeername() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return ret;
+}
+
 typedef FILE *(*orig_fdopen_type)(int fd, const char *mode);
 
 orig_fdopen_type orig_fdopen;
@@ -52,6 +88,17 @@ FILE *my_fdopen(int fd, const char *mode) {
         return orig_fdopen(fd, mode);
 }
 
+// Not the fclose() override, whose fd bookkeeping is for the app's streams.
+typedef int (*orig_fclose_type)(FILE *stream);
+
+static orig_fclose_type orig_fclose;
+
+int my_fclose(FILE *stream) {
+        if (!orig_fclose)
+                orig_fclose = (orig_fclose_type)dlsym(RTLD_NEXT, "fclose");
+        return orig_fclose(stream);
+}
+
 #ifdef __ANDROID__
 typedef int (*ioctl_type)(int fd, int request, ...);
 #else
@@ -120,6 +167,21 @@ error:
         return false;
 }
 
+/* Classification is cached in the fd table, which spares the syscalls of
+ * is_inet_socket() to all but the first call on a fd. Those are accounted as
+ * overhead, unless run from a hook whose time already includes them. */
+bool is_traced_socket(int fd) {
+        unsigned char flags = fd_table_get(fd);
+        if (flags & (FD_UNTRACED | FD_NOT_INET)) return false;
+        if (flags & FD_TRACED) return true;
+        uint64_t start = get_time_ns();
+        bool is_inet = is_inet_socket(fd);
+        if (!is_inet) fd_table_set(fd, FD_NOT_INET);
+        if (!hook_start_ns)
+                overhead_add(OVERHEAD_CLASSIFY, get_time_ns() - start);
+        return is_inet;
+}
+
 bool is_tcp_socket(int fd) {
         if (!is_inet_socket(fd)) return false;
         int optval;
@@ -138,13 +200,13 @@ int append_string_to_file(const char *str, const char *path) {
         FILE *fp = fopen(path, "a");
         if (!fp) goto error1;
         if (fputs(str, fp) == EOF) goto error2;
-        if (fclose(fp) == EOF) goto error3;
+        if (my_fclose(fp) == EOF) goto error3;
         return 0;
 error1:
         LOG(ERROR, "fopen() failed. %s.", strerror(errno));
         goto error_out;
 error2:
-        fclose(fp);
+        my_fclose(fp);
         LOG(ERROR, "fputs() failed.");
         goto error_out;
 error3:
@@ -240,7 +302,10 @@ long get_long_opt_or_defaultval(const char *opt, long def_val) {
 #else
         long val = get_env_as_long(opt);
 #endif
-        if (val < 0) LOG(WARN, "%s incorrect. Defaults to %lu.", opt, def_val);
+        if (val < 0) {
+                LOG(WARN, "%s incorrect. Defaults to %lu.", opt, def_val);
+                return def_val;
+        }
         return val;
 }
 
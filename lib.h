@@ -14,8 +14,11 @@
 
 int my_getsockopt(int sockfd, int level, int optname, void *optval,
                   socklen_t *optlen);
+int my_getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+int my_getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
 FILE *my_fdopen(int fd, const char *mode);
+int my_fclose(FILE *stream);
 
 #ifdef __ANDROID__
 int my_ioctl(int fd, int request, ...);
@@ -26,6 +29,7 @@ int my_ioctl(int fd, unsigned long int request, ...);
 bool is_fd(int fd);
 bool is_socket(int fd);
 bool is_inet_socket(int fd);
+bool is_traced_socket(int fd);
 bool is_tcp_socket(int fd);
 
 int append_string_to_file(const char *str, const char *path);
@@ -23,8 +23,13 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include "fd_table.h"
+#include "dormant.h"
 #include "init.h"
 #include "logger.h"
+#include "loop_lag.h"
+#include "mux_events.h"
+#include "overhead.h"
 #include "sock_events.h"
 #include "string_builders.h"
 
@@ -37,6 +42,36 @@
 #define arg5 arg4, d
 #define arg6 arg5, e
 
+// Only the -q event recorder needs the latency of the calls.
+#define TIME_CALL()                                         \
+        if (__atomic_load_n(&conf_opt_q, __ATOMIC_RELAXED)) \
+                call_start_ns = get_time_ns()
+
+/* A traced fd closed behind the overrides, e.g. by a raw close syscall, is
+ * told by the next call on it failing with EBADF, or ENOTSOCK once reused. */
+#define DROP_IF_STALE(fd, ret, err)                               \
+        if ((ret) == -1 && ((err) == EBADF || (err) == ENOTSOCK)) \
+        drop_stale_fd(fd, err)
+
+static void drop_stale_fd(int fd, int err) {
+        if (!(fd_table_get(fd) & FD_TRACED)) return;
+        // EBADF may be about another fd, e.g. the newfd of dup2().
+        // Not fcntl(), whose override would trace the probe.
+        if (err == EBADF && is_fd(fd)) return;
+        LOG(WARN, "fd %d closed behind the overrides.", fd);
+        fd_table_clear(fd);
+        lag_forget(fd);
+        TRACE_HOOK(free_and_dump_socket(fd));
+}
+
+// The fd closed without close(), e.g. by fclose(): as close() would do.
+static void forget_closed_fd(int fd) {
+        bool is_inet = fd_table_get(fd) & FD_TRACED;
+        fd_table_clear(fd);
+        lag_forget(fd);
+        if (is_inet) TRACE_HOOK(sock_ev_close(fd, 0, 0));
+}
+
 #define override(FUNCTION, RETURN_TYPE, ARGS_COUNT, ...)                   \
         typedef RETURN_TYPE (*FUNCTION##_type)(int fd, __VA_ARGS__);       \
         FUNCTION##_type orig_##FUNCTION;                                   \
@@ -45,10 +80,14 @@
                 if (!orig_##FUNCTION)                                      \
                         orig_##FUNCTION =                                  \
                             (FUNCTION##_type)dlsym(RTLD_NEXT, #FUNCTION);  \
+                if (IS_DORMANT())                                          \
+                        return orig_##FUNCTION(fd, arg##ARGS_COUNT);       \
+                TIME_CALL();                                               \
                 RETURN_TYPE ret = orig_##FUNCTION(fd, arg##ARGS_COUNT);    \
                 int err = errno;                                           \
-                if (is_inet_socket(fd))                                    \
-                        sock_ev_##FUNCTION(fd, ret, err, arg##ARGS_COUNT); \
+                DROP_IF_STALE(fd, ret, err);                               \
+                TRACE_CALL(fd, sock_ev_##FUNCTION(fd, ret, err,            \
+                                                  arg##ARGS_COUNT));       \
                 errno = err;                                               \
                 return ret;                                                \
         }
@@ -61,9 +100,12 @@
                 if (!orig_##FUNCTION)                                     \
                         orig_##FUNCTION =                                 \
                             (FUNCTION##_type)dlsym(RTLD_NEXT, #FUNCTION); \
+                if (IS_DORMANT()) return orig_##FUNCTION(fd);             \
+                TIME_CALL();                                              \
                 RETURN_TYPE ret = orig_##FUNCTION(fd);                    \
                 int err = errno;                                          \
-                if (is_inet_socket(fd)) sock_ev_##FUNCTION(fd, ret, err); \
+                DROP_IF_STALE(fd, ret, err);                              \
+                TRACE_CALL(fd, sock_ev_##FUNCTION(fd, ret, err));         \
                 errno = err;                                              \
                 return ret;                                               \
         }
@@ -94,8 +136,11 @@ socket_type orig_socket;
 
 EXPORT int socket(int domain, int type, int protocol) {
         if (!orig_socket) orig_socket = (socket_type)dlsym(RTLD_NEXT, "socket");
+        if (IS_DORMANT()) return orig_socket(domain, type, protocol);
         int fd = orig_socket(domain, type, protocol);
-        if (is_inet_socket(fd)) sock_ev_socket(fd, domain, type, protocol);
+        fd_table_clear(fd);  // Flags of a previous fd with the same number.
+        lag_forget(fd);
+        TRACE_CALL(fd, sock_ev_socket(fd, domain, type, protocol));
         return fd;
 }
 
@@ -105,11 +150,15 @@ connect_type orig_connect;
 EXPORT int connect(int fd, const struct sockaddr *addr, socklen_t len) {
         if (!orig_connect)
                 orig_connect = (connect_type)dlsym(RTLD_NEXT, "connect");
+        if (IS_DORMANT()) return orig_connect(fd, addr, len);
 
-        if (is_inet_socket(fd) && conf_opt_c) sock_start_capture(fd, addr);
+#ifndef TCPSNITCH_LEAN
+        if (conf_opt_c) TRACE_CALL(fd, sock_start_capture(fd, addr));
+#endif
+        TIME_CALL();
         int ret = orig_connect(fd, addr, len);
         int err = errno;
-        if (is_inet_socket(fd)) sock_ev_connect(fd, ret, err, addr, len);
+        TRACE_CALL(fd, sock_ev_connect(fd, ret, err, addr, len));
 
         errno = err;
         return ret;
@@ -179,7 +228,8 @@ override(isfdtype, int, 2, int a);
 
  unistd.h - standard symbolic constants and types
 
- functions: write(), read(), close(), fork(), dup(), dup2(), dup3()
+ functions: write(), read(), close(), close_range(), closefrom(), fork(),
+ dup(), dup2(), dup3()
 
 */
 
@@ -191,19 +241,122 @@ close_type orig_close;
 
 EXPORT int close(int fd) {
         if (!orig_close) orig_close = (close_type)dlsym(RTLD_NEXT, "close");
+        if (IS_DORMANT()) return orig_close(fd);
 
-        bool is_inet = is_inet_socket(fd);
+        bool is_inet = is_traced_socket(fd);
         int ret = orig_close(fd);
         int err = errno;
-        if (is_inet) sock_ev_close(fd, ret, err);
+        if (!ret) {
+                fd_table_clear(fd);
+                lag_forget(fd);
+        }
+        if (is_inet) TRACE_HOOK(sock_ev_close(fd, ret, err));
+
+        errno = err;
+        return ret;
+}
+
+#if !defined(__ANDROID__) && LIBC_VERSION >= 234
+typedef int (*close_range_type)(unsigned int first, unsigned int last,
+                                int flags);
+close_range_type orig_close_range;
+
+EXPORT int close_range(unsigned int first, unsigned int last, int flags) {
+        if (!orig_close_range)
+                orig_close_range =
+                    (close_range_type)dlsym(RTLD_NEXT, "close_range");
+        if (IS_DORMANT()) return orig_close_range(first, last, flags);
+
+        int ret = orig_close_range(first, last, flags);
+        int err = errno;
+        if (!ret && !(flags & CLOSE_RANGE_CLOEXEC))
+                for (unsigned int fd = first;
+                     fd <= last && fd < (unsigned int)fd_table_end(); fd++)
+                        if (fd_table_get(fd)) forget_closed_fd(fd);
+
+        errno = err;
+        return ret;
+}
+
+typedef void (*closefrom_type)(int lowfd);
+closefrom_type orig_closefrom;
+
+EXPORT void closefrom(int lowfd) {
+        if (!orig_closefrom)
+                orig_closefrom = (closefrom_type)dlsym(RTLD_NEXT, "closefrom");
+        if (IS_DORMANT()) return orig_closefrom(lowfd);
+
+        orig_closefrom(lowfd);
+        int err = errno;
+        for (int fd = lowfd < 0 ? 0 : lowfd; fd < fd_table_end(); fd++)
+                if (fd_table_get(fd)) forget_closed_fd(fd);
+
+        errno = err;
+}
+#endif
+
+/* The hooks only see traced sockets: the copy of a sampled-out or filtered out
+ * socket is marked here, as is the fd closed by dup2() and dup3(). */
+static void dup_fd_flags(int fd, int newfd) {
+        if (newfd == fd) return;
+        if (fd_table_get(newfd)) forget_closed_fd(newfd);
+        unsigned char flags = fd_table_get(fd) & (FD_UNTRACED | FD_NOT_INET);
+        if (flags) fd_table_set(newfd, flags);
+}
+
+typedef int (*dup_type)(int fd);
+dup_type orig_dup;
+
+EXPORT int dup(int fd) {
+        if (!orig_dup) orig_dup = (dup_type)dlsym(RTLD_NEXT, "dup");
+        if (IS_DORMANT()) return orig_dup(fd);
+
+        TIME_CALL();
+        int ret = orig_dup(fd);
+        int err = errno;
+        DROP_IF_STALE(fd, ret, err);
+        if (ret != -1) dup_fd_flags(fd, ret);
+        TRACE_CALL(fd, sock_ev_dup(fd, ret, err));
+
+        errno = err;
+        return ret;
+}
+
+typedef int (*dup2_type)(int fd, int newfd);
+dup2_type orig_dup2;
+
+EXPORT int dup2(int fd, int newfd) {
+        if (!orig_dup2) orig_dup2 = (dup2_type)dlsym(RTLD_NEXT, "dup2");
+        if (IS_DORMANT()) return orig_dup2(fd, newfd);
+
+        TIME_CALL();
+        int ret = orig_dup2(fd, newfd);
+        int err = errno;
+        DROP_IF_STALE(fd, ret, err);
+        if (ret != -1) dup_fd_flags(fd, ret);
+        TRACE_CALL(fd, sock_ev_dup2(fd, ret, err, newfd));
 
         errno = err;
         return ret;
 }
 
-override_1arg(dup, int);
-override(dup2, int, 2, int a);
-override(dup3, int, 3, int a, int b);
+typedef int (*dup3_type)(int fd, int newfd, int flags);
+dup3_type orig_dup3;
+
+EXPORT int dup3(int fd, int newfd, int flags) {
+        if (!orig_dup3) orig_dup3 = (dup3_type)dlsym(RTLD_NEXT, "dup3");
+        if (IS_DORMANT()) return orig_dup3(fd, newfd, flags);
+
+        TIME_CALL();
+        int ret = orig_dup3(fd, newfd, flags);
+        int err = errno;
+        DROP_IF_STALE(fd, ret, err);
+        if (ret != -1) dup_fd_flags(fd, ret);
+        TRACE_CALL(fd, sock_ev_dup3(fd, ret, err, newfd, flags));
+
+        errno = err;
+        return ret;
+}
 
 typedef pid_t (*fork_type)(void);
 fork_type orig_fork;
@@ -214,7 +367,9 @@ EXPORT pid_t fork(void) {
 
         pid_t ret = orig_fork();
         int err = errno;
-        if (ret == 0) reset_tcpsnitch();  // Child
+        // The child was reset by reset_tcpsnitch(), see pthread_atfork(). Yet
+        // nothing else would serve the control socket of a dormant child.
+        if (ret == 0 && IS_DORMANT()) init_tcpsnitch();
 
         errno = err;
         return ret;
@@ -267,10 +422,11 @@ EXPORT int ioctl(int fd, unsigned long int request, ...) {
         va_end(argp);
 
         if (!orig_ioctl) orig_ioctl = (ioctl_type)dlsym(RTLD_NEXT, "ioctl");
+        if (IS_DORMANT()) return orig_ioctl(fd, request, value);
 
         int ret = orig_ioctl(fd, request, value);
         int err = errno;
-        if (is_inet_socket(fd)) sock_ev_ioctl(fd, ret, err, request);
+        TRACE_CALL(fd, sock_ev_ioctl(fd, ret, err, request));
 
         errno = err;
         return ret;
@@ -307,16 +463,12 @@ poll_type orig_poll;
 
 EXPORT int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
         if (!orig_poll) orig_poll = (poll_type)dlsym(RTLD_NEXT, "poll");
+        if (IS_DORMANT()) return orig_poll(fds, nfds, timeout);
 
         int ret = orig_poll(fds, nfds, timeout);
         int err = errno;
-        unsigned long i;
-        for (i = 0; i < nfds; i++) {
-                struct pollfd pollfd = fds[i];
-                if (is_inet_socket(pollfd.fd))
-                        sock_ev_poll(pollfd.fd, ret, err, pollfd.events,
-                                     pollfd.revents, timeout);
-        }
+        int64_t timeout_ns = timeout < 0 ? -1 : timeout * 1000000LL;
+        TRACE_HOOK(mux_ev_poll(SOCK_EV_POLL, ret, err, fds, nfds, timeout_ns));
 
         errno = err;
         return ret;
@@ -330,16 +482,13 @@ ppoll_type orig_ppoll;
 EXPORT int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
           const sigset_t *sigmask) {
         if (!orig_ppoll) orig_ppoll = (ppoll_type)dlsym(RTLD_NEXT, "ppoll");
+        if (IS_DORMANT()) return orig_ppoll(fds, nfds, tmo_p, sigmask);
 
         int ret = orig_ppoll(fds, nfds, tmo_p, sigmask);
         int err = errno;
-        unsigned long i;
-        for (i = 0; i < nfds; i++) {
-                struct pollfd pollfd = fds[i];
-                if (is_inet_socket(pollfd.fd))
-                        sock_ev_ppoll(pollfd.fd, ret, err, pollfd.events,
-                                      pollfd.revents, tmo_p);
-        }
+        int64_t timeout_ns =
+            tmo_p ? tmo_p->tv_sec * 1000000000LL + tmo_p->tv_nsec : -1;
+        TRACE_HOOK(mux_ev_poll(SOCK_EV_PPOLL, ret, err, fds, nfds, timeout_ns));
 
         errno = err;
         return ret;
@@ -361,45 +510,26 @@ typedef int (*select_type)(int nfds, fd_set *readfds, fd_set *writefds,
                            fd_set *exceptfds, struct timeval *timeout);
 select_type orig_select;
 
-#define READ_FLAG 0b1
-#define WRITE_FLAG 0b10
-#define EXCEPT_FLAG 0b100
-
 EXPORT int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
            struct timeval *timeout) {
         if (!orig_select) orig_select = (select_type)dlsym(RTLD_NEXT, "select");
+        if (IS_DORMANT())
+                return orig_select(nfds, readfds, writefds, exceptfds, timeout);
 
-        short req_ev[nfds];
-        memset(req_ev, 0, sizeof(req_ev));
-
-        int fd;
-        for (fd = 0; fd < nfds; fd++) {
-                if (is_inet_socket(fd)) {
-                        if (readfds && FD_ISSET(fd, readfds))
-                                (req_ev[fd] = req_ev[fd] | READ_FLAG);
-                        if (writefds && FD_ISSET(fd, writefds))
-                                (req_ev[fd] = req_ev[fd] | WRITE_FLAG);
-                        if (exceptfds && FD_ISSET(fd, exceptfds))
-                                (req_ev[fd] = req_ev[fd] | EXCEPT_FLAG);
-                }
-        }
+        // Linux updates the timeout with the time left.
+        int64_t timeout_ns =
+            timeout ? timeout->tv_sec * 1000000000LL + timeout->tv_usec * 1000
+                    : -1;
+        SelectSets req;
+        save_select_sets(&req, nfds, readfds, writefds, exceptfds);
 
         int ret = orig_select(nfds, readfds, writefds, exceptfds, timeout);
         int err = errno;
+        TRACE_HOOK(mux_ev_select(SOCK_EV_SELECT, ret, err, &req, readfds,
+                                 writefds, exceptfds, timeout_ns));
+        free_select_sets(&req);
 
-        for (fd = 0; fd < nfds; fd++) {
-                if (is_inet_socket(fd) &&
-                    req_ev[fd]) {  // Socket was in initial call
-                        sock_ev_select(fd, ret, err, (req_ev[fd] & READ_FLAG),
-                                       (req_ev[fd] & WRITE_FLAG),
-                                       (req_ev[fd] & EXCEPT_FLAG),
-                                       readfds && FD_ISSET(fd, readfds),
-                                       writefds && FD_ISSET(fd, writefds),
-                                       exceptfds && FD_ISSET(fd, exceptfds),
-                                       timeout);
-                }
-        }
-
+        errno = err;
         return ret;
 }
 
@@ -412,37 +542,21 @@ EXPORT int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfd
             const struct timespec *timeout, const sigset_t *sigmask) {
         if (!orig_pselect)
                 orig_pselect = (pselect_type)dlsym(RTLD_NEXT, "pselect");
+        if (IS_DORMANT())
+                return orig_pselect(nfds, readfds, writefds, exceptfds, timeout,
+                                    sigmask);
 
-        short req_ev[nfds];
-        memset(req_ev, 0, sizeof(req_ev));
-
-        int fd;
-        for (fd = 0; fd < nfds; fd++) {
-                if (is_inet_socket(fd)) {
-                        if (readfds && FD_ISSET(fd, readfds))
-                                (req_ev[fd] = req_ev[fd] | READ_FLAG);
-                        if (writefds && FD_ISSET(fd, writefds))
-                                (req_ev[fd] = req_ev[fd] | WRITE_FLAG);
-                        if (exceptfds && FD_ISSET(fd, exceptfds))
-                                (req_ev[fd] = req_ev[fd] | EXCEPT_FLAG);
-                }
-        }
+        int64_t timeout_ns =
+            timeout ? timeout->tv_sec * 1000000000LL + timeout->tv_nsec : -1;
+        SelectSets req;
+        save_select_sets(&req, nfds, readfds, writefds, exceptfds);
 
         int ret =
             orig_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
         int err = errno;
-
-        for (fd = 0; fd < nfds; fd++) {
-                if (is_inet_socket(fd) && req_ev[fd]) {
-                        sock_ev_pselect(fd, ret, err, (req_ev[fd] & READ_FLAG),
-                                        (req_ev[fd] & WRITE_FLAG),
-                                        (req_ev[fd] & EXCEPT_FLAG),
-                                        readfds && FD_ISSET(fd, readfds),
-                                        writefds && FD_ISSET(fd, writefds),
-                                        exceptfds && FD_ISSET(fd, exceptfds),
-                                        timeout);
-                }
-        }
+        TRACE_HOOK(mux_ev_select(SOCK_EV_PSELECT, ret, err, &req, readfds,
+                                 writefds, exceptfds, timeout_ns));
+        free_select_sets(&req);
 
         errno = err;
         return ret;
@@ -472,9 +586,10 @@ EXPORT int fcntl(int fd, int cmd, ...) {
         arg = va_arg(argp, void *);
         va_end(argp);
 
+        if (IS_DORMANT()) return orig_fcntl(fd, cmd, arg);
         int ret = orig_fcntl(fd, cmd, arg);
         int err = errno;
-        if (is_inet_socket(fd)) sock_ev_fcntl(fd, ret, err, cmd, arg);
+        TRACE_CALL(fd, sock_ev_fcntl(fd, ret, err, cmd, arg));
 
         errno = err;
         return ret;
@@ -500,11 +615,11 @@ epoll_ctl_type orig_epoll_ctl;
 EXPORT int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
         if (!orig_epoll_ctl)
                 orig_epoll_ctl = (epoll_ctl_type)dlsym(RTLD_NEXT, "epoll_ctl");
+        if (IS_DORMANT()) return orig_epoll_ctl(epfd, op, fd, event);
 
         int ret = orig_epoll_ctl(epfd, op, fd, event);
         int err = errno;
-        if (is_inet_socket(fd))
-                sock_ev_epoll_ctl(fd, ret, err, op, event->events);
+        TRACE_CALL(fd, sock_ev_epoll_ctl(fd, ret, err, op, event->events));
 
         errno = err;
         return ret;
@@ -520,16 +635,15 @@ EXPORT int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
         if (!orig_epoll_wait)
                 orig_epoll_wait =
                     (epoll_wait_type)dlsym(RTLD_NEXT, "epoll_wait");
+        if (IS_DORMANT())
+                return orig_epoll_wait(epfd, events, maxevents, timeout);
 
         int ret = orig_epoll_wait(epfd, events, maxevents, timeout);
         int err = errno;
         for (int i = 0; i < ret; i++) {
                 int fd = events[i].data.fd;
-                if (is_inet_socket(fd)) {
-                        uint32_t returned_events = events[i].events;
-                        sock_ev_epoll_wait(fd, ret, err, timeout,
-                                           returned_events);
-                }
+                TRACE_CALL(fd, sock_ev_epoll_wait(fd, ret, err, timeout,
+                                                  events[i].events));
         }
 
         errno = err;
@@ -547,16 +661,16 @@ EXPORT int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
         if (!orig_epoll_pwait)
                 orig_epoll_pwait =
                     (epoll_pwait_type)dlsym(RTLD_NEXT, "epoll_pwait");
+        if (IS_DORMANT())
+                return orig_epoll_pwait(epfd, events, maxevents, timeout,
+                                        sigmask);
 
         int ret = orig_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
         int err = errno;
         for (int i = 0; i < ret; i++) {
                 int fd = events[i].data.fd;
-                if (is_inet_socket(fd)) {
-                        uint32_t returned_events = events[i].events;
-                        sock_ev_epoll_pwait(fd, ret, err, timeout,
-                                            returned_events);
-                }
+                TRACE_CALL(fd, sock_ev_epoll_pwait(fd, ret, err, timeout,
+                                                   events[i].events));
         }
 
         errno = err;
@@ -572,7 +686,39 @@ EXPORT int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
 
  stdio.h
 
- functions: fdopen()
+ functions: fdopen(), fclose()
 */
 
-override(fdopen, FILE *, 2, const char *a);
+typedef FILE *(*fdopen_type)(int fd, const char *mode);
+fdopen_type orig_fdopen;
+
+EXPORT FILE *fdopen(int fd, const char *mode) {
+        if (!orig_fdopen) orig_fdopen = (fdopen_type)dlsym(RTLD_NEXT, "fdopen");
+        if (IS_DORMANT()) return orig_fdopen(fd, mode);
+
+        TIME_CALL();
+        FILE *ret = orig_fdopen(fd, mode);
+        int err = errno;
+        if (!ret && err == EBADF) drop_stale_fd(fd, err);
+        TRACE_CALL(fd, sock_ev_fdopen(fd, ret, err, mode));
+
+        errno = err;
+        return ret;
+}
+
+typedef int (*fclose_type)(FILE *stream);
+fclose_type orig_fclose;
+
+// The fd of the stream is closed by libc, without close().
+EXPORT int fclose(FILE *stream) {
+        if (!orig_fclose) orig_fclose = (fclose_type)dlsym(RTLD_NEXT, "fclose");
+        if (IS_DORMANT()) return orig_fclose(stream);
+
+        int fd = fileno(stream);
+        int ret = orig_fclose(stream);
+        int err = errno;
+        if (fd >= 0) forget_closed_fd(fd);
+
+        errno = err;
+        return ret;
+}
@@ -116,7 +116,7 @@ static void log_to_stderr(LogLevel log_lvl, const char *formated_str,
 #endif
 
 static void set_log_file(const char *path) {
-        if (log_file != NULL) fclose(log_file);
+        if (log_file != NULL) my_fclose(log_file);
 
         if (!path) {  // reset_tcpsnitch pass a NULL pointer.
                 log_file = NULL;
@@ -144,6 +144,11 @@ void logger_init(const char *path, LogLevel _stdout_lvl, LogLevel _file_lvl) {
         file_lvl = _file_lvl;
 }
 
+// Lines still buffered would otherwise be written by both sides of a fork().
+void logger_flush(void) {
+        if (log_file) fflush(log_file);
+}
+
 void logger(LogLevel log_lvl, const char *str, const char *file, int line) {
         if (log_lvl <= stderr_lvl)
 #ifdef __ANDROID__
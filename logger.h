@@ -6,6 +6,7 @@
 typedef enum LogLevel { ALWAYS, ERROR, WARN, INFO, DEBUG } LogLevel;
 
 void logger_init(const char *path, LogLevel stdout_lvl, LogLevel file_lvl);
+void logger_flush(void);
 
 void logger(LogLevel lvl, const char *str, const char *file, int line);
 
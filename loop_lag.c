@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+
+#include "loop_lag.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "fd_table.h"
+#include "init.h"
+#include "lib.h"
+#include "logger.h"
+#include "string_builders.h"
+#include "timestamp.h"
+
+#define LOOP_LAG_FILE "loop_lag.txt"
+
+typedef struct ThreadLag ThreadLag;
+struct ThreadLag {
+        pid_t thread_id;
+        unsigned long wakeups;  // First read or write after readiness.
+        unsigned long wasted;   // Those which failed with EAGAIN.
+        unsigned long buckets[LAG_BUCKETS];
+        ThreadLag *next;
+};
+
+static uint64_t ready_ns[FD_TABLE_SIZE];  // 0 if not reported ready.
+static uint64_t forked_ns = 0;  // Readiness reported before is the parent's.
+
+/* Stats are never freed, as threads may exit before they are dumped. They are
+ * only updated by their thread. */
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ThreadLag *threads = NULL;
+static _Thread_local ThreadLag *thread_lag = NULL;
+
+/* Private functions */
+
+static bool is_in_bounds(int fd) { return fd >= 0 && fd < FD_TABLE_SIZE; }
+
+static ThreadLag *get_thread_lag(void) {
+        if (thread_lag) return thread_lag;
+        ThreadLag *lag = (ThreadLag *)my_calloc(sizeof(ThreadLag));
+        if (!lag) return NULL;
+        lag->thread_id = syscall(SYS_gettid);
+        mutex_lock(&threads_mutex);
+        lag->next = threads;
+        threads = lag;
+        mutex_unlock(&threads_mutex);
+        return (thread_lag = lag);
+}
+
+static int get_bucket(uint64_t lag_ns) {
+        if (!lag_ns) return 0;
+        int bucket = 63 - __builtin_clzll(lag_ns);
+        return bucket < LAG_BUCKETS ? bucket : LAG_BUCKETS - 1;
+}
+
+static void count(unsigned long *counter) {
+        __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void write_thread_lag(FILE *fp, const ThreadLag *lag) {
+        fprintf(fp,
+                "{\"thread_id\": %d, \"wakeups\": %lu, \"wasted_wakeups\": "
+                "%lu, \"lag_ns_log2\": [",
+                lag->thread_id,
+                __atomic_load_n(&lag->wakeups, __ATOMIC_RELAXED),
+                __atomic_load_n(&lag->wasted, __ATOMIC_RELAXED));
+        for (int i = 0; i < LAG_BUCKETS; i++)
+                fprintf(fp, "%s%lu", i ? ", " : "",
+                        __atomic_load_n(&lag->buckets[i], __ATOMIC_RELAXED));
+        fputs("]}\n", fp);
+}
+
+/* Public functions */
+
+void lag_mark_ready(int fd, uint64_t now_ns) {
+        if (!is_in_bounds(fd)) return;
+        __atomic_store_n(&ready_ns[fd], now_ns, __ATOMIC_RELAXED);
+}
+
+// Only the first call after readiness is measured. The load spares the
+// exchange to the calls of a socket which is not waited for.
+void lag_io(int fd, int ret, int err) {
+        if (!is_in_bounds(fd)) return;
+        if (!__atomic_load_n(&ready_ns[fd], __ATOMIC_RELAXED)) return;
+        uint64_t ready =
+            __atomic_exchange_n(&ready_ns[fd], 0, __ATOMIC_RELAXED);
+        if (!ready) return;  // Taken by another thread.
+        if (ready <= forked_ns) return;
+        ThreadLag *lag = get_thread_lag();
+        if (!lag) goto error;
+        count(&lag->wakeups);
+        count(&lag->buckets[get_bucket(get_time_ns() - ready)]);
+        if (ret == -1 && (err == EAGAIN || err == EWOULDBLOCK))
+                count(&lag->wasted);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+// The fd was closed or reused: its readiness was the previous file's.
+void lag_forget(int fd) {
+        if (!is_in_bounds(fd)) return;
+        __atomic_store_n(&ready_ns[fd], 0, __ATOMIC_RELAXED);
+}
+
+void dump_loop_lag(void) {
+        char *path;
+        FILE *fp;
+        if (!threads || !logs_dir_path) return;
+        if (!(path = alloc_concat_path(logs_dir_path, LOOP_LAG_FILE)))
+                goto error1;
+        fp = fopen(path, "w");
+        free(path);
+        if (!fp) goto error2;
+        mutex_lock(&threads_mutex);
+        for (const ThreadLag *lag = threads; lag != NULL; lag = lag->next)
+                write_thread_lag(fp, lag);
+        mutex_unlock(&threads_mutex);
+        my_fclose(fp);
+        return;
+error2:
+        LOG(ERROR, "fopen() failed. %s.", strerror(errno));
+error1:
+        LOG_FUNC_ERROR;
+}
+
+// Held across fork(), so that the child does not find the list mid-update.
+void loop_lag_prepare_fork(void) { mutex_lock(&threads_mutex); }
+
+void loop_lag_parent_after_fork(void) { mutex_unlock(&threads_mutex); }
+
+/* In the child. The stats are the parent's, left behind rather than freed,
+ * which would copy their pages. So is the readiness of the fds, told stale by
+ * its time on their next call. */
+void loop_lag_reset(void) {
+        mutex_init(&threads_mutex);
+        threads = NULL;
+        thread_lag = NULL;
+        forked_ns = get_time_ns();
+}
@@ -0,0 +1,24 @@
+#ifndef LOOP_LAG_H
+#define LOOP_LAG_H
+
+#include <stdint.h>
+
+/* Event-loop lag. When epoll_wait(), epoll_pwait() or a multiplexing call (see
+ * mux_events.h) reports a traced socket as ready, the time is kept per fd. The
+ * next read or write on the fd measures the lag since, in the thread doing it.
+ * Lags go to a per-thread histogram, and calls failing with EAGAIN are counted
+ * as wasted wakeups. The stats are rewritten to loop_lag.txt, one JSON object
+ * per thread, whenever socket events are dumped. */
+
+#define LAG_BUCKETS 40  // Bucket i holds lags in [2^i, 2^(i+1)) ns, the last
+                        // one all lags above.
+
+void lag_mark_ready(int fd, uint64_t ready_ns);
+void lag_io(int fd, int ret, int err);
+void lag_forget(int fd);
+void dump_loop_lag(void);
+void loop_lag_prepare_fork(void);
+void loop_lag_parent_after_fork(void);
+void loop_lag_reset(void);
+
+#endif
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+
+#include "mux_events.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "constants.h"
+#include "governor.h"
+#include "init.h"
+#include "lib.h"
+#include "logger.h"
+#include "loop_lag.h"
+#include "overhead.h"
+#include "sock_filter.h"
+#include "string_builders.h"
+#include "timestamp.h"
+
+#define MUX_FILE "mux.txt"
+
+static pthread_mutex_t mux_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MuxEvent *head = NULL;
+static MuxEvent *tail = NULL;
+static unsigned long mux_count = 0;
+static unsigned long pending_count = 0;  // Records not dumped yet.
+static unsigned long dropped_count = 0;
+
+/* Private functions */
+
+static bool is_recorded(SockEventType type) {
+        if (!filter_allows_event(type) || GOVERNOR_LEVEL() >= GOV_COUNTERS)
+                return false;
+#ifndef TCPSNITCH_LEAN
+        if (__atomic_load_n(&pending_count, __ATOMIC_RELAXED) >=
+            MUX_MAX_PENDING) {
+                __atomic_add_fetch(&dropped_count, 1, __ATOMIC_RELAXED);
+                return false;
+        }
+#endif
+        return true;
+}
+
+static MuxEvent *alloc_mux_event(SockEventType type, int ret, int err,
+                                 int64_t timeout_ns, int max_fds) {
+        MuxEvent *ev =
+            (MuxEvent *)my_malloc(sizeof(MuxEvent) + max_fds * sizeof(MuxFd));
+        if (!ev) return NULL;
+        ev->type = type;
+        ev->timestamp_ns = get_time_ns();
+        ev->thread_id = syscall(SYS_gettid);
+        ev->return_value = ret;
+        ev->err = err;
+        ev->timeout_ns = timeout_ns;
+        ev->fds_count = 0;
+        ev->next = NULL;
+        return ev;
+}
+
+static void add_fd(MuxEvent *ev, int fd, int id, short requested,
+                   short returned) {
+        MuxFd *mux_fd = &ev->fds[ev->fds_count++];
+        if (returned) lag_mark_ready(fd, ev->timestamp_ns);
+        mux_fd->fd = fd;
+        mux_fd->sock_id = id;
+        mux_fd->requested = requested;
+        mux_fd->returned = returned;
+}
+
+static void copy_words(unsigned long *dst, const fd_set *set, int words) {
+        if (set)
+                memcpy(dst, set, words * sizeof(unsigned long));
+        else
+                memset(dst, 0, words * sizeof(unsigned long));
+}
+
+static bool is_bit_set(const fd_set *set, int fd) {
+        if (!set) return false;
+        const unsigned long *words = (const unsigned long *)set;
+        return words[fd / FD_WORD_BITS] & (1UL << (fd % FD_WORD_BITS));
+}
+
+static short get_returned(const fd_set *readfds, const fd_set *writefds,
+                          const fd_set *exceptfds, int fd) {
+        return (is_bit_set(readfds, fd) ? POLLIN : 0) |
+               (is_bit_set(writefds, fd) ? POLLOUT : 0) |
+               (is_bit_set(exceptfds, fd) ? POLLPRI : 0);
+}
+
+#ifdef TCPSNITCH_LEAN
+/* The lean build only counts the calls with a traced socket, once: nothing is
+ * allocated. Ready fds are still marked for the loop lag, at the time of the
+ * hook, as by sock_ev_epoll_wait(). */
+static void count_mux_fd(bool *counted, int fd, short returned) {
+        if (returned) lag_mark_ready(fd, hook_start_ns);
+        if (!*counted) __atomic_add_fetch(&mux_count, 1, __ATOMIC_RELAXED);
+        *counted = true;
+}
+#endif
+
+static void push_mux_event(MuxEvent *ev) {
+        __atomic_add_fetch(&mux_count, 1, __ATOMIC_RELAXED);
+        mutex_lock(&mux_mutex);
+        if (tail)
+                tail->next = ev;
+        else
+                head = ev;
+        tail = ev;
+        __atomic_add_fetch(&pending_count, 1, __ATOMIC_RELAXED);
+        mutex_unlock(&mux_mutex);
+}
+
+static void free_mux_events(MuxEvent *ev) {
+        MuxEvent *tmp;
+        while (ev != NULL) {
+                tmp = ev;
+                ev = ev->next;
+                free(tmp);
+        }
+}
+
+static void write_mux_event(FILE *fp, const MuxEvent *ev) {
+        fprintf(fp,
+                "{\"type\": \"%s\", \"timestamp_usec\": %lu, "
+                "\"timestamp_ns\": %llu, \"return_value\": %d, ",
+                string_from_sock_event_type(ev->type),
+                wall_micros_from_ns(ev->timestamp_ns),
+                (unsigned long long)ev->timestamp_ns, ev->return_value);
+        if (ev->return_value < 0) {
+                char *errno_str = alloc_errno_str(ev->err);
+                fprintf(fp, "\"errno\": \"%s\", ", errno_str);
+                free(errno_str);
+        }
+        fprintf(fp, "\"thread_id\": %d, \"timeout_ns\": %lld, \"fds\": [",
+                ev->thread_id, (long long)ev->timeout_ns);
+        for (int i = 0; i < ev->fds_count; i++) {
+                const MuxFd *mux_fd = &ev->fds[i];
+                fprintf(fp,
+                        "%s{\"fd\": %d, \"socket\": %d, \"requested\": %hd, "
+                        "\"returned\": %hd}",
+                        i ? ", " : "", mux_fd->fd, mux_fd->sock_id,
+                        mux_fd->requested, mux_fd->returned);
+        }
+        fputs("]}\n", fp);
+}
+
+/* Public functions */
+
+void mux_ev_poll(SockEventType type, int ret, int err,
+                 const struct pollfd *fds, nfds_t nfds, int64_t timeout_ns) {
+        init_tcpsnitch();
+        if (!is_recorded(type)) return;
+        MuxEvent *ev = NULL;
+#ifdef TCPSNITCH_LEAN
+        bool counted = false;
+#endif
+        for (nfds_t i = 0; i < nfds; i++) {
+                int fd = fds[i].fd;
+                if (fd < 0 || !is_traced_socket(fd)) continue;  // < 0: ignored
+                int id = sock_ev_socket_id(fd);
+                if (id < 0) continue;  // Sampled or filtered out.
+#ifdef TCPSNITCH_LEAN
+                count_mux_fd(&counted, fd, fds[i].revents);
+                continue;
+#endif
+                if (!ev && !(ev = alloc_mux_event(type, ret, err, timeout_ns,
+                                                  nfds - i)))
+                        goto error;
+                add_fd(ev, fd, id, fds[i].events, fds[i].revents);
+        }
+        if (ev) push_mux_event(ev);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+void save_select_sets(SelectSets *req, int nfds, const fd_set *readfds,
+                      const fd_set *writefds, const fd_set *exceptfds) {
+        if (nfds < 0) nfds = 0;  // select() fails with EINVAL.
+        req->words = (nfds + FD_WORD_BITS - 1) / FD_WORD_BITS;
+        req->read = req->buf;
+        if (req->words > (int)FD_WORDS &&
+            !(req->read = (unsigned long *)my_malloc(
+                  3 * req->words * sizeof(unsigned long)))) {
+                LOG_FUNC_ERROR;  // Only the first FD_SETSIZE fds are seen.
+                req->words = FD_WORDS;
+                req->read = req->buf;
+        }
+        req->write = req->read + req->words;
+        req->except = req->write + req->words;
+        copy_words(req->read, readfds, req->words);
+        copy_words(req->write, writefds, req->words);
+        copy_words(req->except, exceptfds, req->words);
+}
+
+void free_select_sets(SelectSets *req) {
+        if (req->read != req->buf) free(req->read);
+}
+
+/* The sets are only meaningful on success: they are cleared on timeout and
+ * undefined on error, in which case no event is returned. */
+void mux_ev_select(SockEventType type, int ret, int err, const SelectSets *req,
+                   const fd_set *readfds, const fd_set *writefds,
+                   const fd_set *exceptfds, int64_t timeout_ns) {
+        init_tcpsnitch();
+        if (!is_recorded(type)) return;
+        int max_fds = 0;
+        for (int w = 0; w < req->words; w++)
+                max_fds += __builtin_popcountl(req->read[w] | req->write[w] |
+                                               req->except[w]);
+        if (!max_fds) return;
+
+        MuxEvent *ev = NULL;
+#ifdef TCPSNITCH_LEAN
+        bool counted = false;
+#endif
+        for (int w = 0; w < req->words; w++) {
+                unsigned long bits =
+                    req->read[w] | req->write[w] | req->except[w];
+                while (bits) {
+                        int bit = __builtin_ctzl(bits);
+                        bits &= bits - 1;
+                        int fd = w * FD_WORD_BITS + bit;
+                        if (!is_traced_socket(fd)) continue;
+                        int id = sock_ev_socket_id(fd);
+                        if (id < 0) continue;  // Sampled or filtered out.
+                        short returned =
+                            ret > 0 ? get_returned(readfds, writefds,
+                                                   exceptfds, fd)
+                                    : 0;
+#ifdef TCPSNITCH_LEAN
+                        count_mux_fd(&counted, fd, returned);
+                        continue;
+#endif
+                        if (!ev && !(ev = alloc_mux_event(type, ret, err,
+                                                          timeout_ns, max_fds)))
+                                goto error;
+                        unsigned long mask = 1UL << bit;
+                        short requested = (req->read[w] & mask ? POLLIN : 0) |
+                                          (req->write[w] & mask ? POLLOUT : 0) |
+                                          (req->except[w] & mask ? POLLPRI : 0);
+                        add_fd(ev, fd, id, requested, returned);
+                }
+        }
+        if (ev) push_mux_event(ev);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+/* Records are detached under the lock and written without it, so that calls
+ * are not held by the file writes. */
+void dump_mux_events(void) {
+        mutex_lock(&mux_mutex);
+        MuxEvent *ev = head;
+        head = tail = NULL;
+        __atomic_store_n(&pending_count, 0, __ATOMIC_RELAXED);
+        mutex_unlock(&mux_mutex);
+        if (!ev) return;
+
+        char *path;
+        FILE *fp;
+        if (!logs_dir_path) goto exit;  // No -d, nothing is written.
+        if (!(path = alloc_concat_path(logs_dir_path, MUX_FILE))) goto error1;
+        fp = fopen(path, "a");
+        free(path);
+        if (!fp) goto error2;
+        for (const MuxEvent *cur = ev; cur != NULL; cur = cur->next)
+                write_mux_event(fp, cur);
+        my_fclose(fp);
+        goto exit;
+error2:
+        LOG(ERROR, "fopen() failed. %s.", strerror(errno));
+error1:
+        LOG_FUNC_ERROR;
+exit:
+        free_mux_events(ev);
+}
+
+void mux_ev_log_stats(void) {
+        unsigned long count = __atomic_load_n(&mux_count, __ATOMIC_RELAXED);
+        if (count) LOG(INFO, "%lu multiplexing calls recorded.", count);
+        count = __atomic_load_n(&dropped_count, __ATOMIC_RELAXED);
+        if (count)
+                LOG(WARN, "%lu multiplexing calls not recorded, over %d "
+                          "records not dumped yet.",
+                    count, MUX_MAX_PENDING);
+}
+
+// Held across fork(), so that the child does not find the list mid-update.
+void mux_ev_prepare_fork(void) { mutex_lock(&mux_mutex); }
+
+void mux_ev_parent_after_fork(void) { mutex_unlock(&mux_mutex); }
+
+void mux_ev_reset(void) {
+        mutex_init(&mux_mutex);
+        // Those are the parent's. Left behind rather than freed, which would
+        // copy their pages.
+        head = tail = NULL;
+        mux_count = 0;
+        pending_count = 0;
+        dropped_count = 0;
+}
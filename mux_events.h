@@ -0,0 +1,76 @@
+#ifndef MUX_EVENTS_H
+#define MUX_EVENTS_H
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include "sock_events.h"
+
+/* Multiplexing calls are recorded once per call, rather than once per socket.
+ * A record lists the traced sockets of the call, by fd and socket id, with
+ * their requested and returned events as poll() bitmasks. Records are kept per
+ * process and appended to mux.txt in the logs dir, one JSON object per line,
+ * whenever socket events are dumped. The view of a socket is the entries with
+ * its id. The lean build only counts the records.
+ *
+ * At most MUX_MAX_PENDING records are kept between two dumps, e.g. without -t
+ * until the process exits. The calls over it are counted and logged.
+ *
+ * The read, write and except sets of select() are mapped to POLLIN, POLLOUT
+ * and POLLPRI, as the kernel does. Sets are scanned a word at a time, so that
+ * only the fds actually set are looked at. Applications may pass sets larger
+ * than an fd_set, with nfds above FD_SETSIZE: those are copied to the heap. */
+
+typedef struct {
+        int fd;
+        int sock_id;
+        short requested;
+        short returned;
+} MuxFd;
+
+typedef struct MuxEvent MuxEvent;
+struct MuxEvent {
+        SockEventType type;
+        uint64_t timestamp_ns;
+        pid_t thread_id;
+        int return_value;
+        int err;
+        int64_t timeout_ns;  // -1 if none.
+        int fds_count;
+        MuxEvent *next;
+        MuxFd fds[];
+};
+
+#define MUX_MAX_PENDING 65536
+
+#define FD_WORD_BITS (8 * sizeof(unsigned long))
+#define FD_WORDS (FD_SETSIZE / FD_WORD_BITS)
+
+// Sets requested by a select() call, saved as the call overwrites them.
+typedef struct {
+        int words;
+        unsigned long *read;  // In buf, or allocated over FD_SETSIZE.
+        unsigned long *write;
+        unsigned long *except;
+        unsigned long buf[3 * FD_WORDS];
+} SelectSets;
+
+void mux_ev_poll(SockEventType type, int ret, int err,
+                 const struct pollfd *fds, nfds_t nfds, int64_t timeout_ns);
+
+void save_select_sets(SelectSets *req, int nfds, const fd_set *readfds,
+                      const fd_set *writefds, const fd_set *exceptfds);
+void free_select_sets(SelectSets *req);
+
+void mux_ev_select(SockEventType type, int ret, int err, const SelectSets *req,
+                   const fd_set *readfds, const fd_set *writefds,
+                   const fd_set *exceptfds, int64_t timeout_ns);
+
+void dump_mux_events(void);
+void mux_ev_log_stats(void);
+void mux_ev_prepare_fork(void);
+void mux_ev_parent_after_fork(void);
+void mux_ev_reset(void);
+
+#endif
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+
+#include "overhead.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "lib.h"
+#include "logger.h"
+#include "string_builders.h"
+
+#define OVERHEAD_FILE "overhead.txt"
+
+_Thread_local uint64_t hook_start_ns = 0;
+_Thread_local uint64_t call_start_ns = 0;
+
+static uint64_t overhead_ns[OVERHEAD_KINDS_COUNT];
+static uint64_t overhead_calls[OVERHEAD_KINDS_COUNT];
+
+static const char *kind_names[] = {"classify", "hook", "tcp_info"};
+
+/* Private functions */
+
+static void append_line(const char *logs_dir, const char *line) {
+        char *path;
+        if (!logs_dir) return;  // No -d, nothing is written.
+        if (!(path = alloc_concat_path(logs_dir, OVERHEAD_FILE))) goto error;
+        append_string_to_file(line, path);
+        free(path);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+/* Public functions */
+
+void overhead_add(OverheadKind kind, uint64_t ns) {
+        __atomic_add_fetch(&overhead_ns[kind], ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&overhead_calls[kind], 1, __ATOMIC_RELAXED);
+}
+
+uint64_t overhead_get_ns(OverheadKind kind) {
+        return __atomic_load_n(&overhead_ns[kind], __ATOMIC_RELAXED);
+}
+
+void dump_socket_overhead(const char *logs_dir, int id, uint64_t ns) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "{\"socket\": %d, \"overhead_ns\": %llu}\n",
+                 id, (unsigned long long)ns);
+        append_line(logs_dir, buf);
+}
+
+void dump_overhead_summary(const char *logs_dir) {
+        char buf[512];
+        int n = snprintf(buf, sizeof(buf), "{\"process\": %d", getpid());
+        for (int i = 0; i < OVERHEAD_KINDS_COUNT; i++) {
+                unsigned long long ns = overhead_get_ns(i);
+                unsigned long long calls = __atomic_load_n(
+                    &overhead_calls[i], __ATOMIC_RELAXED);
+                LOG(INFO, "Overhead of %s: %llu ns in %llu calls.",
+                    kind_names[i], ns, calls);
+                n += snprintf(buf + n, sizeof(buf) - n,
+                              ", \"%s_ns\": %llu, \"%s_calls\": %llu",
+                              kind_names[i], ns, kind_names[i], calls);
+        }
+        snprintf(buf + n, sizeof(buf) - n, "}\n");
+        append_line(logs_dir, buf);
+}
@@ -0,0 +1,53 @@
+#ifndef OVERHEAD_H
+#define OVERHEAD_H
+
+#include <stdint.h>
+#include "timestamp.h"
+
+/* Self-overhead accounting. The time spent by the lib in the libc overrides
+ * is measured and summed per kind of work, process-wide. Each socket also sums
+ * the time of the hooks run on it. The totals are written to overhead.txt in
+ * the logs dir, one JSON object per line: one per socket when it is freed, and
+ * a process summary at exit. The time of the original libc call is never
+ * included. */
+
+typedef enum {
+        OVERHEAD_CLASSIFY,  // is_inet_socket() syscalls, traced or not.
+        OVERHEAD_HOOK,      // sock_ev_*() hooks.
+        OVERHEAD_TCP_INFO,  // TCP_INFO samples, see tcp_sampler.h.
+        OVERHEAD_KINDS_COUNT
+} OverheadKind;
+
+/* Start of the hook running in this thread, 0 if none. Read by the hooks to
+ * account their time to the socket. */
+extern _Thread_local uint64_t hook_start_ns;
+/* Start of the libc call run before the hook, 0 if not timed. Calls are only
+ * timed by the overrides for the -q event recorder, see sock_events.h. */
+extern _Thread_local uint64_t call_start_ns;
+
+/* Run [hook] and account for its time. */
+#define TRACE_HOOK(hook)                                             \
+        {                                                            \
+                uint64_t _start = get_time_ns();                     \
+                hook_start_ns = _start;                              \
+                hook;                                                \
+                hook_start_ns = 0;                                   \
+                call_start_ns = 0;                                   \
+                overhead_add(OVERHEAD_HOOK, get_time_ns() - _start); \
+        }
+
+/* Run [hook] if fd is a traced socket, and account for its time. */
+#define TRACE_CALL(fd, hook)              \
+        {                                 \
+                if (is_traced_socket(fd)) \
+                        TRACE_HOOK(hook)  \
+                else                      \
+                        call_start_ns = 0; \
+        }
+
+void overhead_add(OverheadKind kind, uint64_t ns);
+uint64_t overhead_get_ns(OverheadKind kind);
+void dump_socket_overhead(const char *logs_dir, int id, uint64_t ns);
+void dump_overhead_summary(const char *logs_dir);
+
+#endif
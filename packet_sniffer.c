@@ -1,213 +1,1094 @@
 #define _GNU_SOURCE
 
 #include "packet_sniffer.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include <pcap.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
-#include "constants.h"
-#include "init.h"
+#include "capture_ring.h"
+#include "fd_table.h"
 #include "lib.h"
 #include "logger.h"
-#include "logger.h"
-#include "string_builders.h"
+#include "timestamp.h"
 
-#define BUFFER_SIZE 8 * 100000  // In MB = 8MB
+#define FILTER_NONE "less 1"  // Matches no packet, while no flow is captured.
+/* TCP SYNs to or from an ephemeral port, while connections are captured by
+ * their peer. IPv6 extension headers are not parsed. */
+#define FILTER_SYN                                                      \
+        "(tcp portrange %d-%d and (ip and tcp[tcpflags] & tcp-syn != 0 " \
+        "or ip6 and ip6[53] & 2 != 0))"
+// Any packet to or from an ephemeral port, see capture_start().
+#define FILTER_PENDING "portrange %d-%d"
+#define PORT_RANGE_PATH "/proc/sys/net/ipv4/ip_local_port_range"
+#define MAX_FLOWS_PER_PACKET 8
 
 typedef struct {
-        pcap_t *handle;
-        pcap_dumper_t *dump;
-        bool *switch_flag;
-} CaptureThreadArgs;
+        int family;  // AF_INET or AF_INET6, v4-mapped addresses are AF_INET.
+        uint8_t addr[16];
+        uint16_t port;  // Host byte order.
+        bool any;       // Wildcard address.
+} CaptureAddr;
 
+/* A ring, with the filter of its flows: the union of their local ports, and
+ * of the peers of the flows without a local port yet. It is compiled as is,
+ * and with FILTER_PENDING for while flows are pending. */
 typedef struct {
-        bool *switch_flag;
-        int delay_ms;
-} DelayStopThreadArgs;
+        CaptureRing *ring;
+        uint32_t port_refs[2][65536];  // Flows by protocol & local port.
+        int ports_count[2];            // Ports with at least one flow.
+        int peers_count[2];            // Flows without a local port.
+        int full_flows;  // Flows within their <full> budget.
+        bool filter_dirty;
+        struct bpf_program programs[2];  // Without & with FILTER_PENDING.
+} EngineRing;
 
-/* Internal functions */
+typedef struct {
+        long count;  // -1 for no limit.
+        bool in_bytes;
+} Budget;
 
-static pcap_t *get_capture_handle(void) {
-        char err_buf[PCAP_ERRBUF_SIZE];
-        err_buf[0] = 0;
-        pcap_t *handle = pcap_open_live("any", BUFSIZ, 0, 0, err_buf);
-        if (err_buf[0] != 0) LOG(WARN, "pcap_open_live() warn. %s.", err_buf);
-        if (!handle) goto error;
+typedef struct {
+        struct pcap_pkthdr hdr;
+        uint8_t *data;  // Reused, of data_size bytes.
+        uint32_t data_size;
+} RecordedPacket;
 
-        if (!pcap_set_buffer_size(handle, BUFFER_SIZE))
-                LOG(WARN, "pcap_set_buffer_size() failed.");
+struct CaptureFlow {
+        int protocol;  // IPPROTO_TCP or IPPROTO_UDP.
+        EngineRing *ring;  // Packets of other rings are not dumped.
+        CaptureAddr local;  // Port 0 while connect() picks it.
+        CaptureAddr peer;
+        bool has_peer;
+        struct sockaddr_storage peer_sa;  // To find the egress interface.
+        pcap_dumper_t *dump;  // Opened on the first trigger with a recorder.
+        char *path;
+        long full_left;  // See capture_set_budgets().
+        long headers_left;
+        bool ended;      // Out of budget.
+        RecordedPacket *recorded;  // Circular, see capture_set_recorder().
+        int recorded_start;
+        int recorded_count;
+        uint64_t persist_ns;  // 0, or when to write the recorded packets.
+        uint64_t trigger_us;  // Wall clock, as packet timestamps.
+        uint64_t stop_ns;   // 0 until capture_stop().
+        CaptureFlow *next;  // In its bucket, or in the pending flows.
+};
 
-        return handle;
-error:
-        LOG_FUNC_ERROR;
-        LOG(ERROR, "pcap_open_live() failed. %s.", err_buf);
-        return NULL;
+typedef struct {
+        int protocol;
+        int family;
+        const uint8_t *src;
+        const uint8_t *dst;
+        uint16_t sport;
+        uint16_t dport;
+        uint32_t headers_len;  // Up to the end of the TCP or UDP header.
+} PacketTuple;
+
+/* Flows are hashed on (protocol, local port, peer port), with a peer port of 0
+ * for flows without a peer, and a local port of 0 for flows without a local
+ * port yet. A single ring is opened per interface. */
+/* The kernel only copies the headers of packets to a ring without flows within
+ * their <full> budget. */
+typedef struct {
+        pcap_t *pcap;  // Dead handle, to compile filters & write pcap files.
+        pcap_t *headers_pcap;  // Same, with a CAPTURE_HEADERS_SNAPLEN snaplen.
+        EngineRing *rings[CAPTURE_MAX_RINGS];
+        int rings_count;
+        CaptureFlow *buckets[CAPTURE_BUCKETS];
+        int stopping_count;   // Flows to be reaped, see capture_stop().
+        int triggered_count;  // Flows to be written, see capture_trigger().
+        CaptureAddr cached_addr;  // Last address resolved to an interface.
+        int cached_ifindex;
+        int wake_fd;  // eventfd, wakes the thread up to start pending flows.
+} CaptureEngine;
+
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CaptureEngine *engine = NULL;
+static bool engine_running = false;  // Set once the engine is fully started.
+static bool engine_unavailable = false;  // Not retried, e.g. no permission.
+/* Flows started by the application threads, to be set up by the thread. The
+ * lock also switches the filters of the rings, see capture_start(). */
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CaptureFlow *pending_flows = NULL;
+static int unfiltered_flows = 0;  // Started, their filters not applied yet.
+static int ephemeral_ports[2] = {32768, 60999};
+static Budget full_budget = {-1, false};
+static Budget headers_budget = {-1, false};
+static long recorder_packets = 0;     // 0 without flight recorder.
+static long recorder_window_us = -1;  // -1 for no limit.
+
+/* Private functions */
+
+static int proto_index(int protocol) {
+        return protocol == IPPROTO_TCP ? 0 : 1;
 }
 
-/* This thread captures packets indefinitely until the boolean pointed by
-   switch_flag is turned to false. */
-static void *capture_thread(void *params) {
-        LOG_FUNC_INFO;
-        CaptureThreadArgs *args = (CaptureThreadArgs *)params;
-
-        bool *switch_flag = args->switch_flag;
-        while (*switch_flag) {
-                if (pcap_dispatch(args->handle, -1, &pcap_dump,
-                                  (u_char *)args->dump) == -1) {
-                        LOG(ERROR, "pcap_dispatch() failed. %s.",
-                            pcap_geterr(args->handle));
-                }
+static unsigned bucket_of(int protocol, uint16_t local_port,
+                          uint16_t peer_port) {
+        unsigned h = (unsigned)protocol * 0x9e3779b1u;
+        h ^= local_port * 0x85ebca6bu;
+        h ^= peer_port * 0xc2b2ae35u;
+        return (h ^ (h >> 16)) & (CAPTURE_BUCKETS - 1);
+}
+
+static unsigned flow_bucket(const CaptureFlow *flow) {
+        return bucket_of(flow->protocol, flow->local.port,
+                         flow->has_peer ? flow->peer.port : 0);
+}
+
+static bool fill_capture_addr(CaptureAddr *ca, const struct sockaddr *addr) {
+        memset(ca, 0, sizeof(CaptureAddr));
+        if (addr->sa_family == AF_INET) {
+                const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+                ca->family = AF_INET;
+                memcpy(ca->addr, &in->sin_addr, 4);
+                ca->port = ntohs(in->sin_port);
+                ca->any = in->sin_addr.s_addr == htonl(INADDR_ANY);
+                return true;
         }
+        if (addr->sa_family != AF_INET6) return false;
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        ca->port = ntohs(in6->sin6_port);
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+                ca->family = AF_INET;
+                memcpy(ca->addr, &in6->sin6_addr.s6_addr[12], 4);
+        } else {
+                ca->family = AF_INET6;
+                memcpy(ca->addr, &in6->sin6_addr, 16);
+                // A dual-stack socket also gets IPv4 packets.
+                ca->any = IN6_IS_ADDR_UNSPECIFIED(&in6->sin6_addr);
+        }
+        return true;
+}
 
-        pcap_close(args->handle);
-        pcap_dump_close(args->dump);
-        free(switch_flag);
-        free(args);
-        LOG(INFO, "Capture thread ended.");
-        return NULL;
+static bool addr_matches(const CaptureAddr *ca, int family,
+                         const uint8_t *addr) {
+        if (ca->any) return true;
+        if (ca->family != family) return false;
+        return !memcmp(ca->addr, addr, family == AF_INET ? 4 : 16);
 }
 
-/* The sole purpose of this thread if to wait delay_ms before setting the
- * switch flag to false. We don't want to hang the main thread, we thus do this
- * in another thread to delay the end of the packet capture. */
-static void *delayed_stop_thread(void *params) {
-        LOG_FUNC_INFO;
-        DelayStopThreadArgs *args = (DelayStopThreadArgs *)params;
-        struct timespec ns = {0, args->delay_ms * 1000000};
-        nanosleep(&ns, NULL);
-        *(args->switch_flag) = false;
-        LOG(INFO, "Turned off capture switch.");
-        return NULL;
+static bool flow_matches(const CaptureFlow *flow, const PacketTuple *pkt,
+                         bool from_local) {
+        const uint8_t *local = from_local ? pkt->src : pkt->dst;
+        const uint8_t *peer = from_local ? pkt->dst : pkt->src;
+        uint16_t local_port = from_local ? pkt->sport : pkt->dport;
+        uint16_t peer_port = from_local ? pkt->dport : pkt->sport;
+        if (flow->protocol != pkt->protocol ||
+            (flow->local.port && flow->local.port != local_port))
+                return false;
+        if (!addr_matches(&flow->local, pkt->family, local)) return false;
+        if (!flow->has_peer) return true;
+        return flow->peer.port == peer_port &&
+               addr_matches(&flow->peer, pkt->family, peer);
 }
 
-/* Public functions */
+/* Packets start at their IP header. Only the first fragment has ports, and
+ * IPv6 extension headers are not parsed. */
+static bool parse_packet(const uint8_t *ip, uint32_t len, PacketTuple *pkt) {
+        uint32_t off;
+        if (len >= 20 && (ip[0] >> 4) == 4) {
+                if (((ip[6] & 0x1f) << 8 | ip[7]) != 0) return false;
+                pkt->family = AF_INET;
+                pkt->protocol = ip[9];
+                pkt->src = ip + 12;
+                pkt->dst = ip + 16;
+                off = (ip[0] & 0x0f) * 4;
+        } else if (len >= 40 && (ip[0] >> 4) == 6) {
+                pkt->family = AF_INET6;
+                pkt->protocol = ip[6];
+                pkt->src = ip + 8;
+                pkt->dst = ip + 24;
+                off = 40;
+        } else {
+                return false;
+        }
+        if (pkt->protocol != IPPROTO_TCP && pkt->protocol != IPPROTO_UDP)
+                return false;
+        if (len < off + 4) return false;
+        pkt->sport = (ip[off] << 8) | ip[off + 1];
+        pkt->dport = (ip[off + 2] << 8) | ip[off + 3];
+        pkt->headers_len = off + 8;
+        if (pkt->protocol == IPPROTO_TCP)  // Data offset, options included.
+                pkt->headers_len =
+                    len > off + 12 ? off + (ip[off + 12] >> 4) * 4 : len;
+        return true;
+}
 
-// TODO: Bind to specific IP on host to filter on addr1 host too.
-char *alloc_capture_filter(const struct sockaddr *addr1,
-                           const struct sockaddr *addr2) {
-        LOG_FUNC_INFO;
-        static const char *PORT_FILTER = "port %s";
-        static const char *SINGLE_FILTER = "host %s and port %s";
-        static const char *DOUBLE_FILTER = "port %s and host %s and port %s";
-
-        // Build string rep of hosts/ports
-        char *port1 = NULL, *port2 = NULL, *ip1 = NULL, *ip2 = NULL;
-        if (addr1) {
-                if (!(port1 = alloc_port_str(addr1))) goto error_out;
-                if (!(ip1 = alloc_ip_str(addr1))) goto error1;
-        }
-        if (addr2) {
-                if (!(port2 = alloc_port_str(addr2))) goto error2;
-                if (!(ip2 = alloc_ip_str(addr2))) goto error3;
-        }
-
-        // Build filter string
-        static int n = 200;
-        char *filter = (char *)my_malloc(sizeof(char) * n);
-
-        if (addr1 && addr2)
-                snprintf(filter, n, DOUBLE_FILTER, port1, ip2, port2);
-        else if (addr1)
-                snprintf(filter, n, PORT_FILTER, port1);
-        else if (addr2)
-                snprintf(filter, n, SINGLE_FILTER, ip2, port2);
-
-        LOG(INFO, "Capture filter: '%s'.", filter);
-        free(port1);
-        free(ip1);
-        free(port2);
-        free(ip2);
+static const char *PROTOCOLS[] = {"tcp", "udp"};
+
+// Appends the peers of the flows of [ring] without a local port yet.
+static size_t append_peers(const EngineRing *ring, char *filter, size_t size,
+                           size_t n) {
+        for (int b = 0; b < CAPTURE_BUCKETS; b++) {
+                for (CaptureFlow *f = engine->buckets[b]; f; f = f->next) {
+                        if (f->ring != ring || f->ended || f->local.port)
+                                continue;
+                        char addr[INET6_ADDRSTRLEN];
+                        inet_ntop(f->peer.family, f->peer.addr, addr,
+                                  sizeof(addr));
+                        n += snprintf(filter + n, size - n,
+                                      "%s(%s and host %s and port %d)",
+                                      n ? " or " : "",
+                                      PROTOCOLS[proto_index(f->protocol)],
+                                      addr, f->peer.port);
+                }
+        }
+        return n;
+}
+
+/* Union of the local ports and of the peers of the flows being connected, or
+ * of the protocols when there are too many. With flows being connected, the
+ * TCP SYNs are added. [pending] adds FILTER_PENDING. */
+static char *alloc_filter_str(const EngineRing *ring, bool pending) {
+        size_t size = CAPTURE_FILTER_MAX_PORTS * 80 + 200;
+        char *filter = (char *)my_malloc(size);
+        snprintf(filter, size, FILTER_NONE);
+        bool per_protocol =
+            ring->ports_count[0] + ring->ports_count[1] +
+                ring->peers_count[0] + ring->peers_count[1] >
+            CAPTURE_FILTER_MAX_PORTS;
+        size_t n = 0;
+        if (ring->peers_count[proto_index(IPPROTO_TCP)])
+                n = snprintf(filter, size, FILTER_SYN, ephemeral_ports[0],
+                             ephemeral_ports[1]);
+        if (pending)
+                n += snprintf(filter + n, size - n, "%s" FILTER_PENDING,
+                              n ? " or " : "", ephemeral_ports[0],
+                              ephemeral_ports[1]);
+        for (int p = 0; p < 2; p++) {
+                if (per_protocol) {
+                        if (ring->ports_count[p] || ring->peers_count[p])
+                                n += snprintf(filter + n, size - n, "%s%s",
+                                              n ? " or " : "", PROTOCOLS[p]);
+                        continue;
+                }
+                for (int port = 0; port < 65536; port++) {
+                        if (!ring->port_refs[p][port]) continue;
+                        n += snprintf(filter + n, size - n, "%s%s port %d",
+                                      n ? " or " : "", PROTOCOLS[p], port);
+                }
+        }
+        if (!per_protocol && (ring->peers_count[0] || ring->peers_count[1]))
+                append_peers(ring, filter, size, n);
         return filter;
-error3:
-        free(port2);
+}
+
+// The program is to be freed with pcap_freecode().
+// The snaplen of the handle is that of the program.
+static int compile_filter(const EngineRing *ring, bool pending,
+                          struct bpf_program *prog) {
+        pcap_t *pcap = ring->full_flows ? engine->pcap : engine->headers_pcap;
+        char *filter_str = alloc_filter_str(ring, pending);
+        if (pcap_compile(pcap, prog, filter_str, 1, PCAP_NETMASK_UNKNOWN) < 0)
+                goto error;
+        LOG(INFO, "Capture filter: '%s' (snaplen %d).", filter_str,
+            pcap_snapshot(pcap));
+        free(filter_str);
+        return 0;
+error:
+        LOG(ERROR, "pcap_compile() failed. %s.", pcap_geterr(pcap));
+        free(filter_str);
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+// struct bpf_insn & struct sock_filter are the same.
+static void fill_sock_fprog(struct sock_fprog *fprog,
+                            struct bpf_program *prog) {
+        fprog->len = prog->bf_len;
+        fprog->filter = (struct sock_filter *)prog->bf_insns;
+}
+
+// Both programs of [ring]. The previous ones are to be freed by the caller.
+static int compile_filters(EngineRing *ring) {
+        struct bpf_program programs[2];
+        if (compile_filter(ring, false, &programs[0])) goto error1;
+        if (compile_filter(ring, true, &programs[1])) goto error2;
+        memcpy(ring->programs, programs, sizeof(programs));
+        return 0;
 error2:
-        free(ip1);
+        pcap_freecode(&programs[0]);
 error1:
-        free(port1);
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+// With the pending lock.
+static void set_rings_filter(bool pending) {
+        struct sock_fprog fprog;
+        for (int i = 0; i < engine->rings_count; i++) {
+                fill_sock_fprog(&fprog, &engine->rings[i]->programs[pending]);
+                ring_set_filter(engine->rings[i]->ring, &fprog);
+        }
+}
+
+static int apply_filter(EngineRing *ring) {
+        struct bpf_program old[2];
+        memcpy(old, ring->programs, sizeof(old));
+        if (compile_filters(ring)) goto error;
+        mutex_lock(&pending_mutex);
+        struct sock_fprog fprog;
+        fill_sock_fprog(&fprog, &ring->programs[unfiltered_flows > 0]);
+        int rc = ring_set_filter(ring->ring, &fprog);
+        mutex_unlock(&pending_mutex);
+        pcap_freecode(&old[0]);
+        pcap_freecode(&old[1]);
+        if (rc) goto error;
+        ring->filter_dirty = false;
+        return 0;
+error:
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+/* A flow is filtered on its local port, or on its peer until connect() has
+ * picked its local port. */
+static void ref_flow(EngineRing *ring, const CaptureFlow *flow) {
+        int p = proto_index(flow->protocol);
+        if (!flow->local.port)
+                ring->peers_count[p]++;
+        else if (!ring->port_refs[p][flow->local.port]++)
+                ring->ports_count[p]++;
+        else
+                return;
+        ring->filter_dirty = true;
+}
+
+static void unref_flow(EngineRing *ring, const CaptureFlow *flow) {
+        int p = proto_index(flow->protocol);
+        if (!flow->local.port)
+                ring->peers_count[p]--;
+        else if (!--ring->port_refs[p][flow->local.port])
+                ring->ports_count[p]--;
+        else
+                return;
+        ring->filter_dirty = true;
+}
+
+static void ref_full(EngineRing *ring) {
+        if (!ring->full_flows++) ring->filter_dirty = true;
+}
+
+static void unref_full(EngineRing *ring) {
+        if (!--ring->full_flows) ring->filter_dirty = true;
+}
+
+static void spend(long *left, bool in_bytes, uint32_t len) {
+        if (*left < 0) return;  // No limit.
+        long cost = in_bytes ? (long)len : 1;
+        *left = *left > cost ? *left - cost : 0;
+}
+
+// Returns the length of the packet to dump, whole or headers only.
+static uint32_t spend_budgets(CaptureFlow *flow, const PacketTuple *pkt,
+                              const RingPacket *packet) {
+        if (flow->full_left) {
+                spend(&flow->full_left, full_budget.in_bytes, packet->len);
+                if (!flow->full_left) unref_full(flow->ring);
+                return packet->caplen;
+        }
+        spend(&flow->headers_left, headers_budget.in_bytes, packet->len);
+        return pkt->headers_len < packet->caplen ? pkt->headers_len
+                                                 : packet->caplen;
+}
+
+/* Out of budget, the flow is kept until stopped, but its port is no more
+ * captured. Its pcap file is closed, unless triggers may still write to it. */
+static void end_capture(CaptureFlow *flow) {
+        unref_flow(flow->ring, flow);
+        flow->ended = true;
+        if (!flow->dump || flow->recorded) return;
+        pcap_dump_close(flow->dump);
+        flow->dump = NULL;
+}
+
+// Overwrites the oldest packet once full.
+static void record_packet(CaptureFlow *flow, const struct pcap_pkthdr *hdr,
+                          const uint8_t *data) {
+        int i = (flow->recorded_start + flow->recorded_count) %
+                recorder_packets;
+        if (flow->recorded_count < recorder_packets)
+                flow->recorded_count++;
+        else
+                flow->recorded_start = (i + 1) % recorder_packets;
+        RecordedPacket *packet = &flow->recorded[i];
+        if (packet->data_size < hdr->caplen) {
+                free(packet->data);
+                packet->data = (uint8_t *)my_malloc(hdr->caplen);
+                packet->data_size = hdr->caplen;
+        }
+        packet->hdr = *hdr;
+        memcpy(packet->data, data, hdr->caplen);
+}
+
+static pcap_t *dump_pcap(void) {
+        // The snaplen of a header-only pcap file tells it is truncated.
+        return full_budget.count ? engine->pcap : engine->headers_pcap;
+}
+
+/* Writes the packets recorded within the window before the trigger, and after
+ * it until now, then forgets them. The file is kept for later triggers. */
+static void persist_recorder(CaptureFlow *flow) {
+        engine->triggered_count--;
+        flow->persist_ns = 0;
+        if (!flow->dump && !(flow->dump = pcap_dump_open(dump_pcap(),
+                                                         flow->path)))
+                goto error;
+        int written = 0;
+        for (int n = 0; n < flow->recorded_count; n++) {
+                RecordedPacket *packet =
+                    &flow->recorded[(flow->recorded_start + n) %
+                                    recorder_packets];
+                uint64_t ts_us = packet->hdr.ts.tv_sec * 1000000ULL +
+                                 packet->hdr.ts.tv_usec;
+                if (recorder_window_us >= 0 &&
+                    ts_us + recorder_window_us < flow->trigger_us)
+                        continue;
+                pcap_dump((u_char *)flow->dump, &packet->hdr, packet->data);
+                written++;
+        }
+        pcap_dump_flush(flow->dump);
+        flow->recorded_count = 0;
+        LOG(INFO, "%d recorded packets written to %s.", written, flow->path);
+        return;
+error:
+        LOG(ERROR, "pcap_dump_open() failed. %s.", pcap_geterr(dump_pcap()));
+        LOG_FUNC_ERROR;
+}
+
+static void persist_recorders(uint64_t now) {
+        for (int b = 0; b < CAPTURE_BUCKETS && engine->triggered_count; b++)
+                for (CaptureFlow *f = engine->buckets[b]; f; f = f->next)
+                        if (f->persist_ns && f->persist_ns <= now)
+                                persist_recorder(f);
+}
+
+static void free_flow(CaptureFlow *flow) {
+        if (flow->persist_ns) persist_recorder(flow);
+        if (flow->dump) pcap_dump_close(flow->dump);
+        for (int i = 0; flow->recorded && i < recorder_packets; i++)
+                free(flow->recorded[i].data);
+        free(flow->recorded);
+        free(flow->path);
+        free(flow);
+}
+
+// With the engine lock.
+static void trigger_flow(CaptureFlow *flow, const char *reason) {
+        if (!flow->recorded || flow->persist_ns) return;
+        LOG(INFO, "Flight recorder of %s triggered: %s.", flow->path, reason);
+        // The packets around the trigger may not be out of the ring yet.
+        flow->persist_ns =
+            get_time_ns() + 2 * RING_BLOCK_TIMEOUT_MS * 1000000ULL;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        flow->trigger_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+        engine->triggered_count++;
+}
+
+/* A packet is dumped to every flow of the ring it belongs to: over the
+ * loopback, it is sent by one socket and received by another. It is written
+ * to the pcap files straight from the ring, truncated to the budgets of each
+ * flow. A flow without a local port yet only gets the packets of the ports
+ * which belong to no other flow, e.g. not those of an earlier connection to
+ * the same peer. */
+static void demux_packet(const RingPacket *packet, void *arg) {
+        EngineRing *ring = (EngineRing *)arg;
+        PacketTuple pkt;
+        if (!parse_packet(packet->data, packet->caplen, &pkt)) return;
+        struct pcap_pkthdr hdr;
+        hdr.ts.tv_sec = packet->sec;
+        hdr.ts.tv_usec = packet->nsec / 1000;
+        hdr.len = packet->len;
+        const struct {
+                uint16_t local_port;
+                uint16_t peer_port;
+                bool from_local;
+        } keys[] = {{pkt.sport, pkt.dport, true},
+                    {pkt.dport, pkt.sport, false},
+                    {pkt.sport, 0, true},
+                    {pkt.dport, 0, false},
+                    {0, pkt.dport, true},
+                    {0, pkt.sport, false}};
+
+        CaptureFlow *dumped[MAX_FLOWS_PER_PACKET];
+        int dumped_count = 0;
+        bool port_owned[2] = {false, false};  // By from_local.
+        for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+                bool by_peer = !keys[k].local_port;
+                if (by_peer && port_owned[keys[k].from_local]) continue;
+                unsigned b = bucket_of(pkt.protocol, keys[k].local_port,
+                                       keys[k].peer_port);
+                CaptureFlow *flow = engine->buckets[b];
+                for (; flow; flow = flow->next) {
+                        if (flow->ring != ring || flow->ended ||
+                            by_peer != !flow->local.port ||
+                            !flow_matches(flow, &pkt, keys[k].from_local))
+                                continue;
+                        if (!by_peer) port_owned[keys[k].from_local] = true;
+                        int i = 0;
+                        while (i < dumped_count && dumped[i] != flow) i++;
+                        if (i < dumped_count) continue;  // Already dumped.
+                        if (dumped_count == MAX_FLOWS_PER_PACKET) return;
+                        dumped[dumped_count++] = flow;
+                        hdr.caplen = spend_budgets(flow, &pkt, packet);
+                        if (flow->recorded)
+                                record_packet(flow, &hdr, packet->data);
+                        else
+                                pcap_dump((u_char *)flow->dump, &hdr,
+                                          packet->data);
+                        if (!flow->full_left && !flow->headers_left)
+                                end_capture(flow);
+                }
+        }
+}
+
+static void reap_flows(uint64_t now) {
+        for (int b = 0; b < CAPTURE_BUCKETS; b++) {
+                CaptureFlow **prev = &engine->buckets[b];
+                while (*prev) {
+                        CaptureFlow *flow = *prev;
+                        if (!flow->stop_ns || flow->stop_ns > now) {
+                                prev = &flow->next;
+                                continue;
+                        }
+                        *prev = flow->next;
+                        if (flow->full_left) unref_full(flow->ring);
+                        if (!flow->ended) unref_flow(flow->ring, flow);
+                        free_flow(flow);
+                        engine->stopping_count--;
+                }
+        }
+}
+
+static void flush_dumps(void) {
+        for (int b = 0; b < CAPTURE_BUCKETS; b++)
+                for (CaptureFlow *f = engine->buckets[b]; f; f = f->next)
+                        if (f->dump) pcap_dump_flush(f->dump);
+}
+
+static void read_rings(void) {
+        for (int i = 0; i < engine->rings_count; i++)
+                ring_read(engine->rings[i]->ring, demux_packet,
+                          engine->rings[i]);
+}
+
+static bool addr_equals(const CaptureAddr *a, const CaptureAddr *b) {
+        return a->family == b->family && !memcmp(a->addr, b->addr, 16);
+}
+
+// Source address of the route to [peer], without sending anything.
+static bool route_source(const struct sockaddr *peer, CaptureAddr *src) {
+        socklen_t len = peer->sa_family == AF_INET6
+                            ? sizeof(struct sockaddr_in6)
+                            : sizeof(struct sockaddr_in);
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        // Raw syscalls, which spare the socket to the overrides.
+        int fd = syscall(SYS_socket, peer->sa_family, SOCK_DGRAM | SOCK_CLOEXEC,
+                         0);
+        if (fd < 0) goto error;
+        bool ok = !syscall(SYS_connect, fd, peer, len) &&
+                  !syscall(SYS_getsockname, fd, &addr, &addr_len) &&
+                  fill_capture_addr(src, (struct sockaddr *)&addr);
+        syscall(SYS_close, fd);
+        return ok;
+error:
+        LOG(ERROR, "socket() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return false;
+}
+
+static int ifindex_of_addr(const CaptureAddr *addr) {
+        if (addr_equals(addr, &engine->cached_addr))
+                return engine->cached_ifindex;
+        struct ifaddrs *ifaddrs;
+        if (getifaddrs(&ifaddrs)) goto error;
+        int ifindex = 0;
+        for (struct ifaddrs *ifa = ifaddrs; ifa && !ifindex;
+             ifa = ifa->ifa_next) {
+                CaptureAddr ca;
+                if (ifa->ifa_addr && fill_capture_addr(&ca, ifa->ifa_addr) &&
+                    addr_equals(&ca, addr))
+                        ifindex = if_nametoindex(ifa->ifa_name);
+        }
+        freeifaddrs(ifaddrs);
+        engine->cached_addr = *addr;
+        engine->cached_ifindex = ifindex;
+        return ifindex;
+error:
+        LOG(ERROR, "getifaddrs() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return 0;
+}
+
+/* The interface of the local address, or the one the route to the peer goes
+ * through if not bound to an address yet. 0, i.e. all interfaces, for sockets
+ * bound to a wildcard address without a peer. */
+static int egress_ifindex(const CaptureFlow *flow) {
+        if (!flow->local.any) return ifindex_of_addr(&flow->local);
+        CaptureAddr src;
+        const struct sockaddr *peer = (const struct sockaddr *)&flow->peer_sa;
+        if (flow->has_peer && route_source(peer, &src))
+                return ifindex_of_addr(&src);
+        return 0;
+}
+
+// Before the engine runs, no flow is pending yet.
+static EngineRing *open_engine_ring(int ifindex) {
+        EngineRing *engine_ring = (EngineRing *)my_calloc(sizeof(EngineRing));
+        if (compile_filters(engine_ring)) goto error_out;
+        struct sock_fprog fprog;
+        fill_sock_fprog(&fprog, &engine_ring->programs[0]);
+        engine_ring->ring = ring_open(ifindex, &fprog);
+        if (!engine_ring->ring) goto error;
+        engine->rings[engine->rings_count++] = engine_ring;
+        return engine_ring;
+error:
+        pcap_freecode(&engine_ring->programs[0]);
+        pcap_freecode(&engine_ring->programs[1]);
 error_out:
+        free(engine_ring);
         LOG_FUNC_ERROR;
         return NULL;
 }
 
-bool *start_capture(const char *filter_str, const char *path) {
-        LOG_FUNC_INFO;
-        // Get handle
-        pcap_t *handle = get_capture_handle();
-        if (!handle) goto error_out;
+static EngineRing *find_ring(int ifindex) {
+        for (int i = 0; i < engine->rings_count; i++)
+                if (engine->rings[i]->ring->ifindex == ifindex)
+                        return engine->rings[i];
+        return NULL;
+}
+
+/* Rings are only opened at start, and never closed. The flows of the other
+ * interfaces are captured by the ring of all interfaces, of ifindex 0: a ring
+ * opened for a flow would miss its first packets. */
+static EngineRing *get_flow_ring(int ifindex) {
+        EngineRing *ring = find_ring(ifindex);
+        return ring ? ring : find_ring(0);
+}
 
-        // Compile filter
-        struct bpf_program comp_filter;
-        if (pcap_compile(handle, &comp_filter, filter_str, 1,
-                         PCAP_NETMASK_UNKNOWN) < 0) {
-                LOG(ERROR, "pcap_compile() failed. %s.", pcap_geterr(handle));
-                goto error1;
+/* A flow is set up by the thread, once its packets may be in a ring: the first
+ * ones are caught by FILTER_PENDING meanwhile. A flow which cannot be set up
+ * is kept, ended, until stopped. */
+static void start_flow(CaptureFlow *flow) {
+        flow->ring = get_flow_ring(egress_ifindex(flow));
+        if (!flow->ring) goto error;
+        if (!flow->recorded &&
+            !(flow->dump = pcap_dump_open(dump_pcap(), flow->path))) {
+                LOG(ERROR, "pcap_dump_open() failed. %s.",
+                    pcap_geterr(dump_pcap()));
+                goto error;
         }
+        ref_flow(flow->ring, flow);
+        if (flow->full_left) ref_full(flow->ring);
+        return;
+error:
+        flow->ring = NULL;
+        flow->full_left = 0;
+        flow->ended = true;
+        LOG_FUNC_ERROR;
+}
+
+static void link_flow(CaptureFlow *flow) {
+        unsigned b = flow_bucket(flow);
+        flow->next = engine->buckets[b];
+        engine->buckets[b] = flow;
+}
+
+static void unlink_flow(CaptureFlow *flow) {
+        CaptureFlow **prev = &engine->buckets[flow_bucket(flow)];
+        while (*prev != flow) prev = &(*prev)->next;
+        *prev = flow->next;
+}
 
-        // Apply filter
-        if (pcap_setfilter(handle, &comp_filter) < 0) {
-                LOG(ERROR, "pcap_setfilter() failed. %s.", pcap_geterr(handle));
-                goto error1;
+static void apply_dirty_filters(void) {
+        for (int i = 0; i < engine->rings_count; i++)
+                if (engine->rings[i]->filter_dirty)
+                        apply_filter(engine->rings[i]);
+}
+
+/* With the engine lock. The rings keep FILTER_PENDING until the filters of
+ * the flows are applied. */
+static void start_pending_flows(void) {
+        int count = 0;
+        mutex_lock(&pending_mutex);
+        CaptureFlow *flow = pending_flows;
+        pending_flows = NULL;
+        mutex_unlock(&pending_mutex);
+        while (flow) {
+                CaptureFlow *next = flow->next;
+                start_flow(flow);
+                link_flow(flow);
+                flow = next;
+                count++;
         }
+        apply_dirty_filters();
+        if (!count) return;
+        mutex_lock(&pending_mutex);
+        unfiltered_flows -= count;
+        if (!unfiltered_flows) set_rings_filter(false);
+        mutex_unlock(&pending_mutex);
+}
 
-        // Set capture handle into 'non-blocking' mode
-        char errbuf[PCAP_ERRBUF_SIZE];
-        if (pcap_setnonblock(handle, 1, errbuf) == -1) {
-                LOG(ERROR, "pcap_setnonblock() failed. %s.", errbuf);
-                goto error1;
+/* Packets are read while holding the engine lock. The pending flows are set up
+ * first, so that their packets are dumped, then the filters are updated. The
+ * thread sleeps until a block is retired in a ring, or until woken up by a new
+ * flow. */
+static void *capture_thread(void *params) {
+        UNUSED(params);
+        LOG_FUNC_INFO;
+        struct pollfd pfds[CAPTURE_MAX_RINGS + 1];
+        while (true) {
+                mutex_lock(&engine_mutex);
+                int count = engine->rings_count;
+                for (int i = 0; i < count; i++) {
+                        pfds[i].fd = engine->rings[i]->ring->fd;
+                        pfds[i].events = POLLIN;
+                }
+                pfds[count].fd = engine->wake_fd;
+                pfds[count].events = POLLIN;
+                mutex_unlock(&engine_mutex);
+                if (poll(pfds, count + 1, CAPTURE_POLL_MS) < 0 &&
+                    errno != EINTR)
+                        LOG(ERROR, "poll() failed. %s.", strerror(errno));
+                eventfd_t value;
+                if (pfds[count].revents & POLLIN)
+                        eventfd_read(pfds[count].fd, &value);
+                mutex_lock(&engine_mutex);
+                start_pending_flows();
+                read_rings();
+                if (engine->triggered_count) persist_recorders(get_time_ns());
+                if (engine->stopping_count) reap_flows(get_time_ns());
+                mutex_unlock(&engine_mutex);
         }
+        return NULL;
+}
 
-        // Open a file to which to write packets.
-        // The pcap_dumper_t * can be passed to pcap_dump.
-        pcap_dumper_t *dump = pcap_dump_open(handle, path);
-        if (dump == NULL) {
-                LOG(ERROR, "pcap_dump_open() failed. %s.", pcap_geterr(handle));
-                goto error1;
+// The range of the kernel, for FILTER_SYN.
+static void read_ephemeral_ports(void) {
+        FILE *fp = fopen(PORT_RANGE_PATH, "r");
+        if (!fp) goto error;
+        int range[2];
+        if (fscanf(fp, "%d %d", &range[0], &range[1]) == 2) {
+                ephemeral_ports[0] = range[0];
+                ephemeral_ports[1] = range[1];
         }
+        my_fclose(fp);
+        return;
+error:
+        LOG(WARN, "fopen() of %s failed. %s.", PORT_RANGE_PATH,
+            strerror(errno));
+}
 
-        // Alloc flag for controlling capture end. This flag can be turned off
-        // at any time by called thread to end the capture.
-        bool *switch_flag = my_malloc(sizeof(bool));
-        (*switch_flag) = true;
+/* Rings are opened for the interfaces which are up, so that the first
+ * connections need not wait for theirs. Each ring takes RING_BLOCKS *
+ * RING_BLOCK_SIZE of kernel memory in every traced process, hence the bound
+ * of CAPTURE_MAX_RINGS, with the ring of all interfaces. */
+static void open_interface_rings(void) {
+        struct ifaddrs *ifaddrs;
+        if (getifaddrs(&ifaddrs)) goto error;
+        for (struct ifaddrs *ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+                if (!ifa->ifa_addr || !(ifa->ifa_flags & IFF_UP)) continue;
+                if (ifa->ifa_addr->sa_family != AF_INET &&
+                    ifa->ifa_addr->sa_family != AF_INET6)
+                        continue;
+                int ifindex = if_nametoindex(ifa->ifa_name);
+                if (ifindex && engine->rings_count < CAPTURE_MAX_RINGS &&
+                    !find_ring(ifindex))
+                        open_engine_ring(ifindex);
+        }
+        freeifaddrs(ifaddrs);
+        return;
+error:
+        LOG(ERROR, "getifaddrs() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+}
 
-        // Start capture in another thread.
-        CaptureThreadArgs *args =
-            (CaptureThreadArgs *)my_malloc(sizeof(CaptureThreadArgs));
-        args->handle = handle;
-        args->dump = dump;
-        args->switch_flag = switch_flag;
+// With the engine lock.
+static bool start_engine(void) {
+        if (engine) return true;
+        if (engine_unavailable) return false;
+        engine = (CaptureEngine *)my_calloc(sizeof(CaptureEngine));
+        engine->pcap = pcap_open_dead(DLT_RAW, BUFSIZ);
+        if (!engine->pcap) goto error1;
+        engine->headers_pcap = pcap_open_dead(DLT_RAW, CAPTURE_HEADERS_SNAPLEN);
+        if (!engine->headers_pcap) goto error2;
+        read_ephemeral_ports();
+        // The first ring tells whether capture is permitted at all.
+        if (!open_engine_ring(0)) goto error3;
+        engine->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (engine->wake_fd < 0) goto error4;
+        fd_table_set(engine->wake_fd, FD_UNTRACED | FD_OWN);
+        open_interface_rings();
 
         pthread_t thread;
-        if (my_pthread_create(&thread, NULL, capture_thread, args)) goto error4;
-        return switch_flag;
+        if (my_pthread_create(&thread, NULL, capture_thread, NULL))
+                goto error5;
+        __atomic_store_n(&engine_running, true, __ATOMIC_RELEASE);
+        LOG(INFO, "Capture engine started.");
+        return true;
+error5:
+        close(engine->wake_fd);
+        goto error_rings;
 error4:
-        free(args);
-        free(switch_flag);
-        pcap_dump_close(dump);
+        LOG(ERROR, "eventfd() failed. %s.", strerror(errno));
+error_rings:
+        for (int i = 0; i < engine->rings_count; i++) {
+                ring_close(engine->rings[i]->ring);
+                pcap_freecode(&engine->rings[i]->programs[0]);
+                pcap_freecode(&engine->rings[i]->programs[1]);
+                free(engine->rings[i]);
+        }
+error3:
+        pcap_close(engine->headers_pcap);
+error2:
+        pcap_close(engine->pcap);
+        goto error_out;
 error1:
-        pcap_close(handle);
+        LOG(ERROR, "pcap_open_dead() failed.");
 error_out:
+        free(engine);
+        engine = NULL;
         LOG_FUNC_ERROR;
-        return NULL;
+        LOG(WARN, "No packet capture.");
+        __atomic_store_n(&engine_unavailable, true, __ATOMIC_RELAXED);
+        return false;
 }
 
-int stop_capture(bool *switch_flag, int delay_ms) {
-        LOG_FUNC_INFO;
-        // Prepare args for thread
-        DelayStopThreadArgs *args =
-            (DelayStopThreadArgs *)my_malloc(sizeof(DelayStopThreadArgs));
-        args->switch_flag = switch_flag;
-        args->delay_ms = delay_ms;
+static bool parse_budget(const char *str, Budget *budget) {
+        char *end;
+        errno = 0;
+        long count = strtol(str, &end, 10);
+        if (end == str || count < 0 || errno) return false;
+        budget->count = count;
+        budget->in_bytes = *end == 'B';
+        if (budget->in_bytes) end++;
+        return *end == '\0';
+}
 
-        // Start thread
-        pthread_t thread;
-        if (my_pthread_create(&thread, NULL, delayed_stop_thread, args)) {
-                *(switch_flag) = false;
+/* Public functions */
+
+// Before the first capture_start(). [spec] may be NULL, for no budgets.
+bool capture_set_budgets(const char *spec) {
+        Budget full = {-1, false}, headers = {-1, false};
+        char *str = NULL;
+        if (!spec) goto set;
+
+        str = strdup(spec);
+        char *slash = strchr(str, '/');
+        if (slash) *slash = '\0';
+        if (!parse_budget(str, &full)) goto error;
+        if (slash && !parse_budget(slash + 1, &headers)) goto error;
+        if (!full.count && !headers.count) goto error;  // Nothing to capture.
+        free(str);
+set:
+        full_budget = full;
+        headers_budget = headers;
+        return true;
+error:
+        LOG(ERROR, "Invalid capture budgets '%s'. No budgets.", spec);
+        free(str);
+        return false;
+}
+
+/* "<packets>[/<sec>]". Before the first capture_start(). */
+bool capture_set_recorder(const char *spec) {
+        const char *str = spec;
+        char *end;
+        errno = 0;
+        long packets = strtol(str, &end, 10);
+        if (end == str || packets <= 0 || packets > CAPTURE_RECORDER_MAX ||
+            errno)
                 goto error;
+        long window_sec = -1;
+        if (*end == '/') {
+                str = end + 1;
+                window_sec = strtol(str, &end, 10);
+                if (end == str || window_sec <= 0 || errno) goto error;
         }
-        return 0;
+        if (*end != '\0') goto error;
+        recorder_packets = packets;
+        recorder_window_us = window_sec < 0 ? -1 : window_sec * 1000000;
+        return true;
+error:
+        LOG(ERROR, "Invalid flight recorder '%s'. No flight recorder.", spec);
+        return false;
+}
+
+bool capture_is_available(void) {
+        return !__atomic_load_n(&engine_unavailable, __ATOMIC_RELAXED);
+}
+
+/* At init, after capture_set_budgets() & capture_set_recorder(). Otherwise,
+ * the engine is started by the first capture_start(). */
+bool capture_prewarm(void) {
+        mutex_lock(&engine_mutex);
+        bool started = start_engine();
+        mutex_unlock(&engine_mutex);
+        return started;
+}
+
+/* Starts the capture of the packets between [local] & [peer], to [path]. The
+ * flow is only queued to the capture thread: the caller does not wait for the
+ * route lookup, the pcap file, nor the filter. Until the filter is applied,
+ * the rings capture FILTER_PENDING, set before returning: before the SYN of a
+ * connect() leaves. [peer] may be NULL. Before connect(), [local] may have no
+ * port: all packets from or to [peer] are then captured until
+ * capture_set_local(). Returns NULL on error. */
+CaptureFlow *capture_start(int protocol, const struct sockaddr *local,
+                           const struct sockaddr *peer, const char *path) {
+        if (!__atomic_load_n(&engine_running, __ATOMIC_ACQUIRE) &&
+            !capture_prewarm())
+                goto error_out;
+        CaptureFlow *flow = (CaptureFlow *)my_calloc(sizeof(CaptureFlow));
+        flow->protocol = protocol;
+        if (!fill_capture_addr(&flow->local, local)) goto error;
+        flow->has_peer = peer && fill_capture_addr(&flow->peer, peer) &&
+                         flow->peer.port;
+        if (!flow->local.port && !flow->has_peer) goto error_port;
+        if (flow->has_peer)
+                memcpy(&flow->peer_sa, peer,
+                       peer->sa_family == AF_INET6
+                           ? sizeof(struct sockaddr_in6)
+                           : sizeof(struct sockaddr_in));
+        flow->full_left = full_budget.count;
+        flow->headers_left = headers_budget.count;
+        flow->path = strdup(path);
+        if (recorder_packets)
+                flow->recorded = (RecordedPacket *)my_calloc(
+                    recorder_packets * sizeof(RecordedPacket));
+
+        mutex_lock(&pending_mutex);
+        if (!unfiltered_flows++) set_rings_filter(true);
+        flow->next = pending_flows;
+        pending_flows = flow;
+        mutex_unlock(&pending_mutex);
+        eventfd_write(engine->wake_fd, 1);
+        return flow;
+error_port:
+        LOG(ERROR, "Neither a local port nor a peer.");
+        free(flow);
+        goto error_out;
 error:
-        LOG(ERROR, "Ending packet capture immediately.");
+        LOG(ERROR, "Unsupported address family %d.", local->sa_family);
+        free(flow);
+error_out:
         LOG_FUNC_ERROR;
-        return -1;
+        return NULL;
+}
+
+/* Once connect() has picked the local address of [flow], it is filtered on its
+ * local port instead of its peer. */
+void capture_set_local(CaptureFlow *flow, const struct sockaddr *local) {
+        CaptureAddr addr;
+        if (!fill_capture_addr(&addr, local) || !addr.port) return;
+        mutex_lock(&engine_mutex);
+        if (flow->local.port) goto exit;
+        if (!flow->ring && !flow->ended) {  // Still pending.
+                flow->local = addr;
+                goto exit;
+        }
+        unlink_flow(flow);
+        if (!flow->ended) unref_flow(flow->ring, flow);
+        flow->local = addr;
+        if (!flow->ended) ref_flow(flow->ring, flow);
+        link_flow(flow);
+exit:
+        mutex_unlock(&engine_mutex);
+}
+
+/* The flow is still captured for [delay_us], e.g. to get the last ACKs after
+ * close(), then freed by the capture thread. It must not be used anymore. */
+void capture_stop(CaptureFlow *flow, long delay_us) {
+        if (delay_us < 0) delay_us = 0;
+        mutex_lock(&engine_mutex);
+        if (!flow->stop_ns) engine->stopping_count++;
+        // The last packets wait in the ring until their block is retired.
+        flow->stop_ns = get_time_ns() + (uint64_t)delay_us * 1000 +
+                        2 * RING_BLOCK_TIMEOUT_MS * 1000000ULL;
+        mutex_unlock(&engine_mutex);
+}
+
+/* The recorded packets of [flow] are written to its pcap file shortly, with
+ * those which follow in the meantime. [reason] is logged. */
+void capture_trigger(CaptureFlow *flow, const char *reason) {
+        mutex_lock(&engine_mutex);
+        trigger_flow(flow, reason);
+        mutex_unlock(&engine_mutex);
+}
+
+void capture_trigger_all(const char *reason) {
+        mutex_lock(&engine_mutex);
+        for (int b = 0; engine && b < CAPTURE_BUCKETS; b++)
+                for (CaptureFlow *f = engine->buckets[b]; f; f = f->next)
+                        if (f->recorded_count) trigger_flow(f, reason);
+        mutex_unlock(&engine_mutex);
+}
+
+/* At exit, the capture thread is not joined: the rings are read here. The last
+ * packets are in blocks yet to be retired, which takes RING_BLOCK_TIMEOUT_MS
+ * at most. */
+void capture_flush(void) {
+        mutex_lock(&engine_mutex);
+        if (!engine) goto exit;
+        uint64_t deadline =
+            get_time_ns() + 2 * RING_BLOCK_TIMEOUT_MS * 1000000ULL;
+        start_pending_flows();
+        read_rings();
+        while (get_time_ns() < deadline) {
+                struct pollfd pfds[CAPTURE_MAX_RINGS];
+                int count = 0;
+                for (int i = 0; i < engine->rings_count; i++) {
+                        if (!ring_has_pending(engine->rings[i]->ring))
+                                continue;
+                        pfds[count].fd = engine->rings[i]->ring->fd;
+                        pfds[count++].events = POLLIN;
+                }
+                if (!count) break;
+                poll(pfds, count, RING_BLOCK_TIMEOUT_MS);
+                read_rings();
+        }
+        persist_recorders(UINT64_MAX);
+        flush_dumps();
+exit:
+        mutex_unlock(&engine_mutex);
+}
+
+/* The lock is held across fork(), with the pcap files flushed: the child would
+ * otherwise write the buffered packets again when it exits. */
+void capture_prepare_fork(void) {
+        mutex_lock(&engine_mutex);
+        if (!engine) return;
+        flush_dumps();
+}
+
+void capture_parent_after_fork(void) { mutex_unlock(&engine_mutex); }
+
+/* In the child. The engine is the parent's: its thread did not survive fork()
+ * and its pcap files are the parent's to write. It is left behind, only the
+ * child's copies of the rings are closed. */
+void reset_packet_sniffer(void) {
+        mutex_init(&engine_mutex);
+        mutex_init(&pending_mutex);
+        for (int i = 0; engine && i < engine->rings_count; i++)
+                ring_close(engine->rings[i]->ring);
+        if (engine) close(engine->wake_fd);
+        engine = NULL;
+        engine_running = false;
+        engine_unavailable = false;
+        pending_flows = NULL;
+        unfiltered_flows = 0;
 }
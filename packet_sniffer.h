@@ -2,14 +2,62 @@
 #define PACKET_SNIFFER_H
 
 #include <netinet/in.h>
-#include <pcap.h>
-#include <pthread.h>
 #include <stdbool.h>
 
-char *alloc_capture_filter(const struct sockaddr *addr1,
-                           const struct sockaddr *addr2);
+/* One capture engine per process, read by a single thread: a capture ring
+ * (see capture_ring.h) per interface the captured sockets go through, the
+ * egress interface of their route. The kernel filter of a ring is the union
+ * of the local ports of its sockets, rebuilt as ports come and go. Packets are
+ * demultiplexed in userspace, by 5-tuple, to a .pcap file per socket, of raw
+ * IP packets. A flow without a peer, e.g. an unconnected UDP socket, gets all
+ * packets to or from its port.
+ *
+ * The engine is started at init, with a ring for all interfaces and a ring per
+ * interface which is up, up to CAPTURE_MAX_RINGS rings of 8MB each (see
+ * capture_ring.h) in every traced process, forked children included. The
+ * flows of the other interfaces go to the ring of all interfaces. New flows
+ * are handed to the capture thread, which updates the filters shortly after:
+ * the application thread never waits for it. Meanwhile, all the packets to or
+ * from an ephemeral port are captured by all the rings, so that connections
+ * are captured from their first packet. Those of a flow between two ports out
+ * of the ephemeral range may be missed until then. A socket is captured
+ * before connect() by its peer, any local port, until the kernel has picked
+ * its port. Meanwhile, the TCP SYNs of the ephemeral ports are also captured
+ * by the ring of the socket. */
 
-bool *start_capture(const char *filters, const char *path);
-int stop_capture(bool *switch_flag, int delay_ms);
+#define CAPTURE_MAX_RINGS 4           // 32MB of rings at most.
+#define CAPTURE_BUCKETS 4096       // Flows hash table, a power of 2.
+#define CAPTURE_FILTER_MAX_PORTS 128  // Beyond, the filter is per protocol.
+#define CAPTURE_POLL_MS 100           // Also the granularity of delayed stops.
+#define CAPTURE_HEADERS_SNAPLEN 120   // Longest IPv4 & TCP headers.
+#define CAPTURE_RECORDER_MAX 65536    // Packets per socket.
+#define CAPTURE_RETRANS_TRIGGER 3     // Between two TCP_INFO samples.
+
+typedef struct CaptureFlow CaptureFlow;
+
+/* Per-socket budgets, "<full>[/<headers>]": the first <full> packets of a
+ * socket are captured whole, the next <headers> up to the end of their TCP or
+ * UDP header, then none. A count ending with 'B' is in bytes on the wire.
+ * There is no limit on <headers> if absent, nor on <full> without budgets. */
+bool capture_set_budgets(const char *spec);
+/* Flight recorder, "<packets>[/<sec>]": the last <packets> of each socket, no
+ * older than <sec>, are kept in memory instead of being written. They are
+ * written to its pcap file on a trigger only: ECONNRESET or ETIMEDOUT from a
+ * call, CAPTURE_RETRANS_TRIGGER retransmissions between two TCP_INFO samples,
+ * or the "record" control command. */
+bool capture_set_recorder(const char *spec);
+bool capture_is_available(void);
+bool capture_prewarm(void);
+CaptureFlow *capture_start(int protocol, const struct sockaddr *local,
+                           const struct sockaddr *peer, const char *path);
+void capture_set_local(CaptureFlow *flow, const struct sockaddr *local);
+void capture_stop(CaptureFlow *flow, long delay_us);
+void capture_trigger(CaptureFlow *flow, const char *reason);
+void capture_trigger_all(const char *reason);
+void capture_flush(void);
+// See pthread_atfork(), reset_packet_sniffer() is run by the child.
+void capture_prepare_fork(void);
+void capture_parent_after_fork(void);
+void reset_packet_sniffer(void);
 
 #endif
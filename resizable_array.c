@@ -9,14 +9,23 @@
 #include "logger.h"
 #include "sock_events.h"
 
-typedef struct {
+typedef struct ElemWrapper ElemWrapper;
+struct ElemWrapper {
         ELEM_TYPE elem;
         pthread_mutex_t mutex;
-} ElemWrapper;
+        int index;
+        int generation;  // See ra_reset_after_fork().
+        // List of the present elements, in insertion order.
+        ElemWrapper *prev;
+        ElemWrapper *next;
+};
 
 static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
 static ElemWrapper **array = NULL;
 static int size = 0;
+static ElemWrapper *head = NULL;
+static ElemWrapper *tail = NULL;
+static int generation = 0;  // Number of fork() since the process started.
 
 // Private functions
 
@@ -57,6 +66,34 @@ error:
 
 static bool is_index_in_bounds(int index) { return index < size; }
 
+static void link_wrapper(ElemWrapper *ew) {
+        ew->prev = tail;
+        ew->next = NULL;
+        if (tail)
+                tail->next = ew;
+        else
+                head = ew;
+        tail = ew;
+}
+
+// Elements inherited through fork() are reset on their first access.
+static void refresh_wrapper(ElemWrapper *ew) {
+        if (ew->generation == generation) return;
+        RESET_ELEM(ew->index, ew->elem);
+        ew->generation = generation;
+}
+
+static void unlink_wrapper(ElemWrapper *ew) {
+        if (ew->prev)
+                ew->prev->next = ew->next;
+        else
+                head = ew->next;
+        if (ew->next)
+                ew->next->prev = ew->prev;
+        else
+                tail = ew->prev;
+}
+
 /* Public functions */
 
 bool ra_put_elem(int index, ELEM_TYPE elem) {
@@ -64,9 +101,17 @@ bool ra_put_elem(int index, ELEM_TYPE elem) {
         if (!array && !init(index + 1)) goto error;
         if (index > size - 1 && !double_size(index)) goto error;
 
+        if (array[index]) {  // Overwritten, the element is not freed.
+                LOG(WARN, "Element already present at index %d.", index);
+                unlink_wrapper(array[index]);
+                free(array[index]);
+        }
         ElemWrapper *ew = (ElemWrapper *)my_malloc(sizeof(ElemWrapper));
         mutex_init(&ew->mutex);
         ew->elem = elem;
+        ew->index = index;
+        ew->generation = generation;
+        link_wrapper(ew);
 
         array[index] = ew;
         pthread_rwlock_unlock(&rwlock);
@@ -87,6 +132,7 @@ ELEM_TYPE ra_get_and_lock_elem(int index) {
         }
         ElemWrapper *ew = array[index];
         mutex_lock(&ew->mutex);
+        refresh_wrapper(ew);
         return ew->elem;
 error:
         LOG(ERROR, "OOB (index %d, bound %d).", index, size - 1);
@@ -122,7 +168,9 @@ ELEM_TYPE ra_remove_elem(int index) {
         // No need to lock it. Having the rwlock in write mode means no other
         // thread has a valid el or will be able to acquire one.
         mutex_destroy(&ew->mutex);
+        refresh_wrapper(ew);
         ELEM_TYPE el = ew->elem;
+        unlink_wrapper(ew);
         array[index] = NULL;
         free(ew);
         pthread_rwlock_unlock(&rwlock);
@@ -152,6 +200,27 @@ int ra_get_size(void) {
         return ret;
 }
 
+/* The array is write locked across fork(), so that no other thread holds an
+ * element when the child is created. See sock_ev_prepare_fork(). */
+void ra_lock_for_fork(void) { pthread_rwlock_wrlock(&rwlock); }
+
+void ra_unlock_after_fork(void) { pthread_rwlock_unlock(&rwlock); }
+
+/* In the child, which runs a single thread. No element mutex is held, see
+ * ra_lock_for_fork(). Elements are reset lazily, with RESET_ELEM on their
+ * next access, so that the child does not touch their pages on startup. */
+void ra_reset_after_fork(void) {
+        pthread_rwlock_init(&rwlock, NULL);
+        generation++;
+}
+
+// Calls [fn] on each present index, in insertion order. Elements are untouched.
+void ra_for_each_index(void (*fn)(int index)) {
+        pthread_rwlock_rdlock(&rwlock);
+        for (ElemWrapper *ew = head; ew; ew = ew->next) fn(ew->index);
+        pthread_rwlock_unlock(&rwlock);
+}
+
 void ra_free() {
         pthread_rwlock_rdlock(&rwlock);
         for (int i = 0; i < size; i++) {
@@ -165,6 +234,7 @@ void ra_free() {
                 }
         }
         free(array);
+        head = tail = NULL;
         pthread_rwlock_unlock(&rwlock);
         pthread_rwlock_destroy(&rwlock);
 }
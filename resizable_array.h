@@ -6,6 +6,8 @@
 #define ELEM_TYPE Socket*  // Elements stored in the array.
 #define FREE_ELEM(elem) \
         free_socket(elem)  // Routine for freeing an element.
+#define RESET_ELEM(index, elem) \
+        sock_ev_forked_socket(index, elem)  // Reset after fork().
 #define MIN_INIT_SIZE 16         // Starting size of array.
 #define GROWTH_FACTOR 2  // Minimum growth factor when the array is expanded.
 
@@ -17,6 +19,11 @@ void ra_unlock_elem(int index);
 bool ra_is_present(int index);
 int ra_get_size(void);
 
+void ra_lock_for_fork(void);
+void ra_unlock_after_fork(void);
+void ra_reset_after_fork(void);
+void ra_for_each_index(void (*fn)(int index));
+
 void ra_free(void);  // Free state.
 
 #endif
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+
+#include "sock_diag.h"
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "fd_table.h"
+#include "lib.h"
+#include "logger.h"
+
+// All states with an inode, see sock_diag.h.
+#define DIAG_STATES \
+        (((1 << (TCP_CLOSING + 1)) - 1) & ~(1 << TCP_TIME_WAIT))
+
+static pthread_mutex_t diag_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int diag_fd = -1;
+static uint32_t diag_seq = 0;
+static bool diag_unavailable = false;  // Not retried, e.g. denied by SELinux.
+
+/* Private functions */
+
+static int open_diag_socket(void) {
+        if (diag_fd >= 0) return 0;
+        if (diag_unavailable) return -1;
+        int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                        NETLINK_SOCK_DIAG);
+        if (fd < 0) goto error;
+        // Spare the overrides, and survive fd table resets.
+        fd_table_set(fd, FD_UNTRACED | FD_OWN);
+        diag_fd = fd;
+        return 0;
+error:
+        LOG(ERROR, "socket() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        LOG(WARN, "No sock_diag, TCP_INFO only taken with getsockopt().");
+        diag_unavailable = true;
+        return -1;
+}
+
+static int send_request(int family, int protocol) {
+        struct {
+                struct nlmsghdr nlh;
+                struct inet_diag_req_v2 req;
+        } msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.nlh.nlmsg_len = sizeof(msg);
+        msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+        msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        msg.nlh.nlmsg_seq = ++diag_seq;
+        msg.req.sdiag_family = family;
+        msg.req.sdiag_protocol = protocol;
+        msg.req.idiag_states = DIAG_STATES;
+        msg.req.idiag_ext =
+            (1 << (INET_DIAG_INFO - 1)) | (1 << (INET_DIAG_MEMINFO - 1));
+
+        struct sockaddr_nl kernel;
+        memset(&kernel, 0, sizeof(kernel));
+        kernel.nl_family = AF_NETLINK;
+        if (sendto(diag_fd, &msg, sizeof(msg), 0, (struct sockaddr *)&kernel,
+                   sizeof(kernel)) < 0)
+                goto error;
+        return 0;
+error:
+        LOG(ERROR, "sendto() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+static void parse_entry(struct nlmsghdr *nlh, int protocol,
+                        SockDiagCallback callback, void *arg) {
+        struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+        if (!msg->idiag_inode) return;
+        SockDiagEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.inode = msg->idiag_inode;
+        entry.family = msg->idiag_family;
+        entry.protocol = protocol;
+        entry.rqueue = msg->idiag_rqueue;
+        entry.wqueue = msg->idiag_wqueue;
+
+        int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+        struct rtattr *attr = (struct rtattr *)(msg + 1);
+        for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+                size_t n = RTA_PAYLOAD(attr);
+                if (attr->rta_type == INET_DIAG_INFO) {
+                        // Older & newer kernels have a different tcp_info.
+                        if (n > sizeof(entry.info)) n = sizeof(entry.info);
+                        memcpy(&entry.info, RTA_DATA(attr), n);
+                        entry.has_info = true;
+                } else if (attr->rta_type == INET_DIAG_MEMINFO &&
+                           n >= sizeof(entry.meminfo)) {
+                        memcpy(&entry.meminfo, RTA_DATA(attr),
+                               sizeof(entry.meminfo));
+                        entry.has_meminfo = true;
+                }
+        }
+        callback(&entry, arg);
+}
+
+// Returns 1 once the dump is done, 0 if more is to come, -1 on error.
+static int parse_replies(char *buf, int len, int protocol,
+                         SockDiagCallback callback, void *arg) {
+        struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+        for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                if (nlh->nlmsg_seq != diag_seq) continue;  // Stale reply.
+                if (nlh->nlmsg_type == NLMSG_DONE) return 1;
+                if (nlh->nlmsg_type == NLMSG_ERROR) goto error;
+                if (nlh->nlmsg_type == SOCK_DIAG_BY_FAMILY)
+                        parse_entry(nlh, protocol, callback, arg);
+        }
+        return 0;
+error:
+        if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+                struct nlmsgerr *err = NLMSG_DATA(nlh);
+                errno = -err->error;
+        }
+        LOG(ERROR, "sock_diag dump failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+static int dump_family(int family, int protocol, SockDiagCallback callback,
+                       void *arg) {
+        // Netlink messages are 4-byte aligned.
+        static long buf[SOCK_DIAG_BUF_SIZE / sizeof(long)];
+        if (send_request(family, protocol)) goto error_out;
+        int done = 0;
+        while (!done) {
+                ssize_t n = recv(diag_fd, buf, sizeof(buf), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) goto error;
+                done = parse_replies((char *)buf, n, protocol, callback,
+                                     arg);
+                if (done < 0) goto error_out;
+        }
+        return 0;
+error:
+        LOG(ERROR, "recv() failed. %s.", strerror(errno));
+error_out:
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+/* Public functions */
+
+/* Calls [callback] once per socket of [protocol], IPPROTO_TCP or IPPROTO_UDP.
+ * Dumps are serialized, the callback must thus not dump again. Returns -1 when
+ * the dump could not be completed, which leaves the callback called on part of
+ * the sockets. */
+int sock_diag_dump(int protocol, SockDiagCallback callback, void *arg) {
+        int ret = -1;
+        mutex_lock(&diag_mutex);
+        if (open_diag_socket()) goto exit;
+        if (dump_family(AF_INET, protocol, callback, arg)) goto error;
+        if (dump_family(AF_INET6, protocol, callback, arg)) goto error;
+        ret = 0;
+        goto exit;
+error:
+        LOG_FUNC_ERROR;
+exit:
+        mutex_unlock(&diag_mutex);
+        return ret;
+}
+
+/* Held across fork(), so that the child does not find a dump half-read on the
+ * socket. Taken before the sockets, which the dump callbacks lock. */
+void sock_diag_prepare_fork(void) { mutex_lock(&diag_mutex); }
+
+void sock_diag_parent_after_fork(void) { mutex_unlock(&diag_mutex); }
+
+void reset_sock_diag(void) {
+        // Shared with the parent after fork(), replies would be mixed up.
+        if (diag_fd >= 0) close(diag_fd);
+        diag_fd = -1;
+        mutex_init(&diag_mutex);
+}
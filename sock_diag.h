@@ -0,0 +1,38 @@
+#ifndef SOCK_DIAG_H
+#define SOCK_DIAG_H
+
+#include <linux/inet_diag.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Bulk socket state, through a NETLINK_SOCK_DIAG dump of the TCP or UDP
+ * sockets. One dump per family returns the tcp_info, queue sizes and memory
+ * usage of every socket at once, where getsockopt() takes one syscall per
+ * socket. The kernel cannot filter on inodes, so the dump covers the whole
+ * network namespace and callers keep the entries of their own sockets.
+ * TIME_WAIT & NEW_SYN_RECV sockets are left out, they have no inode. */
+
+#define SOCK_DIAG_BUF_SIZE 32768
+
+typedef struct {
+        ino_t inode;
+        int family;
+        int protocol;
+        uint32_t rqueue;  // Not yet read, or pending connections if LISTEN.
+        uint32_t wqueue;  // Not yet acked, or backlog if LISTEN.
+        bool has_info;
+        struct tcp_info info;  // Zeroed beyond what the kernel returned.
+        bool has_meminfo;
+        struct inet_diag_meminfo meminfo;
+} SockDiagEntry;
+
+typedef void (*SockDiagCallback)(const SockDiagEntry *entry, void *arg);
+
+int sock_diag_dump(int protocol, SockDiagCallback callback, void *arg);
+void sock_diag_prepare_fork(void);
+void sock_diag_parent_after_fork(void);
+void reset_sock_diag(void);
+
+#endif
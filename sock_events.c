@@ -3,12 +3,15 @@
 #include "sock_events.h"
 #include <assert.h>
 #include <dirent.h>
-#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#ifndef TCPSNITCH_LEAN
 #include <pcap/pcap.h>
+#endif
 #include <poll.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -20,14 +23,25 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "constants.h"
+#include "fd_sweep.h"
+#include "fd_table.h"
+#include "governor.h"
 #include "init.h"
-#include "json_builder.h"
 #include "lib.h"
 #include "logger.h"
-#include "packet_sniffer.h"
+#include "loop_lag.h"
+#include "mux_events.h"
+#include "overhead.h"
 #include "resizable_array.h"
+#include "sock_filter.h"
 #include "string_builders.h"
+#include "tcp_sampler.h"
+#include "timestamp.h"
+#ifndef TCPSNITCH_LEAN
+#include "json_builder.h"
+#include "packet_sniffer.h"
 #include "verbose_mode.h"
+#endif
 
 #ifdef __ANDROID__
 #define MUTEX_ERRORCHECK PTHREAD_ERRORCHECK_MUTEX_INITIALIZER
@@ -35,92 +49,182 @@
 #define MUTEX_ERRORCHECK PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP
 #endif
 
-void sock_ev_forked_socket(int fd, SockInfo *sock_info);
-void sock_ev_ghost_socket(int fd);
+#define RECORDER_FILE "recorder.txt"
+
+bool sock_ev_ghost_socket(int fd);
 
 static pthread_mutex_t connections_count_mutex = MUTEX_ERRORCHECK;
+static pthread_mutex_t ghost_mutex = MUTEX_ERRORCHECK;  // See fd_sweep.h.
 static int connections_count = 0;
+static int *forked_ids = NULL;  // By fd, see sock_ev_reset().
+static long sampled_out_count = 0;
+static long filtered_out_count = 0;
 
 /* Private functions */
 
-static Socket *alloc_socket(int fd) {
-        Socket *sock = (Socket *)my_calloc(sizeof(Socket));
+static int next_socket_id(void) {
         mutex_lock(&connections_count_mutex);
-        sock->id = connections_count;
+        int id = connections_count;
         connections_count++;
         mutex_unlock(&connections_count_mutex);
+        return id;
+}
+
+/* With -s <n>, 1 socket in n is traced. The decision is a hash of the socket
+ * id, so that the same sockets are picked for identical runs. It is taken when
+ * the socket appears, as the whole trace of a socket is kept or dropped. */
+static bool is_sampled(int id) {
+        long n = conf_opt_s;
+        if (GOVERNOR_LEVEL() >= GOV_SAMPLED && n < GOVERNOR_SAMPLING)
+                n = GOVERNOR_SAMPLING;
+        if (n <= 1) return true;
+        // Murmur3 finalizer: a plain multiplication keeps the low bits of
+        // the id, so that "hash % n" would be "id % n" for powers of 2.
+        uint32_t hash = (uint32_t)id;
+        hash ^= hash >> 16;
+        hash *= 0x85ebca6bu;
+        hash ^= hash >> 13;
+        hash *= 0xc2b2ae35u;
+        hash ^= hash >> 16;
+        return (hash % n) == 0;
+}
+
+static void sample_out(int fd) {
+        fd_table_set(fd, FD_UNTRACED);
+        __atomic_add_fetch(&sampled_out_count, 1, __ATOMIC_RELAXED);
+}
+
+/* With -m, sockets which do not match the filter are dropped as soon as their
+ * addresses are known, i.e. at connect(), listen() or accept() time, or at
+ * bind() time for UDP sockets, which may never connect. Until then, they are
+ * traced as usual. */
+static bool passes_filter(Socket *sock, const struct sockaddr *remote) {
+        if (!is_filter_set() || sock->filter_matched) return true;
+        const struct sockaddr *local =
+            sock->bound ? (const struct sockaddr *)&sock->bound_addr : NULL;
+        sock->filter_matched = filter_match(&sock->sock_info, local, remote);
+        return sock->filter_matched;
+}
+
+// For sockets we did not see connecting, we ask the kernel for the addresses.
+static bool is_fd_matched(int fd, const SockInfo *sock_info) {
+        if (!is_filter_set()) return true;
+        struct sockaddr_storage local, remote;
+        socklen_t local_len = sizeof(local), remote_len = sizeof(remote);
+        bool has_local =
+            !my_getsockname(fd, (struct sockaddr *)&local, &local_len);
+        bool has_remote =
+            !my_getpeername(fd, (struct sockaddr *)&remote, &remote_len);
+        return filter_match(sock_info,
+                            has_local ? (struct sockaddr *)&local : NULL,
+                            has_remote ? (struct sockaddr *)&remote : NULL);
+}
+
+static void mark_filtered_out(int fd) {
+        fd_table_set(fd, FD_UNTRACED);
+        __atomic_add_fetch(&filtered_out_count, 1, __ATOMIC_RELAXED);
+}
+
+/* The fd table caches the socket id, which spares the rwlock to lookups that
+ * only need the id, and the classification syscalls to is_traced_socket(). */
+static void put_socket(int fd, Socket *sock) {
+        fd_table_clear(fd);  // Flags of a previous fd, e.g. from a sweep.
+        lag_forget(fd);
+        ra_put_elem(fd, sock);
+        fd_table_set_traced(fd, sock->id);
+}
+
+static Socket *remove_socket(int fd) {
+        fd_table_clear_traced(fd);
+        return ra_remove_elem(fd);
+}
+
+static Socket *alloc_socket(int fd, int id) {
+        Socket *sock = (Socket *)my_calloc(sizeof(Socket));
+        sock->id = id;
         sock->fd = fd;
         return sock;
 }
 
-#define CASE_EV(ev_type_cons, ev_type, err_val)               \
+// Return value of a failed call.
+static int failure_value(SockEventType type) {
+        return (type == SOCK_EV_SOCKET || type == SOCK_EV_FDOPEN) ? 0 : -1;
+}
+
+static void init_event(SockEvent *ev, SockEventType type, int return_value,
+                       int err, int id) {
+#ifndef TCPSNITCH_LEAN
+        ev->timestamp_ns = get_time_ns();
+        ev->thread_id = syscall(SYS_gettid);
+#endif
+        ev->type = type;
+        ev->return_value = return_value;
+        ev->success = (return_value != failure_value(type));
+        ev->err = err;
+        ev->id = id;
+}
+
+#define CASE_EV(ev_type_cons, ev_type)                        \
         case ev_type_cons:                                    \
                 ev = (SockEvent *)my_calloc(sizeof(ev_type)); \
-                success = (return_value != err_val);          \
                 break;
 
 static SockEvent *alloc_event(SockEventType type, int return_value, int err,
                               int id) {
-        bool success;
         SockEvent *ev;
         switch (type) {
-                CASE_EV(SOCK_EV_SOCKET, SockEvSocket, 0);
-                CASE_EV(SOCK_EV_FORKED_SOCKET, SockEvForkedSocket, -1);
-                CASE_EV(SOCK_EV_GHOST_SOCKET, SockEvGhostSocket, -1);
-                CASE_EV(SOCK_EV_BIND, SockEvBind, -1);
-                CASE_EV(SOCK_EV_CONNECT, SockEvConnect, -1);
-                CASE_EV(SOCK_EV_SHUTDOWN, SockEvShutdown, -1);
-                CASE_EV(SOCK_EV_LISTEN, SockEvListen, -1);
-                CASE_EV(SOCK_EV_ACCEPT, SockEvAccept, -1);
-                CASE_EV(SOCK_EV_ACCEPT4, SockEvAccept4, -1);
-                CASE_EV(SOCK_EV_GETSOCKOPT, SockEvGetsockopt, -1);
-                CASE_EV(SOCK_EV_SETSOCKOPT, SockEvSetsockopt, -1);
-                CASE_EV(SOCK_EV_SEND, SockEvSend, -1);
-                CASE_EV(SOCK_EV_RECV, SockEvRecv, -1);
-                CASE_EV(SOCK_EV_SENDTO, SockEvSendto, -1);
-                CASE_EV(SOCK_EV_RECVFROM, SockEvRecvfrom, -1);
-                CASE_EV(SOCK_EV_SENDMSG, SockEvSendmsg, -1);
-                CASE_EV(SOCK_EV_RECVMSG, SockEvRecvmsg, -1);
+                CASE_EV(SOCK_EV_SOCKET, SockEvSocket);
+                CASE_EV(SOCK_EV_FORKED_SOCKET, SockEvForkedSocket);
+                CASE_EV(SOCK_EV_GHOST_SOCKET, SockEvGhostSocket);
+                CASE_EV(SOCK_EV_BIND, SockEvBind);
+                CASE_EV(SOCK_EV_CONNECT, SockEvConnect);
+                CASE_EV(SOCK_EV_SHUTDOWN, SockEvShutdown);
+                CASE_EV(SOCK_EV_LISTEN, SockEvListen);
+                CASE_EV(SOCK_EV_ACCEPT, SockEvAccept);
+                CASE_EV(SOCK_EV_ACCEPT4, SockEvAccept4);
+                CASE_EV(SOCK_EV_GETSOCKOPT, SockEvGetsockopt);
+                CASE_EV(SOCK_EV_SETSOCKOPT, SockEvSetsockopt);
+                CASE_EV(SOCK_EV_SEND, SockEvSend);
+                CASE_EV(SOCK_EV_RECV, SockEvRecv);
+                CASE_EV(SOCK_EV_SENDTO, SockEvSendto);
+                CASE_EV(SOCK_EV_RECVFROM, SockEvRecvfrom);
+                CASE_EV(SOCK_EV_SENDMSG, SockEvSendmsg);
+                CASE_EV(SOCK_EV_RECVMSG, SockEvRecvmsg);
 #if !defined(__ANDROID__) || __ANDROID_API__ >= 21
-                CASE_EV(SOCK_EV_SENDMMSG, SockEvSendmmsg, -1);
-                CASE_EV(SOCK_EV_RECVMMSG, SockEvRecvmmsg, -1);
+                CASE_EV(SOCK_EV_SENDMMSG, SockEvSendmmsg);
+                CASE_EV(SOCK_EV_RECVMMSG, SockEvRecvmmsg);
 #endif
-                CASE_EV(SOCK_EV_GETSOCKNAME, SockEvGetsockname, -1);
-                CASE_EV(SOCK_EV_GETPEERNAME, SockEvGetpeername, -1);
-                CASE_EV(SOCK_EV_SOCKATMARK, SockEvSockatmark, -1);
-                CASE_EV(SOCK_EV_ISFDTYPE, SockEvIsfdtype, -1);
-                CASE_EV(SOCK_EV_WRITE, SockEvWrite, -1);
-                CASE_EV(SOCK_EV_READ, SockEvRead, -1);
-                CASE_EV(SOCK_EV_CLOSE, SockEvClose, -1);
-                CASE_EV(SOCK_EV_DUP, SockEvDup, -1);
-                CASE_EV(SOCK_EV_DUP2, SockEvDup2, -1);
-                CASE_EV(SOCK_EV_DUP3, SockEvDup3, -1);
-                CASE_EV(SOCK_EV_WRITEV, SockEvWritev, -1);
-                CASE_EV(SOCK_EV_READV, SockEvReadv, -1);
-                CASE_EV(SOCK_EV_IOCTL, SockEvIoctl, -1);
-                CASE_EV(SOCK_EV_SENDFILE, SockEvSendfile, -1);
-                CASE_EV(SOCK_EV_POLL, SockEvPoll, -1);
-                CASE_EV(SOCK_EV_PPOLL, SockEvPpoll, -1);
-                CASE_EV(SOCK_EV_SELECT, SockEvSelect, -1);
-                CASE_EV(SOCK_EV_PSELECT, SockEvPselect, -1);
-                CASE_EV(SOCK_EV_FCNTL, SockEvFcntl, -1);
-                CASE_EV(SOCK_EV_EPOLL_CTL, SockEvEpollCtl, -1);
-                CASE_EV(SOCK_EV_EPOLL_WAIT, SockEvEpollWait, -1);
-                CASE_EV(SOCK_EV_EPOLL_PWAIT, SockEvEpollPwait, -1);
-                CASE_EV(SOCK_EV_FDOPEN, SockEvFdopen, 0);
-                CASE_EV(SOCK_EV_TCP_INFO, SockEvTcpInfo, -1);
+                CASE_EV(SOCK_EV_GETSOCKNAME, SockEvGetsockname);
+                CASE_EV(SOCK_EV_GETPEERNAME, SockEvGetpeername);
+                CASE_EV(SOCK_EV_SOCKATMARK, SockEvSockatmark);
+                CASE_EV(SOCK_EV_ISFDTYPE, SockEvIsfdtype);
+                CASE_EV(SOCK_EV_WRITE, SockEvWrite);
+                CASE_EV(SOCK_EV_READ, SockEvRead);
+                CASE_EV(SOCK_EV_CLOSE, SockEvClose);
+                CASE_EV(SOCK_EV_DUP, SockEvDup);
+                CASE_EV(SOCK_EV_DUP2, SockEvDup2);
+                CASE_EV(SOCK_EV_DUP3, SockEvDup3);
+                CASE_EV(SOCK_EV_WRITEV, SockEvWritev);
+                CASE_EV(SOCK_EV_READV, SockEvReadv);
+                CASE_EV(SOCK_EV_IOCTL, SockEvIoctl);
+                CASE_EV(SOCK_EV_SENDFILE, SockEvSendfile);
+                CASE_EV(SOCK_EV_FCNTL, SockEvFcntl);
+                CASE_EV(SOCK_EV_EPOLL_CTL, SockEvEpollCtl);
+                CASE_EV(SOCK_EV_EPOLL_WAIT, SockEvEpollWait);
+                CASE_EV(SOCK_EV_EPOLL_PWAIT, SockEvEpollPwait);
+                CASE_EV(SOCK_EV_FDOPEN, SockEvFdopen);
+                CASE_EV(SOCK_EV_TCP_INFO, SockEvTcpInfo);
+                case SOCK_EV_POLL:
+                case SOCK_EV_PPOLL:
+                case SOCK_EV_SELECT:
+                case SOCK_EV_PSELECT:
+                        return NULL;  // Recorded per call, see mux_events.h.
         }
-        ev->timestamp_usec = get_time_micros();
-        ev->type = type;
-        ev->return_value = return_value;
-        ev->success = success;
-        ev->err = err;
-        ev->id = id;
-        ev->thread_id = syscall(SYS_gettid);
+        init_event(ev, type, return_value, err, id);
         return ev;
 }
 
-static void free_event(SockEvent *ev) {
+static void free_event_fields(SockEvent *ev) {
         switch (ev->type) {
                 case SOCK_EV_GETSOCKOPT:
                         free(((SockEvGetsockopt *)ev)->sockopt.optval);
@@ -148,6 +252,10 @@ static void free_event(SockEvent *ev) {
                 default:
                         break;
         }
+}
+
+static void free_event(SockEvent *ev) {
+        free_event_fields(ev);
         free(ev);
 }
 
@@ -161,6 +269,51 @@ static void free_events_list(SockEventNode *head) {
         }
 }
 
+// See -q in sock_events.h.
+static bool is_recorder_on(void) {
+        return __atomic_load_n(&conf_opt_q, __ATOMIC_RELAXED) > 0;
+}
+
+#ifdef TCPSNITCH_LEAN
+static void count_event(Socket *sock, SockEventType type, bool success) {
+        sock->counters.counts[type]++;
+        if (!success) sock->counters.errors[type]++;
+        sock->events_count++;
+}
+
+static void push_event(Socket *sock, SockEvent *ev) {
+        count_event(sock, ev->type, ev->success);
+        free_event(ev);
+}
+#else
+/* The oldest event goes first, be it a control event or a data-path record.
+ * Blocks are freed once all their records are evicted. */
+static void evict_oldest_event(Socket *sock) {
+        SockEventNode *node = sock->head;
+        DataEvBlock *block = sock->data_head;
+        if (block &&
+            (!node || block->records[block->first].id < node->data->id)) {
+                if (++block->first == block->count) {
+                        sock->data_head = block->next;
+                        if (sock->data_tail == block) sock->data_tail = NULL;
+                        free(block);
+                }
+        } else {
+                sock->head = node->next;
+                if (sock->tail == node) sock->tail = NULL;
+                free_event(node->data);
+                free(node);
+        }
+        sock->events_retained--;
+}
+
+// With -q, until the socket is triggered. The last event is never evicted.
+static void trim_events(Socket *sock) {
+        long max = __atomic_load_n(&conf_opt_q, __ATOMIC_RELAXED);
+        if (max <= 0 || sock->trigger) return;
+        while (sock->events_retained > max) evict_oldest_event(sock);
+}
+
 static void push_event(Socket *sock, SockEvent *ev) {
         SockEventNode *node = (SockEventNode *)my_malloc(sizeof(SockEventNode));
         node->data = ev;
@@ -173,8 +326,168 @@ static void push_event(Socket *sock, SockEvent *ev) {
 
         sock->tail = node;
         sock->events_count++;
+        sock->events_retained++;
+        trim_events(sock);
         return;
 }
+#endif
+
+_Static_assert(sizeof(DataEvent) == 32, "DataEvent must stay 32 bytes");
+
+/* Structural events are always recorded, whatever the budget, as the trace
+ * would not make sense without them. */
+static bool is_budgeted(SockEventType type) {
+        switch (type) {
+                case SOCK_EV_SOCKET:
+                case SOCK_EV_FORKED_SOCKET:
+                case SOCK_EV_GHOST_SOCKET:
+                case SOCK_EV_BIND:
+                case SOCK_EV_CONNECT:
+                case SOCK_EV_SHUTDOWN:
+                case SOCK_EV_LISTEN:
+                case SOCK_EV_ACCEPT:
+                case SOCK_EV_ACCEPT4:
+                case SOCK_EV_CLOSE:
+                case SOCK_EV_DUP:
+                case SOCK_EV_DUP2:
+                case SOCK_EV_DUP3:
+                        return false;
+                default:
+                        return true;
+        }
+}
+
+/* Events outside the -w allowlist are dropped. With -e <n>, at most n events
+ * are recorded per socket. Beyond that, events are only counted. */
+static bool is_dropped_event(Socket *sock, SockEventType type) {
+        if (!is_budgeted(type)) return false;
+        if (!filter_allows_event(type)) return true;
+#ifndef TCPSNITCH_LEAN
+        if (GOVERNOR_LEVEL() >= GOV_COUNTERS) {
+                sock->events_dropped++;
+                return true;
+        }
+#endif
+        if (!conf_opt_e || sock->events_count < conf_opt_e) return false;
+        sock->events_dropped++;
+        return true;
+}
+
+static void free_data_blocks(DataEvBlock *head) {
+        DataEvBlock *tmp;
+        while (head != NULL) {
+                tmp = head;
+                head = head->next;
+                free(tmp);
+        }
+}
+
+#ifndef TCPSNITCH_LEAN
+static DataEvBlock *alloc_data_block(Socket *sock, uint64_t base_ns) {
+        DataEvBlock *block = (DataEvBlock *)my_malloc(sizeof(DataEvBlock));
+        block->base_ns = base_ns;
+        block->first = 0;
+        block->count = 0;
+        block->next = NULL;
+
+        if (!sock->data_head)
+                sock->data_head = block;
+        else
+                sock->data_tail->next = block;
+
+        sock->data_tail = block;
+        return block;
+}
+
+static void push_data_event(Socket *sock, SockEventType type, int return_value,
+                            int err, size_t bytes, int flags, uint16_t peer) {
+        uint64_t now = get_time_ns();
+        DataEvBlock *block = sock->data_tail;
+        // A new block is started when the current one is full or when the
+        // timestamp delta no longer fits in the record.
+        if (!block || block->count == DATA_EV_BLOCK_SIZE ||
+            now - block->base_ns > UINT32_MAX)
+                block = alloc_data_block(sock, now);
+
+        DataEvent *rec = &block->records[block->count++];
+        rec->id = sock->events_count;
+        rec->delta_ns = now - block->base_ns;
+        rec->return_value = return_value;
+        rec->err = err;
+        rec->bytes = (bytes > UINT32_MAX) ? UINT32_MAX : bytes;
+        rec->flags = flags;
+        rec->thread_id = syscall(SYS_gettid);
+        rec->peer = peer;
+        rec->type = type;
+        rec->unused = 0;
+
+        sock->events_count++;
+        sock->events_retained++;
+        trim_events(sock);
+}
+
+typedef union {
+        SockEvent super;
+        SockEvSend send;
+        SockEvRecv recv;
+        SockEvSendto sendto;
+        SockEvRecvfrom recvfrom;
+        SockEvWrite write;
+        SockEvRead read;
+} DataEvExpanded;
+
+/* Rebuild a full event from a compact record, so that the JSON builder and
+ * verbose mode do not have to know about data-path records. */
+static void expand_data_event(DataEvExpanded *ev, const DataEvent *rec,
+                              uint64_t base_ns) {
+        memset(ev, 0, sizeof(DataEvExpanded));
+        ev->super.type = rec->type;
+        ev->super.timestamp_ns = base_ns + rec->delta_ns;
+        ev->super.return_value = rec->return_value;
+        ev->super.success = (rec->return_value != -1);
+        ev->super.err = rec->err;
+        ev->super.id = rec->id;
+        ev->super.thread_id = rec->thread_id;
+
+        switch (rec->type) {
+                case SOCK_EV_SEND:
+                        ev->send.bytes = rec->bytes;
+                        ev->send.flags = rec->flags;
+                        break;
+                case SOCK_EV_RECV:
+                        ev->recv.bytes = rec->bytes;
+                        ev->recv.flags = rec->flags;
+                        break;
+                case SOCK_EV_SENDTO:
+                        ev->sendto.bytes = rec->bytes;
+                        ev->sendto.flags = rec->flags;
+                        ev->sendto.addr_id = rec->peer;
+                        break;
+                case SOCK_EV_RECVFROM:
+                        ev->recvfrom.bytes = rec->bytes;
+                        ev->recvfrom.flags = rec->flags;
+                        ev->recvfrom.addr_id = rec->peer;
+                        break;
+                case SOCK_EV_WRITE:
+                        ev->write.bytes = rec->bytes;
+                        break;
+                case SOCK_EV_READ:
+                        ev->read.bytes = rec->bytes;
+                        break;
+                default:
+                        LOG(ERROR, "Unexpected data event type %d.", rec->type);
+        }
+}
+
+static void output_data_event(const Socket *sock) {
+        if (!conf_opt_v) return;
+        DataEvBlock *block = sock->data_tail;
+        DataEvExpanded ev;
+        expand_data_event(&ev, &block->records[block->count - 1],
+                          block->base_ns);
+        output_event(&ev.super);
+}
+#endif
 
 #define SOCK_TYPE_MASK 0b1111
 static void fill_sock_info(SockInfo *si, int domain, int type, int protocol) {
@@ -216,16 +529,6 @@ static void fill_addr(Addr *a, const struct sockaddr *addr, socklen_t len) {
         a->len = len;
 }
 
-static void fill_poll_events(PollEvents *pe, int events) {
-        pe->pollin = (events & POLLIN);
-        pe->pollpri = (events & POLLPRI);
-        pe->pollout = (events & POLLOUT);
-        pe->pollrdhup = (events & POLLRDHUP);
-        pe->pollerr = (events & POLLERR);
-        pe->pollhup = (events & POLLHUP);
-        pe->pollnval = (events & POLLNVAL);
-}
-
 static socklen_t fill_iovec(Iovec *iov1, const struct iovec *iov2,
                             int iovec_count) {
         iov1->iovec_count = iovec_count;
@@ -240,20 +543,99 @@ static socklen_t fill_iovec(Iovec *iov1, const struct iovec *iov2,
         return bytes;
 }
 
-static socklen_t fill_msghdr(Msghdr *m1, const struct msghdr *m2) {
-        // We copy the msg_control fields of the "struct msghdr" to another
-        // such struct, since we must have such a struct available later to
-        // use the CMSG macros for extracting the ancillary data.
+static void fill_timeout(Timeout *t, const struct timespec *ts) {
+        t->seconds = ts->tv_sec;
+        t->nanoseconds = ts->tv_nsec;
+}
+
+static void fill_cmsg(CmsgSummary *sum, const struct cmsghdr *cmsg) {
+        const unsigned char *data = CMSG_DATA(cmsg);
+        size_t data_len = cmsg->cmsg_len - CMSG_LEN(0);
+        int level = cmsg->cmsg_level, type = cmsg->cmsg_type;
+
+        if (level == SOL_SOCKET && type == SCM_RIGHTS) {
+                sum->rights_fds += data_len / sizeof(int);
+        } else if (level == SOL_SOCKET && type == SO_TIMESTAMPING &&
+                   data_len >= 3 * sizeof(struct timespec)) {
+                // struct scm_timestamping: software, legacy, hardware.
+                struct timespec ts[3];
+                memcpy(ts, data, sizeof(ts));
+                sum->timestamping = true;
+                fill_timeout(&sum->ts_software, &ts[0]);
+                fill_timeout(&sum->ts_hardware, &ts[2]);
+#ifdef UDP_SEGMENT
+        } else if (level == SOL_UDP && type == UDP_SEGMENT &&
+                   data_len >= sizeof(uint16_t)) {
+                uint16_t segment;
+                memcpy(&segment, data, sizeof(segment));
+                sum->udp_segment = segment;
+#endif
+#ifdef UDP_GRO
+        } else if (level == SOL_UDP && type == UDP_GRO &&
+                   data_len >= sizeof(int)) {
+                memcpy(&sum->udp_gro, data, sizeof(int));
+#endif
+        } else if (level == IPPROTO_IP && type == IP_PKTINFO &&
+                   data_len >= sizeof(struct in_pktinfo)) {
+                struct in_pktinfo info;
+                memcpy(&info, data, sizeof(info));
+                sum->pktinfo_family = AF_INET;
+                sum->pktinfo_ifindex = info.ipi_ifindex;
+                memcpy(sum->pktinfo_addr, &info.ipi_addr,
+                       sizeof(info.ipi_addr));
+        } else if (level == IPPROTO_IPV6 && type == IPV6_PKTINFO &&
+                   data_len >= sizeof(struct in6_pktinfo)) {
+                struct in6_pktinfo info;
+                memcpy(&info, data, sizeof(info));
+                sum->pktinfo_family = AF_INET6;
+                sum->pktinfo_ifindex = info.ipi6_ifindex;
+                memcpy(sum->pktinfo_addr, &info.ipi6_addr,
+                       sizeof(info.ipi6_addr));
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+        } else if (((level == IPPROTO_IP && type == IP_RECVERR) ||
+                    (level == IPPROTO_IPV6 && type == IPV6_RECVERR)) &&
+                   data_len >= sizeof(struct sock_extended_err)) {
+                struct sock_extended_err ee;
+                memcpy(&ee, data, sizeof(ee));
+                if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) return;
+                sum->zerocopy = true;
+                sum->zerocopy_copied =
+                    (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+                sum->zerocopy_lo = ee.ee_info;
+                sum->zerocopy_hi = ee.ee_data;
+#endif
+        }
+}
+
+static void fill_cmsg_summary(CmsgSummary *sum, const struct msghdr *msg) {
+        memset(sum, 0, sizeof(CmsgSummary));
+        if (!msg->msg_control) return;
+        // CMSG_NXTHDR() takes a non-const msghdr but does not modify it.
+        struct msghdr *msgh = (struct msghdr *)(uintptr_t)msg;
+        const char *end = (const char *)msg->msg_control + msg->msg_controllen;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msgh); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+                // Malformed by the application, e.g. a sendmsg() one.
+                if (cmsg->cmsg_len < CMSG_LEN(0) ||
+                    cmsg->cmsg_len > (size_t)(end - (const char *)cmsg))
+                        break;
+                sum->cmsg_count++;
+                fill_cmsg(sum, cmsg);
+        }
+}
 
+static socklen_t fill_msghdr(Msghdr *m1, const struct msghdr *m2,
+                             bool decode_cmsg) {
         // Msg name
         if (m2->msg_name) memcpy(&m1->addr, m2->msg_name, m2->msg_namelen);
 
-        // Control data (ancillary data)
-        m1->msghdr = my_calloc(sizeof(struct msghdr));
-        m1->msghdr->msg_controllen = m2->msg_controllen;
-        if (m2->msg_controllen)
-                m1->msghdr->msg_control = my_malloc(m2->msg_controllen);
-        memcpy(m1->msghdr->msg_control, m2->msg_control, m2->msg_controllen);
+        // Control data (ancillary data), summarized right away. On a failed
+        // recvmsg() the control buffer holds no valid data.
+        m1->control_data_len = m2->msg_controllen;
+        if (decode_cmsg)
+                fill_cmsg_summary(&m1->cmsg, m2);
+        else
+                memset(&m1->cmsg, 0, sizeof(CmsgSummary));
 
         // Flags
         m1->flags = m2->msg_flags;
@@ -264,13 +646,14 @@ static socklen_t fill_msghdr(Msghdr *m1, const struct msghdr *m2) {
 
 static unsigned int fill_mmsghdr_vec(Mmsghdr *mmsghdr_vec1,
                                      const struct mmsghdr *mmsghdr_vec2,
-                                     unsigned int vlen) {
+                                     unsigned int vlen, int valid) {
         unsigned int bytes = 0;
         for (unsigned int i = 0; i < vlen; i++) {
                 const struct mmsghdr *mmsghdr2 = (mmsghdr_vec2 + i);
                 Mmsghdr *mmsghdr1 = (mmsghdr_vec1 + i);
                 mmsghdr1->bytes_transmitted = mmsghdr2->msg_len;
-                bytes += fill_msghdr(&mmsghdr1->msghdr, &mmsghdr2->msg_hdr);
+                bytes += fill_msghdr(&mmsghdr1->msghdr, &mmsghdr2->msg_hdr,
+                                     (int)i < valid);
         }
         return bytes;
 }
@@ -288,51 +671,26 @@ static void fill_sockopt(Sockopt *sockopt, int level, int optname,
         return;
 }
 
-typedef int (*orig_bind_type)(int fd, const struct sockaddr *addr,
-                              socklen_t len);
-orig_bind_type orig_bind;
-
-#define MIN_PORT 32768  // cat /proc/sys/net/ipv4/ip_local_port_range
-#define MAX_PORT 60999
-static int force_bind(int fd, Socket *sock, bool IPV6) {
-        LOG(INFO, "Forcing bind on connection %d.", sock->id);
-        LOG_FUNC_INFO;
-        if (!orig_bind) orig_bind = (orig_bind_type)dlsym(RTLD_NEXT, "bind");
-
-        for (int port = MIN_PORT; port <= MAX_PORT; port++) {
-                int rc;
-                if (IPV6) {
-                        struct sockaddr_in6 a;
-                        a.sin6_family = AF_INET6;
-                        a.sin6_port = htons(port);  // Any port
-                        a.sin6_addr = in6addr_any;
-                        rc = orig_bind(fd, (struct sockaddr *)&a, sizeof(a));
-                } else {
-                        struct sockaddr_in a;
-                        a.sin_family = AF_INET;
-                        a.sin_port = htons(port);
-                        a.sin_addr.s_addr = INADDR_ANY;
-                        rc = orig_bind(fd, (struct sockaddr *)&a, sizeof(a));
-                }
-                if (rc == 0) return 0;                 // Sucessfull bind. Stop.
-                if (errno != EADDRINUSE) goto error1;  // Unexpected error.
-                // Expected error EADDRINUSE. Try next port.
-        }
-        // Could not bind if we reach this point.
-        goto error_out;
-error1:
-        LOG(ERROR, "bind() failed. %s.", strerror(errno));
-        goto error_out;
-error_out:
+#ifndef TCPSNITCH_LEAN
+static bool write_event_as_json(const SockEvent *ev, AddrTable *addrs,
+                                FILE *fp) {
+        char *json_str;
+        if (!(json_str = alloc_sock_ev_json(ev, addrs))) goto error;
+        my_fputs(json_str, fp);
+        my_fputs("\n", fp);
+        free(json_str);
+        return true;
+error:
         LOG_FUNC_ERROR;
-        LOG(INFO, "Packet capture filter on dest IP/PORT only.");
-        return -1;
+        return false;
 }
 
+/* Control events and data-path records are kept apart, both ordered by event
+ * id. We merge the two sequences so that the trace keeps the call order. */
 static void dump_events_as_json(Socket *sock) {
         if (OPT_D == NULL) goto error1;
         LOG_FUNC_INFO;
-        char *json_str, *json_file_str;
+        char *json_file_str;
 
         if (!(json_file_str = alloc_json_path_str(sock))) goto error_out;
         FILE *fp = fopen(json_file_str, "a");
@@ -340,23 +698,37 @@ static void dump_events_as_json(Socket *sock) {
         if (!fp) goto error_out;
 
         SockEventNode *tmp, *cur = sock->head;
-        while (cur != NULL) {
-                SockEvent *ev = cur->data;
-                if (!(json_str = alloc_sock_ev_json(ev))) goto error_out;
-
-                my_fputs(json_str, fp);
-                my_fputs("\n", fp);
-
-                free(json_str);
-                free_event(cur->data);
-                tmp = cur;
-                cur = cur->next;
-                free(tmp);
+        DataEvBlock *block = sock->data_head;
+        int i = block ? block->first : 0;
+        DataEvExpanded data_ev;
+        while (cur != NULL || block != NULL) {
+                bool data_first =
+                    block && (!cur || block->records[i].id < cur->data->id);
+                if (data_first) {
+                        expand_data_event(&data_ev, &block->records[i],
+                                          block->base_ns);
+                        write_event_as_json(&data_ev.super, &sock->addrs,
+                                            fp);
+                        if (++i < block->count) continue;
+                        DataEvBlock *done = block;
+                        block = block->next;
+                        free(done);
+                        i = block ? block->first : 0;
+                } else {
+                        write_event_as_json(cur->data, &sock->addrs, fp);
+                        free_event(cur->data);
+                        tmp = cur;
+                        cur = cur->next;
+                        free(tmp);
+                }
         }
         sock->head = NULL;
         sock->tail = NULL;
+        sock->data_head = NULL;
+        sock->data_tail = NULL;
+        sock->events_retained = 0;
 
-        if (fclose(fp) == EOF) goto error2;
+        if (my_fclose(fp) == EOF) goto error2;
         return;
 error2:
         LOG(ERROR, "fclose() failed. %s.", strerror(errno));
@@ -367,31 +739,102 @@ error_out:
         LOG_FUNC_ERROR;
         return;
 }
+#else
+static void dump_counters(Socket *sock) {
+        LOG_FUNC_INFO;
+        char *path;
+        if (!(path = alloc_counters_path_str(sock))) goto error_out;
+        FILE *fp = fopen(path, "w");
+        free(path);
+        if (!fp) goto error_out;
 
-static void tcp_dump_tcp_info(int fd) {
-        struct tcp_info *info =
-            (struct tcp_info *)my_malloc(sizeof(struct tcp_info));
-        int ret = fill_tcp_info(fd, info);
-        int err = errno;
-        sock_ev_tcp_info(fd, ret, err, info);
+        SockCounters *counters = &sock->counters;
+        counters->magic = SOCK_COUNTERS_MAGIC;
+        counters->version = SOCK_COUNTERS_VERSION;
+        counters->types_count = SOCK_EV_TCP_INFO + 1;
+        counters->id = sock->id;
+        counters->domain = sock->sock_info.domain;
+        counters->type = sock->sock_info.type;
+        counters->protocol = sock->sock_info.protocol;
+        counters->bytes_sent = sock->bytes_sent;
+        counters->bytes_received = sock->bytes_received;
+        counters->events_dropped = sock->events_dropped;
+        if (fwrite(counters, sizeof(SockCounters), 1, fp) != 1)
+                LOG(ERROR, "fwrite() failed. %s.", strerror(errno));
+
+        if (my_fclose(fp) == EOF) goto error1;
+        return;
+error1:
+        LOG(ERROR, "fclose() failed. %s.", strerror(errno));
+error_out:
+        LOG_FUNC_ERROR;
+        return;
 }
+#endif
 
-static bool should_dump_tcp_info(const Socket *sock) {
-        if (!is_tcp_socket(sock->fd)) return false;
+static void dump_socket(Socket *sock) {
+#ifdef TCPSNITCH_LEAN
+        dump_counters(sock);
+#else
+        // The events of an untriggered socket stay in its recorder.
+        if (is_recorder_on() && !sock->trigger) return;
+        dump_events_as_json(sock);
+#endif
+}
 
-        if (conf_opt_u > 0) {
-                long cur_time = get_time_micros();
-                long time_elasped = cur_time - sock->last_info_dump_micros;
-                if (time_elasped > conf_opt_u) return true;
-        }
+// One line per socket with -q, see sock_events.h.
+static void dump_recorder_summary(const Socket *sock) {
+        if (!is_recorder_on() || !logs_dir_path) return;
+        char buf[256], *path;
+        int n = snprintf(buf, sizeof(buf),
+                         "{\"socket\": %d, \"events\": %ld, \"errors\": %lu, "
+                         "\"bytes_sent\": %lu, \"bytes_received\": %lu",
+                         sock->id, sock->events_count, sock->errors_count,
+                         sock->bytes_sent, sock->bytes_received);
+        if (sock->trigger)
+                snprintf(buf + n, sizeof(buf) - n,
+                         ", \"trigger\": \"%s\", \"trigger_event\": %ld}\n",
+                         sock->trigger, sock->trigger_event);
+        else
+                snprintf(buf + n, sizeof(buf) - n, ", \"trigger\": null}\n");
+        if (!(path = alloc_concat_path(logs_dir_path, RECORDER_FILE)))
+                goto error;
+        append_string_to_file(buf, path);
+        free(path);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
 
-        if (conf_opt_b > 0) {
-                long cur_bytes = sock->bytes_sent + sock->bytes_received;
-                long bytes_elapsed = cur_bytes - sock->last_info_dump_bytes;
-                if (bytes_elapsed > conf_opt_b) return true;
-        }
+static void trigger_recorder(Socket *sock, const char *reason) {
+        sock->trigger = reason;
+        sock->trigger_event = sock->events_count;
+        LOG(INFO, "Socket %d: event recorder triggered by %s.", sock->id,
+            reason);
+}
 
-        return false;
+// Time spent in the current hook until now, unless not run from an override.
+static void account_overhead(Socket *sock) {
+        if (hook_start_ns) sock->overhead_ns += get_time_ns() - hook_start_ns;
+}
+
+static bool is_tcp(const Socket *sock) {
+        return sock->sock_info.type == SOCK_STREAM;
+}
+
+// The -b trigger only enqueues a request, see tcp_sampler.h.
+static void request_tcp_info(Socket *sock) {
+        long bytes = __atomic_load_n(&conf_opt_b, __ATOMIC_RELAXED);
+        if (bytes <= 0 || sock->tcp_info_requested || !is_tcp(sock)) return;
+        long cur_bytes = sock->bytes_sent + sock->bytes_received;
+        if (cur_bytes - sock->last_info_dump_bytes <= bytes) return;
+        sock->tcp_info_requested = tcp_sampler_request(sock->fd, sock->id);
+}
+
+// See sock_ev_reset(), ids are assigned in the order sockets were opened.
+static void assign_forked_id(int fd) {
+        forked_ids[fd] = next_socket_id();
+        fd_table_set_traced(fd, forked_ids[fd]);
 }
 
 /* Public functions */
@@ -399,42 +842,223 @@ static bool should_dump_tcp_info(const Socket *sock) {
 void free_socket(Socket *sock) {
         if (!sock) return;  // NULL
         free_events_list(sock->head);
+        free_data_blocks(sock->data_head);
+        addr_table_free(&sock->addrs);
         free(sock);
 }
 
-void sock_start_capture(int fd, const struct sockaddr *addr_to) {
-        LOG(INFO, "Starting packet capture.");
-        LOG_FUNC_INFO;
-        Socket *sock = ra_get_and_lock_elem(fd);
-        if (!sock) goto error_out;
-
-        // We force a bind if the socket is not bound. This allows us to know
-        // the source port and use a more specific filter for the capture.
-        if (!sock->bound) force_bind(fd, sock, addr_to->sa_family == AF_INET6);
-
-        // Build pcap file path
-        char *pcap_file_path = alloc_pcap_path_str(sock);
-        if (!pcap_file_path) goto error_out;
+#ifndef TCPSNITCH_LEAN
+static bool is_udp(const Socket *sock) {
+        return sock->sock_info.type == SOCK_DGRAM;
+}
 
-        // Build capture filter
-        const struct sockaddr *addr_from =
-            (sock->bound) ? (const struct sockaddr *)&sock->bound_addr : NULL;
+static bool has_port(const struct sockaddr_storage *addr) {
+        if (addr->ss_family == AF_INET)
+                return ((const struct sockaddr_in *)addr)->sin_port;
+        if (addr->ss_family == AF_INET6)
+                return ((const struct sockaddr_in6 *)addr)->sin6_port;
+        return false;
+}
 
-        const char *capture_filter = alloc_capture_filter(addr_from, addr_to);
-        if (!capture_filter) goto error1;
-        // See deadlock note in is_inet_socket.
-        sock->capture_switch = start_capture(capture_filter, pcap_file_path);
+/* Adds the socket to the capture engine, see packet_sniffer.h, once it has a
+ * local port, or before connect() to [peer]. Without [peer], it is asked to
+ * the kernel, and unconnected sockets get all packets to their port. */
+static void capture_socket(int fd, Socket *sock, const struct sockaddr *peer) {
+        if (!conf_opt_c || sock->capture || !capture_is_available()) return;
+        int protocol;
+        if (is_tcp(sock))
+                protocol = IPPROTO_TCP;
+        else if (is_udp(sock))
+                protocol = IPPROTO_UDP;
+        else
+                return;
+
+        struct sockaddr_storage local, connected;
+        socklen_t len = sizeof(local);
+        if (my_getsockname(fd, (struct sockaddr *)&local, &len)) goto error;
+        if (!has_port(&local) &&
+            !(peer && has_port((const struct sockaddr_storage *)peer)))
+                return;  // Not bound yet, nor connecting.
+        len = sizeof(connected);
+        if (!peer && !my_getpeername(fd, (struct sockaddr *)&connected, &len))
+                peer = (const struct sockaddr *)&connected;
 
+        char *pcap_file_path = alloc_pcap_path_str(sock);
+        if (!pcap_file_path) goto error;
+        sock->capture = capture_start(protocol, (struct sockaddr *)&local,
+                                      peer, pcap_file_path);
+        sock->capture_by_peer = !has_port(&local);
         free(pcap_file_path);
-        ra_unlock_elem(fd);
         return;
-error1:
-        free(pcap_file_path);
-error_out:
-        ra_unlock_elem(fd);
+error:
         LOG_FUNC_ERROR;
+}
+
+/* After connect(), the flow started before it is narrowed to the local port
+ * the kernel picked. It is stopped if the connection failed. */
+static void capture_connected_socket(int fd, Socket *sock, bool connecting) {
+        if (!sock->capture_by_peer) return;
+        sock->capture_by_peer = false;
+        if (!connecting) {
+                capture_stop(sock->capture, 0);
+                sock->capture = NULL;
+                return;
+        }
+        struct sockaddr_storage local;
+        socklen_t len = sizeof(local);
+        if (my_getsockname(fd, (struct sockaddr *)&local, &len)) goto error;
+        capture_set_local(sock->capture, (struct sockaddr *)&local);
         return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+// After the accept hook has unlocked the listener, never under its lock.
+static void capture_accepted_socket(int fd) {
+        Socket *sock = ra_get_and_lock_elem(fd);
+        if (sock) capture_socket(fd, sock, NULL);
+        ra_unlock_elem(fd);
+}
+#endif
+
+// UDP sockets are bound implicitly, by their first send.
+static void capture_sending_socket(int fd, Socket *sock, int ret) {
+#ifndef TCPSNITCH_LEAN
+        if (ret != -1 && is_udp(sock)) capture_socket(fd, sock, NULL);
+#else
+        UNUSED(fd);
+        UNUSED(sock);
+        UNUSED(ret);
+#endif
+}
+
+/* The flight recorder of the socket, if any, is written on a connection error,
+ * or on a burst of retransmissions. */
+static void trigger_on_error(Socket *sock, int ret, int err) {
+#ifndef TCPSNITCH_LEAN
+        if (!sock->capture || ret != -1) return;
+        if (err == ECONNRESET) capture_trigger(sock->capture, "ECONNRESET");
+        if (err == ETIMEDOUT) capture_trigger(sock->capture, "ETIMEDOUT");
+#else
+        UNUSED(sock);
+        UNUSED(ret);
+        UNUSED(err);
+#endif
+}
+
+static void trigger_on_retrans(Socket *sock, const struct tcp_info *info) {
+#ifndef TCPSNITCH_LEAN
+        if (sock->capture && info->tcpi_total_retrans >=
+                                 sock->total_retrans + CAPTURE_RETRANS_TRIGGER)
+                capture_trigger(sock->capture, "retransmissions");
+#endif
+        sock->total_retrans = info->tcpi_total_retrans;
+}
+
+#ifndef TCPSNITCH_LEAN
+// Failures which are part of the normal operation of a socket.
+static bool is_expected_error(int err) {
+        return err == EAGAIN || err == EWOULDBLOCK || err == EINPROGRESS ||
+               err == EALREADY || err == EINTR;
+}
+
+// Their latency is that of the peer.
+static bool waits_for_peer(SockEventType type) {
+        switch (type) {
+                case SOCK_EV_CONNECT:
+                case SOCK_EV_ACCEPT:
+                case SOCK_EV_ACCEPT4:
+                case SOCK_EV_RECV:
+                case SOCK_EV_RECVFROM:
+                case SOCK_EV_RECVMSG:
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+                case SOCK_EV_RECVMMSG:
+#endif
+                case SOCK_EV_READ:
+                case SOCK_EV_READV:
+                        return true;
+                default:
+                        return false;
+        }
+}
+
+// The calls after which a non-blocking connect() is deemed over.
+static bool ends_connect(SockEventType type) {
+        switch (type) {
+                case SOCK_EV_GETSOCKOPT:  // SO_ERROR
+                case SOCK_EV_SEND:
+                case SOCK_EV_RECV:
+                case SOCK_EV_SENDTO:
+                case SOCK_EV_RECVFROM:
+                case SOCK_EV_SENDMSG:
+                case SOCK_EV_RECVMSG:
+                case SOCK_EV_WRITE:
+                case SOCK_EV_READ:
+                case SOCK_EV_WRITEV:
+                case SOCK_EV_READV:
+                case SOCK_EV_SENDFILE:
+                        return true;
+                default:
+                        return false;
+        }
+}
+
+/* The latency is compared to the moving average of the socket, which gives
+ * the last call a weight of 1/8, before being added to it. */
+static bool is_latency_outlier(Socket *sock, uint64_t latency_ns) {
+        uint64_t avg = sock->latency_avg_ns;
+        bool outlier = sock->latency_samples == RECORDER_OUTLIER_WARMUP &&
+                       latency_ns > avg * RECORDER_OUTLIER_FACTOR &&
+                       latency_ns > RECORDER_OUTLIER_MIN_MS * 1000000ULL;
+        if (!sock->latency_samples)
+                sock->latency_avg_ns = latency_ns;
+        else
+                sock->latency_avg_ns = avg - avg / 8 + latency_ns / 8;
+        if (sock->latency_samples < RECORDER_OUTLIER_WARMUP)
+                sock->latency_samples++;
+        return outlier;
+}
+
+/* A blocking connect() is timed as any call. A non-blocking one runs from the
+ * call until the first transfer, or getsockopt() of SO_ERROR. */
+static bool is_slow_connect(Socket *sock, SockEventType type, bool success,
+                            int err, uint64_t latency_ns) {
+        const uint64_t slow_ns = RECORDER_SLOW_CONNECT_MS * 1000000ULL;
+        if (type == SOCK_EV_CONNECT) {
+                if (!success && err == EINPROGRESS)
+                        sock->connect_start_ns = call_start_ns;
+                return success && latency_ns > slow_ns;
+        }
+        if (!sock->connect_start_ns || !success || !ends_connect(type))
+                return false;
+        uint64_t elapsed_ns = get_time_ns() - sock->connect_start_ns;
+        sock->connect_start_ns = 0;
+        return elapsed_ns > slow_ns;
+}
+
+/* Run for each recorded event, before it is pushed. The latency is that of
+ * the libc call, timed by the override, see overhead.h. */
+static void check_recorder(Socket *sock, SockEventType type, bool success,
+                           int err) {
+        if (!is_recorder_on()) return;
+        if (!success) sock->errors_count++;
+        if (sock->trigger) return;
+        uint64_t latency_ns =
+            call_start_ns ? hook_start_ns - call_start_ns : 0;
+
+        const char *reason = NULL;
+        if (!success && !is_expected_error(err))
+                reason = "error";
+        else if (latency_ns && !waits_for_peer(type) &&
+                 is_latency_outlier(sock, latency_ns))
+                reason = "latency";
+        else if (is_slow_connect(sock, type, success, err, latency_ns))
+                reason = "slow connect";
+        else if (filter_triggers_match(type, success, err, latency_ns))
+                reason = "user trigger";
+        if (reason) trigger_recorder(sock, reason);
 }
+#endif
 
 void log_event(LogLevel lvl, int ev_type_cons, int fd, int con_id) {
         const char *ev_name = string_from_sock_event_type(ev_type_cons);
@@ -442,20 +1066,49 @@ void log_event(LogLevel lvl, int ev_type_cons, int fd, int con_id) {
 }
 
 void free_and_dump_socket(int fd) {
-        Socket *sock = ra_remove_elem(fd);
-        if (sock->capture_switch != NULL)
-                stop_capture(sock->capture_switch, sock->rtt * 2);
-        dump_events_as_json(sock);
+        Socket *sock = remove_socket(fd);
+        if (!sock) return;  // Already removed by another thread.
+        if (sock->events_dropped)
+                LOG(WARN, "Socket %d: %lu events over budget not recorded.",
+                    sock->id, sock->events_dropped);
+#ifndef TCPSNITCH_LEAN
+        // The rtt is in microseconds, see struct tcp_info.
+        if (sock->capture) capture_stop(sock->capture, sock->rtt * 2);
+#endif
+        dump_socket(sock);
+        dump_recorder_summary(sock);
+        dump_socket_overhead(logs_dir_path, sock->id, sock->overhead_ns);
         free_socket(sock);
 }
 
+// The socket is forgotten, as if it had never been traced.
+static void filter_out_socket(int fd) {
+        Socket *sock = remove_socket(fd);
+        if (!sock) return;
+        LOG(INFO, "Connection %d does not match filter.", sock->id);
+#ifdef TCPSNITCH_LEAN
+        char *path = alloc_counters_path_str(sock);
+#else
+        if (sock->capture) capture_stop(sock->capture, 0);
+        char *path = alloc_json_path_str(sock);
+#endif
+        // The dumper thread may already have written the trace.
+        if (path) {
+                unlink(path);
+                free(path);
+        }
+        free_socket(sock);
+        mark_filtered_out(fd);
+}
+
 // Used for any event that duplicates a socket, such as dup() or accept().
 // We don't have a regular socket() call but we still need to know about the
 // type of socket we are dealing with in the trace. To this purpose, we copy
 // the sock_info of the original socket to the new event & socket.
-#define DUP_SOCKET(ev_type_cons, ev_type)                              \
+#define DUP_SOCKET(ev_type_cons, ev_type, new_id)                      \
         {                                                              \
-                Socket *new_sock = alloc_socket(ret);                  \
+                Socket *new_sock = alloc_socket(ret, new_id);          \
+                fd_table_clear(ret);                                   \
                 memcpy(&new_sock->sock_info, &sock->sock_info,         \
                        sizeof(SockInfo));                              \
                 log_event(INFO, ev_type_cons, ret, new_sock->id);      \
@@ -466,25 +1119,96 @@ void free_and_dump_socket(int fd) {
                        sizeof(SockInfo));                              \
                 push_event(new_sock, (SockEvent *)new_ev);             \
                 ra_unlock_elem(fd);                                    \
-                ra_put_elem(ret, new_sock);                            \
+                put_socket(ret, new_sock);                             \
                 sock = ra_get_and_lock_elem(fd);                       \
         }
 
-#define SOCK_EV_PRELUDE(ev_type_cons, ev_type)                       \
+// Locks the socket, before SOCK_EV_START(). SOCK_EV_PRELUDE() does both.
+#define SOCK_EV_LOCK()                                               \
         init_tcpsnitch();                                            \
-        if (!ra_is_present(fd)) sock_ev_ghost_socket(fd);            \
-        Socket *sock = ra_get_and_lock_elem(fd);                     \
+        if (!ra_is_present(fd) && !sock_ev_ghost_socket(fd)) return; \
+        Socket *sock = ra_get_and_lock_elem(fd);
+
+#define SOCK_EV_PRELUDE(ev_type_cons, ev_type) \
+        SOCK_EV_LOCK();                        \
+        SOCK_EV_START(ev_type_cons, ev_type)
+
+#ifdef TCPSNITCH_LEAN
+// The lean build only counts events. The event is filled on the stack, as the
+// hooks expect, then counted and released.
+#define SOCK_EV_START(ev_type_cons, ev_type)                         \
+        trigger_on_error(sock, ret, err);                            \
+        if (is_dropped_event(sock, ev_type_cons)) {                  \
+                ra_unlock_elem(fd);                                  \
+                return;                                              \
+        }                                                            \
+        log_event(INFO, ev_type_cons, fd, sock->id);                 \
+        ev_type _ev;                                                 \
+        memset(&_ev, 0, sizeof(ev_type));                            \
+        ev_type *ev = &_ev;                                          \
+        init_event((SockEvent *)ev, ev_type_cons, ret, err,          \
+                   sock->events_count);
+
+#define SOCK_EV_POSTLUDE(ev_type_cons)                                      \
+        count_event(sock, ev_type_cons, ((SockEvent *)ev)->success);        \
+        free_event_fields((SockEvent *)ev);                                 \
+        request_tcp_info(sock);                                             \
+        account_overhead(sock);                                             \
+        ra_unlock_elem(fd);
+#else
+#define SOCK_EV_START(ev_type_cons, ev_type)                         \
+        trigger_on_error(sock, ret, err);                            \
+        if (is_dropped_event(sock, ev_type_cons)) {                  \
+                ra_unlock_elem(fd);                                  \
+                return;                                              \
+        }                                                            \
         log_event(INFO, ev_type_cons, fd, sock->id);                 \
         ev_type *ev = (ev_type *)alloc_event(ev_type_cons, ret, err, \
                                              sock->events_count);
 
 #define SOCK_EV_POSTLUDE(ev_type_cons)                                      \
+        check_recorder(sock, ((SockEvent *)ev)->type,                       \
+                       ((SockEvent *)ev)->success, ((SockEvent *)ev)->err); \
         push_event(sock, (SockEvent *)ev);                                  \
         output_event((SockEvent *)ev);                                      \
-        bool dump_tcp_info =                                                \
-            should_dump_tcp_info(sock) && ev_type_cons != SOCK_EV_TCP_INFO; \
-        ra_unlock_elem(fd);                                                 \
-        if (dump_tcp_info) tcp_dump_tcp_info(fd);
+        request_tcp_info(sock);                                             \
+        account_overhead(sock);                                             \
+        ra_unlock_elem(fd);
+#endif
+
+// Data-path events do not allocate a SockEvent, they push a DataEvent record.
+#define SOCK_EV_DATA_PRELUDE(ev_type_cons)                           \
+        init_tcpsnitch();                                            \
+        if (!ra_is_present(fd) && !sock_ev_ghost_socket(fd)) return; \
+        Socket *sock = ra_get_and_lock_elem(fd);                     \
+        trigger_on_error(sock, ret, err);                            \
+        log_event(INFO, ev_type_cons, fd, sock->id);
+
+// Dropped events still update the byte counters.
+#ifdef TCPSNITCH_LEAN
+#define SOCK_EV_DATA_POSTLUDE(ev_type_cons, bytes, flags, addr, len) \
+        UNUSED(err);                                                 \
+        UNUSED(flags);                                               \
+        UNUSED(addr);                                                \
+        UNUSED(len);                                                 \
+        if (!is_dropped_event(sock, ev_type_cons))                   \
+                count_event(sock, ev_type_cons, ret != -1);          \
+        request_tcp_info(sock);                                      \
+        account_overhead(sock);                                      \
+        ra_unlock_elem(fd);
+#else
+#define SOCK_EV_DATA_POSTLUDE(ev_type_cons, bytes, flags, addr, len)        \
+        if (!is_dropped_event(sock, ev_type_cons)) {                        \
+                check_recorder(sock, ev_type_cons, ret != -1, err);         \
+                uint16_t peer = addr_table_intern(&sock->addrs, addr, len); \
+                push_data_event(sock, ev_type_cons, ret, err, bytes, flags, \
+                                peer);                                      \
+                output_data_event(sock);                                    \
+        }                                                                   \
+        request_tcp_info(sock);                                             \
+        account_overhead(sock);                                             \
+        ra_unlock_elem(fd);
+#endif
 
 const char *string_from_sock_event_type(SockEventType type) {
         static const char *strings[] = {
@@ -545,7 +1269,12 @@ void sock_ev_socket(int fd, int domain, int type, int protocol) {
                 free_and_dump_socket(fd);
         }
 
-        Socket *sock = alloc_socket(fd);
+        int id = next_socket_id();
+        if (!is_sampled(id)) {
+                sample_out(fd);
+                return;
+        }
+        Socket *sock = alloc_socket(fd, id);
         SockEvSocket *ev =
             (SockEvSocket *)alloc_event(SOCK_EV_SOCKET, fd, 0, 0);
 
@@ -557,31 +1286,79 @@ void sock_ev_socket(int fd, int domain, int type, int protocol) {
         log_event(INFO, SOCK_EV_SOCKET, fd, sock->id);
 
         push_event(sock, (SockEvent *)ev);
-        ra_put_elem(fd, sock);
-}
-
-void sock_ev_forked_socket(int fd, SockInfo *sock_info) {
-        Socket *forked_sock = alloc_socket(fd);
-        SockEvForkedSocket *ev =
-            (SockEvForkedSocket *)alloc_event(SOCK_EV_FORKED_SOCKET, 0, 0, 0);
-
-        memcpy(&forked_sock->sock_info, sock_info, sizeof(SockInfo));
-        memcpy(&ev->sock_info, sock_info, sizeof(SockInfo));
-        log_event(INFO, SOCK_EV_FORKED_SOCKET, fd, forked_sock->id);
-
-        push_event(forked_sock, (SockEvent *)ev);
-        ra_put_elem(fd, forked_sock);
+        account_overhead(sock);
+        put_socket(fd, sock);
 }
 
-void sock_ev_ghost_socket(int fd) {
-        Socket *ghost_sock = alloc_socket(fd);
+// Sock_info is filled from the fd if NULL, once the socket is sampled.
+static bool add_ghost_socket(int fd, const SockInfo *sock_info) {
+        int id = next_socket_id();
+        if (!is_sampled(id)) {
+                sample_out(fd);
+                return false;
+        }
+        SockInfo info;
+        if (!sock_info) {
+                fill_sock_info_from_fd(&info, fd);
+                sock_info = &info;
+        }
+        if (!is_fd_matched(fd, sock_info)) {
+                mark_filtered_out(fd);
+                return false;
+        }
+        Socket *ghost_sock = alloc_socket(fd, id);
         SockEvGhostSocket *ev =
             (SockEvGhostSocket *)alloc_event(SOCK_EV_GHOST_SOCKET, 0, 0, 0);
-        fill_sock_info_from_fd(&ev->sock_info, fd);
-        memcpy(&ghost_sock->sock_info, &ev->sock_info, sizeof(SockInfo));
+        memcpy(&ev->sock_info, sock_info, sizeof(SockInfo));
+        memcpy(&ghost_sock->sock_info, sock_info, sizeof(SockInfo));
         log_event(WARN, SOCK_EV_GHOST_SOCKET, fd, ghost_sock->id);
         push_event(ghost_sock, (SockEvent *)ev);
-        ra_put_elem(fd, ghost_sock);
+        put_socket(fd, ghost_sock);
+        return true;
+}
+
+bool sock_ev_ghost_socket(int fd) {
+        run_requested_fd_sweep();  // Which may find this socket.
+        mutex_lock(&ghost_mutex);
+        bool traced = ra_is_present(fd);
+        if (!traced && !is_fd_untraced(fd)) traced = add_ghost_socket(fd, NULL);
+        mutex_unlock(&ghost_mutex);
+        return traced;
+}
+
+/* Sockets found by a sweep, see fd_sweep.h. Those not classified yet are
+ * classified one by one. */
+void sock_ev_ghost_sockets(const SweptFd *fds, int count) {
+        mutex_lock(&ghost_mutex);
+        for (int i = 0; i < count; i++) {
+                int fd = fds[i].fd;
+                if (ra_is_present(fd) || fd_table_get(fd)) continue;  // Known.
+                if (fds[i].sock_info.filled)
+                        add_ghost_socket(fd, &fds[i].sock_info);
+                else if (is_inet_socket(fd))
+                        add_ghost_socket(fd, NULL);
+                else
+                        fd_table_set(fd, FD_NOT_INET);
+        }
+        mutex_unlock(&ghost_mutex);
+}
+
+#ifndef TCPSNITCH_LEAN
+/* Before connect(): the packets of the socket are then captured from its SYN,
+ * by its peer until sock_ev_connect(). The kernel still picks its port. */
+void sock_start_capture(int fd, const struct sockaddr *addr_to) {
+        Socket *sock = ra_get_and_lock_elem(fd);
+        if (sock && passes_filter(sock, addr_to))
+                capture_socket(fd, sock, addr_to);
+        ra_unlock_elem(fd);
+}
+#endif
+
+// Id of the socket traced on fd, -1 if none. Unknown sockets become ghosts.
+int sock_ev_socket_id(int fd) {
+        int id = fd_table_get_id(fd);
+        if (id >= 0 || !sock_ev_ghost_socket(fd)) return id;
+        return fd_table_get_id(fd);
 }
 
 void sock_ev_bind(int fd, int ret, int err, const struct sockaddr *addr,
@@ -590,13 +1367,21 @@ void sock_ev_bind(int fd, int ret, int err, const struct sockaddr *addr,
         SOCK_EV_PRELUDE(SOCK_EV_BIND, SockEvBind);
 
         fill_addr(&(ev->addr), addr, len);
+        bool matched = true;
         if (!ret) {
                 // Save bound addr as we will later use it for capture filter.
                 sock->bound = true;
                 memcpy(&sock->bound_addr, &ev->addr.sockaddr_sto, ev->addr.len);
+                // TCP sockets are matched again once connected or listening.
+                matched = passes_filter(sock, NULL) || is_tcp(sock);
+#ifndef TCPSNITCH_LEAN
+                // TCP sockets are captured once connected.
+                if (matched && is_udp(sock)) capture_socket(fd, sock, NULL);
+#endif
         }
 
         SOCK_EV_POSTLUDE(SOCK_EV_BIND);
+        if (!matched) filter_out_socket(fd);
 }
 
 void sock_ev_connect(int fd, int ret, int err, const struct sockaddr *addr,
@@ -605,8 +1390,18 @@ void sock_ev_connect(int fd, int ret, int err, const struct sockaddr *addr,
         SOCK_EV_PRELUDE(SOCK_EV_CONNECT, SockEvConnect);
 
         fill_addr(&(ev->addr), addr, len);
+        bool matched = passes_filter(sock, addr);
+#ifndef TCPSNITCH_LEAN
+        bool connecting = !ret || err == EINPROGRESS;
+        // The kernel has picked the local port by now.
+        if (sock->capture)
+                capture_connected_socket(fd, sock, connecting);
+        else if (matched && connecting)
+                capture_socket(fd, sock, addr);
+#endif
 
         SOCK_EV_POSTLUDE(SOCK_EV_CONNECT);
+        if (!matched) filter_out_socket(fd);
 }
 
 void sock_ev_shutdown(int fd, int ret, int err, int how) {
@@ -624,8 +1419,10 @@ void sock_ev_listen(int fd, int ret, int err, int backlog) {
         SOCK_EV_PRELUDE(SOCK_EV_LISTEN, SockEvListen);
 
         ev->backlog = backlog;
+        bool matched = passes_filter(sock, NULL);
 
         SOCK_EV_POSTLUDE(SOCK_EV_LISTEN);
+        if (!matched) filter_out_socket(fd);
 }
 
 void sock_ev_accept(int fd, int ret, int err, struct sockaddr *addr,
@@ -634,9 +1431,21 @@ void sock_ev_accept(int fd, int ret, int err, struct sockaddr *addr,
         SOCK_EV_PRELUDE(SOCK_EV_ACCEPT, SockEvAccept);
 
         if (ret != -1 && addr) fill_addr(&(ev->addr), addr, *addr_len);
-        if (ret != -1) DUP_SOCKET(SOCK_EV_ACCEPT, SockEvAccept);
+        if (ret != -1) {
+                int new_id = next_socket_id();
+                if (!is_sampled(new_id))
+                        sample_out(ret);
+                else if (!is_fd_matched(ret, &sock->sock_info))
+                        mark_filtered_out(ret);
+                else {
+                        DUP_SOCKET(SOCK_EV_ACCEPT, SockEvAccept, new_id);
+                }
+        }
 
         SOCK_EV_POSTLUDE(SOCK_EV_ACCEPT);
+#ifndef TCPSNITCH_LEAN
+        if (ret != -1) capture_accepted_socket(ret);
+#endif
 }
 
 void sock_ev_accept4(int fd, int ret, int err, struct sockaddr *addr,
@@ -646,9 +1455,21 @@ void sock_ev_accept4(int fd, int ret, int err, struct sockaddr *addr,
 
         if (ret != -1 && addr) fill_addr(&(ev->addr), addr, *addr_len);
         ev->flags = flags;
-        if (ret != -1) DUP_SOCKET(SOCK_EV_ACCEPT4, SockEvAccept4);
+        if (ret != -1) {
+                int new_id = next_socket_id();
+                if (!is_sampled(new_id))
+                        sample_out(ret);
+                else if (!is_fd_matched(ret, &sock->sock_info))
+                        mark_filtered_out(ret);
+                else {
+                        DUP_SOCKET(SOCK_EV_ACCEPT4, SockEvAccept4, new_id);
+                }
+        }
 
         SOCK_EV_POSTLUDE(SOCK_EV_ACCEPT4);
+#ifndef TCPSNITCH_LEAN
+        if (ret != -1) capture_accepted_socket(ret);
+#endif
 }
 
 void sock_ev_getsockopt(int fd, int ret, int err, int level, int optname,
@@ -671,78 +1492,77 @@ void sock_ev_setsockopt(int fd, int ret, int err, int level, int optname,
         SOCK_EV_POSTLUDE(SOCK_EV_SETSOCKOPT);
 }
 
+static void sock_ev_send_compact(int fd, int ret, int err,
+                                 SockEventType type, size_t bytes, int flags,
+                                 const struct sockaddr *addr, socklen_t len) {
+        lag_io(fd, ret, err);
+        // Inst. local var Socket *sock
+        SOCK_EV_DATA_PRELUDE(type);
+        sock->bytes_sent += bytes;
+        capture_sending_socket(fd, sock, ret);
+        SOCK_EV_DATA_POSTLUDE(type, bytes, flags, addr, len);
+}
+
+static void sock_ev_recv_compact(int fd, int ret, int err,
+                                 SockEventType type, size_t bytes, int flags,
+                                 const struct sockaddr *addr, socklen_t len) {
+        lag_io(fd, ret, err);
+        // Inst. local var Socket *sock
+        SOCK_EV_DATA_PRELUDE(type);
+        sock->bytes_received += bytes;
+        SOCK_EV_DATA_POSTLUDE(type, bytes, flags, addr, len);
+}
+
 void sock_ev_send(int fd, int ret, int err, const void *buf, size_t bytes,
                   int flags) {
-        // Inst. local vars Socket *sock & SockEvSend *ev
-        SOCK_EV_PRELUDE(SOCK_EV_SEND, SockEvSend);
         UNUSED(buf);
-
-        ev->bytes = bytes;
-        ev->flags = flags;
-        sock->bytes_sent += bytes;
-
-        SOCK_EV_POSTLUDE(SOCK_EV_SEND);
+        sock_ev_send_compact(fd, ret, err, SOCK_EV_SEND, bytes, flags,
+                             NULL, 0);
 }
 
 void sock_ev_recv(int fd, int ret, int err, void *buf, size_t bytes,
                   int flags) {
-        // Inst. local vars Socket *sock & SockEvRecv *ev
-        SOCK_EV_PRELUDE(SOCK_EV_RECV, SockEvRecv);
         UNUSED(buf);
-
-        ev->bytes = bytes;
-        ev->flags = flags;
-        sock->bytes_received += bytes;
-
-        SOCK_EV_POSTLUDE(SOCK_EV_RECV);
+        sock_ev_recv_compact(fd, ret, err, SOCK_EV_RECV, bytes, flags,
+                             NULL, 0);
 }
 
 void sock_ev_sendto(int fd, int ret, int err, const void *buf, size_t bytes,
                     int flags, const struct sockaddr *addr, socklen_t len) {
-        // Inst. local vars Socket *sock & SockEvSendto *ev
-        SOCK_EV_PRELUDE(SOCK_EV_SENDTO, SockEvSendto);
         UNUSED(buf);
-
-        ev->bytes = bytes;
-        ev->flags = flags;
-        sock->bytes_sent += bytes;
-        if (addr) fill_addr(&(ev->addr), addr, len);
-
-        SOCK_EV_POSTLUDE(SOCK_EV_SENDTO);
+        sock_ev_send_compact(fd, ret, err, SOCK_EV_SENDTO, bytes, flags, addr,
+                             len);
 }
 
 void sock_ev_recvfrom(int fd, int ret, int err, void *buf, size_t bytes,
                       int flags, const struct sockaddr *addr, socklen_t *len) {
-        // Inst. local vars Socket *sock & SockEvRecvfrom *ev
-        SOCK_EV_PRELUDE(SOCK_EV_RECVFROM, SockEvRecvfrom);
         UNUSED(buf);
-
-        ev->bytes = bytes;
-        ev->flags = flags;
-        sock->bytes_received += bytes;
-        if (ret != -1 && addr) fill_addr(&(ev->addr), addr, *len);
-
-        SOCK_EV_POSTLUDE(SOCK_EV_RECVFROM);
+        bool has_addr = (ret != -1 && addr);
+        sock_ev_recv_compact(fd, ret, err, SOCK_EV_RECVFROM, bytes, flags,
+                             has_addr ? addr : NULL, has_addr ? *len : 0);
 }
 
 void sock_ev_sendmsg(int fd, int ret, int err, const struct msghdr *msg,
                      int flags) {
+        lag_io(fd, ret, err);
         // Inst. local vars Socket *sock & SockEvSendmsg *ev
         SOCK_EV_PRELUDE(SOCK_EV_SENDMSG, SockEvSendmsg);
 
-        ev->bytes = fill_msghdr(&ev->msghdr, msg);
+        ev->bytes = fill_msghdr(&ev->msghdr, msg, true);
         ev->flags = flags;
         sock->bytes_sent += ev->bytes;
+        capture_sending_socket(fd, sock, ret);
 
         SOCK_EV_POSTLUDE(SOCK_EV_SENDMSG);
 }
 
 void sock_ev_recvmsg(int fd, int ret, int err, const struct msghdr *msg,
                      int flags) {
+        lag_io(fd, ret, err);
         // Inst. local vars Socket *sock & SockEvRecvmsg *ev
         SOCK_EV_PRELUDE(SOCK_EV_RECVMSG, SockEvRecvmsg);
 
-        ev->bytes = fill_msghdr(&ev->msghdr, msg);
+        ev->bytes = fill_msghdr(&ev->msghdr, msg, ret != -1);
         ev->flags = flags;
         sock->bytes_received += ev->bytes;
 
@@ -753,6 +1573,7 @@ void sock_ev_recvmsg(int fd, int ret, int err, const struct msghdr *msg,
 
 void sock_ev_sendmmsg(int fd, int ret, int err, const struct mmsghdr *vmessages,
                       unsigned int vlen, int flags) {
+        lag_io(fd, ret, err);
         // Inst. local vars Socket *sock & SockEvSendmmsg *ev
         SOCK_EV_PRELUDE(SOCK_EV_SENDMMSG, SockEvSendmmsg);
 
@@ -760,15 +1581,18 @@ void sock_ev_sendmmsg(int fd, int ret, int err, const struct mmsghdr *vmessages,
 
         ev->mmsghdr_count = vlen;
         ev->mmsghdr_vec = (Mmsghdr *)my_malloc(vlen * sizeof(Mmsghdr));
-        ev->bytes = fill_mmsghdr_vec(ev->mmsghdr_vec, vmessages, vlen);
+        ev->bytes = fill_mmsghdr_vec(ev->mmsghdr_vec, vmessages, vlen,
+                                     vlen);
 
         sock->bytes_sent += ev->bytes;
+        capture_sending_socket(fd, sock, ret);
         SOCK_EV_POSTLUDE(SOCK_EV_SENDMMSG);
 }
 
 void sock_ev_recvmmsg(int fd, int ret, int err, const struct mmsghdr *vmessages,
                       unsigned int vlen, int flags,
                       const struct timespec *tmo) {
+        lag_io(fd, ret, err);
         // Inst. local vars Socket *sock & SockEvRecvmmsg *ev
         SOCK_EV_PRELUDE(SOCK_EV_RECVMMSG, SockEvRecvmmsg);
 
@@ -778,7 +1602,7 @@ void sock_ev_recvmmsg(int fd, int ret, int err, const struct mmsghdr *vmessages,
 
         ev->mmsghdr_count = vlen;
         ev->mmsghdr_vec = (Mmsghdr *)my_malloc(vlen * sizeof(Mmsghdr));
-        ev->bytes = fill_mmsghdr_vec(ev->mmsghdr_vec, vmessages, vlen);
+        ev->bytes = fill_mmsghdr_vec(ev->mmsghdr_vec, vmessages, vlen, ret);
 
         sock->bytes_received += ev->bytes;
         SOCK_EV_POSTLUDE(SOCK_EV_RECVMMSG);
@@ -791,7 +1615,8 @@ void sock_ev_getsockname(int fd, int ret, int err, struct sockaddr *addr,
         // Inst. local vars Socket *sock & SockEvGetsockname *ev
         SOCK_EV_PRELUDE(SOCK_EV_GETSOCKNAME, SockEvGetsockname);
 
-        if (ret != -1) fill_addr(&(ev->addr), addr, *addrlen);
+        if (ret != -1)
+                ev->addr_id = addr_table_intern(&sock->addrs, addr, *addrlen);
 
         SOCK_EV_POSTLUDE(SOCK_EV_GETSOCKNAME);
 }
@@ -801,7 +1626,8 @@ void sock_ev_getpeername(int fd, int ret, int err, struct sockaddr *addr,
         // Inst. local vars Socket *sock & SockEvGetpeername *ev
         SOCK_EV_PRELUDE(SOCK_EV_GETPEERNAME, SockEvGetpeername);
 
-        if (ret != -1) fill_addr(&(ev->addr), addr, *addrlen);
+        if (ret != -1)
+                ev->addr_id = addr_table_intern(&sock->addrs, addr, *addrlen);
 
         SOCK_EV_POSTLUDE(SOCK_EV_GETPEERNAME);
 }
@@ -822,25 +1648,15 @@ void sock_ev_isfdtype(int fd, int ret, int err, int fdtype) {
 }
 
 void sock_ev_write(int fd, int ret, int err, const void *buf, size_t bytes) {
-        // Inst. local vars Socket *sock & SockEvWrite *ev
-        SOCK_EV_PRELUDE(SOCK_EV_WRITE, SockEvWrite);
         UNUSED(buf);
-
-        ev->bytes = bytes;
-        sock->bytes_sent += bytes;
-
-        SOCK_EV_POSTLUDE(SOCK_EV_WRITE);
+        sock_ev_send_compact(fd, ret, err, SOCK_EV_WRITE, bytes, 0,
+                             NULL, 0);
 }
 
 void sock_ev_read(int fd, int ret, int err, void *buf, size_t bytes) {
-        // Inst. local vars Socket *sock & SockEvRead *ev
-        SOCK_EV_PRELUDE(SOCK_EV_READ, SockEvRead);
         UNUSED(buf);
-
-        ev->bytes = bytes;
-        sock->bytes_received += bytes;
-
-        SOCK_EV_POSTLUDE(SOCK_EV_READ);
+        sock_ev_recv_compact(fd, ret, err, SOCK_EV_READ, bytes, 0,
+                             NULL, 0);
 }
 
 void sock_ev_close(int fd, int ret, int err) {
@@ -854,7 +1670,7 @@ void sock_ev_dup(int fd, int ret, int err) {
         // Inst. local vars Socket *sock & SockEvDup *ev
         SOCK_EV_PRELUDE(SOCK_EV_DUP, SockEvDup);
 
-        if (ret != -1) DUP_SOCKET(SOCK_EV_DUP, SockEvDup);
+        if (ret != -1) DUP_SOCKET(SOCK_EV_DUP, SockEvDup, next_socket_id());
 
         SOCK_EV_POSTLUDE(SOCK_EV_DUP);
 }
@@ -864,7 +1680,7 @@ void sock_ev_dup2(int fd, int ret, int err, int newfd) {
         SOCK_EV_PRELUDE(SOCK_EV_DUP2, SockEvDup2);
 
         ev->newfd = newfd;
-        if (ret != -1) DUP_SOCKET(SOCK_EV_DUP2, SockEvDup2);
+        if (ret != -1) DUP_SOCKET(SOCK_EV_DUP2, SockEvDup2, next_socket_id());
 
         SOCK_EV_POSTLUDE(SOCK_EV_DUP2);
 }
@@ -875,13 +1691,14 @@ void sock_ev_dup3(int fd, int ret, int err, int newfd, int flags) {
 
         ev->newfd = newfd;
         ev->o_cloexec = (flags == O_CLOEXEC);
-        if (ret != -1) DUP_SOCKET(SOCK_EV_DUP3, SockEvDup3);
+        if (ret != -1) DUP_SOCKET(SOCK_EV_DUP3, SockEvDup3, next_socket_id());
 
         SOCK_EV_POSTLUDE(SOCK_EV_DUP3);
 }
 
 void sock_ev_writev(int fd, int ret, int err, const struct iovec *iovec,
                     int iovec_count) {
+        lag_io(fd, ret, err);
         // Inst. local vars Socket *sock & SockEvWritev *ev
         SOCK_EV_PRELUDE(SOCK_EV_WRITEV, SockEvWritev);
 
@@ -893,6 +1710,7 @@ void sock_ev_writev(int fd, int ret, int err, const struct iovec *iovec,
 
 void sock_ev_readv(int fd, int ret, int err, const struct iovec *iovec,
                    int iovec_count) {
+        lag_io(fd, ret, err);
         // Inst. local vars Socket *sock & SockEvReadv *ev
         SOCK_EV_PRELUDE(SOCK_EV_READV, SockEvReadv);
 
@@ -928,68 +1746,6 @@ void sock_ev_sendfile(int fd, int ret, int err, int in_fd, off_t *offset,
         SOCK_EV_POSTLUDE(SOCK_EV_SENDFILE);
 }
 
-void sock_ev_poll(int fd, int ret, int err, short requested_events,
-                  short returned_events, int timeout) {
-        // Inst. local vars Socket *sock & SockEvPoll *ev
-        SOCK_EV_PRELUDE(SOCK_EV_POLL, SockEvPoll);
-
-        ev->timeout.seconds = (timeout / 1000);
-        ev->timeout.nanoseconds = (timeout % 1000) * 1000;
-        fill_poll_events(&ev->requested_events, requested_events);
-        fill_poll_events(&ev->returned_events, returned_events);
-
-        SOCK_EV_POSTLUDE(SOCK_EV_POLL);
-}
-
-void sock_ev_ppoll(int fd, int ret, int err, short requested_events,
-                   short returned_events, const struct timespec *timeout) {
-        // Inst. local vars Socket *sock & SockEvPpoll *ev
-        SOCK_EV_PRELUDE(SOCK_EV_PPOLL, SockEvPpoll);
-
-        ev->timeout.seconds = timeout ? timeout->tv_sec : 0;
-        ev->timeout.nanoseconds = timeout ? timeout->tv_nsec : 0;
-        fill_poll_events(&ev->requested_events, requested_events);
-        fill_poll_events(&ev->returned_events, returned_events);
-
-        SOCK_EV_POSTLUDE(SOCK_EV_PPOLL);
-}
-
-void sock_ev_select(int fd, int ret, int err, bool req_read, bool req_write,
-                    bool req_except, bool ret_read, bool ret_write,
-                    bool ret_except, struct timeval *timeout) {
-        // Inst. local vars Socket *sock & SockEvSelect *ev
-        SOCK_EV_PRELUDE(SOCK_EV_SELECT, SockEvSelect);
-
-        ev->timeout.seconds = timeout ? timeout->tv_sec : 0;
-        ev->timeout.nanoseconds = timeout ? timeout->tv_usec * 1000 : 0;
-        ev->requested_events.read = req_read;
-        ev->requested_events.write = req_write;
-        ev->requested_events.except = req_except;
-        ev->returned_events.read = ret_read;
-        ev->returned_events.write = ret_write;
-        ev->returned_events.except = ret_except;
-
-        SOCK_EV_POSTLUDE(SOCK_EV_SELECT);
-}
-
-void sock_ev_pselect(int fd, int ret, int err, bool req_read, bool req_write,
-                     bool req_except, bool ret_read, bool ret_write,
-                     bool ret_except, const struct timespec *timeout) {
-        // Inst. local vars Socket *sock & SockEvPselect *ev
-        SOCK_EV_PRELUDE(SOCK_EV_PSELECT, SockEvPselect);
-
-        ev->timeout.seconds = timeout ? timeout->tv_sec : 0;
-        ev->timeout.nanoseconds = timeout ? timeout->tv_nsec : 0;
-        ev->requested_events.read = req_read;
-        ev->requested_events.write = req_write;
-        ev->requested_events.except = req_except;
-        ev->returned_events.read = ret_read;
-        ev->returned_events.write = ret_write;
-        ev->returned_events.except = ret_except;
-
-        SOCK_EV_POSTLUDE(SOCK_EV_PSELECT);
-}
-
 void sock_ev_fcntl(int fd, int ret, int err, int cmd, ...) {
         // Inst. local vars Socket *sock & SockEvFcntl *ev
         SOCK_EV_PRELUDE(SOCK_EV_FCNTL, SockEvFcntl);
@@ -1046,7 +1802,8 @@ void sock_ev_fcntl(int fd, int ret, int err, int cmd, ...) {
         }
 
         bool dup = (ev->cmd == F_DUPFD || ev->cmd == F_DUPFD_CLOEXEC);
-        if (dup && ret != -1) DUP_SOCKET(SOCK_EV_FCNTL, SockEvFcntl);
+        if (dup && ret != -1)
+                DUP_SOCKET(SOCK_EV_FCNTL, SockEvFcntl, next_socket_id());
         SOCK_EV_POSTLUDE(SOCK_EV_FCNTL);
 }
 
@@ -1063,6 +1820,7 @@ void sock_ev_epoll_ctl(int fd, int ret, int err, int op,
 
 void sock_ev_epoll_wait(int fd, int ret, int err, int timeout,
                         uint32_t returned_events) {
+        lag_mark_ready(fd, hook_start_ns);
         // Inst. local vars Socket *sock & SockEvEpollWait *ev
         SOCK_EV_PRELUDE(SOCK_EV_EPOLL_WAIT, SockEvEpollWait);
 
@@ -1074,6 +1832,7 @@ void sock_ev_epoll_wait(int fd, int ret, int err, int timeout,
 
 void sock_ev_epoll_pwait(int fd, int ret, int err, int timeout,
                          uint32_t returned_events) {
+        lag_mark_ready(fd, hook_start_ns);
         // Inst. local vars Socket *sock & SockEvEpollPwait *ev
         SOCK_EV_PRELUDE(SOCK_EV_EPOLL_PWAIT, SockEvEpollPwait);
 
@@ -1095,42 +1854,230 @@ void sock_ev_fdopen(int fd, FILE *_ret, int err, const char *mode) {
         SOCK_EV_POSTLUDE(SOCK_EV_FDOPEN);
 }
 
-void sock_ev_tcp_info(int fd, int ret, int err, struct tcp_info *info) {
+void sock_ev_tcp_info(int fd, int ret, int err, const struct tcp_info *info,
+                      const SockDiagEntry *diag) {
         // Inst. local vars Socket *sock & SockEvTcpInfo *ev
-        SOCK_EV_PRELUDE(SOCK_EV_TCP_INFO, SockEvTcpInfo);
+        SOCK_EV_LOCK();
+        // The sampling state is updated even if the event is dropped, e.g.
+        // over the -e budget.
+        sock->last_info_dump_bytes = sock->bytes_sent + sock->bytes_received;
+        sock->last_info_dump_ns = get_time_ns();
+        sock->tcp_info_requested = false;
+        if (!ret) {
+                sock->rtt = info->tcpi_rtt;
+                trigger_on_retrans(sock, info);
+        }
+        SOCK_EV_START(SOCK_EV_TCP_INFO, SockEvTcpInfo);
         LOG_FUNC_INFO;
 
         memcpy(&(ev->info), info, sizeof(struct tcp_info));
-        sock->last_info_dump_bytes = sock->bytes_sent + sock->bytes_received;
-        sock->last_info_dump_micros = get_time_micros();
-        sock->rtt = info->tcpi_rtt;
-        free(info);
+        if (diag) {
+                ev->from_sock_diag = true;
+                ev->rqueue = diag->rqueue;
+                ev->wqueue = diag->wqueue;
+                ev->meminfo = diag->meminfo;
+        }
 
         SOCK_EV_POSTLUDE(SOCK_EV_TCP_INFO);
 }
 
+/* Run by the TCP_INFO sampler. The socket may have been closed since it was
+ * found due, in which case its id is no longer cached for the fd. */
+void sock_ev_sample_tcp_info(int fd, int id) {
+        if (fd_table_get_id(fd) != id) return;
+        uint64_t start = get_time_ns();
+        hook_start_ns = start;  // Accounted to the socket.
+        struct tcp_info info;
+        int ret = fill_tcp_info(fd, &info);
+        int err = errno;
+        if (fd_table_get_id(fd) == id)
+                sock_ev_tcp_info(fd, ret, err, &info, NULL);
+        hook_start_ns = 0;
+        overhead_add(OVERHEAD_TCP_INFO, get_time_ns() - start);
+}
+
+typedef struct {
+        ino_t inode;
+        int fd;
+        int id;
+        bool sampled;
+} DueSocket;
+
+typedef struct {
+        DueSocket *socks;  // Sorted by inode.
+        int count;
+} DueSockets;
+
+static int compare_inodes(const void *a, const void *b) {
+        ino_t ia = ((const DueSocket *)a)->inode;
+        ino_t ib = ((const DueSocket *)b)->inode;
+        return (ia > ib) - (ia < ib);
+}
+
+// Looked up once, the sampler thread runs fstat() rather than the hooks.
+static ino_t get_inode(Socket *sock) {
+        struct stat st;
+        if (!sock->inode && !fstat(sock->fd, &st) && S_ISSOCK(st.st_mode))
+                sock->inode = st.st_ino;
+        return sock->inode;
+}
+
+static void collect_due_sockets(long period_us, DueSockets *due) {
+        uint64_t now = get_time_ns();
+        int size = ra_get_size();
+        due->count = 0;
+        due->socks = NULL;
+        if (!size) return;
+        due->socks = (DueSocket *)my_malloc(size * sizeof(DueSocket));
+        for (int i = 0; i < size; i++) {
+                if (!ra_is_present(i)) continue;
+                Socket *sock = ra_get_and_lock_elem(i);
+                if (sock && is_tcp(sock) &&
+                    sock->last_info_dump_ns + (uint64_t)period_us * 1000 <
+                        now) {
+                        DueSocket *d = &due->socks[due->count++];
+                        d->inode = get_inode(sock);
+                        d->fd = i;
+                        d->id = sock->id;
+                        d->sampled = false;
+                }
+                ra_unlock_elem(i);
+        }
+        qsort(due->socks, due->count, sizeof(DueSocket), compare_inodes);
+}
+
+static void sample_from_sock_diag(const SockDiagEntry *entry, void *arg) {
+        DueSockets *due = (DueSockets *)arg;
+        DueSocket key = {.inode = entry->inode};
+        DueSocket *d = (DueSocket *)bsearch(&key, due->socks, due->count,
+                                            sizeof(DueSocket), compare_inodes);
+        if (!d || d->sampled || !entry->has_info) return;
+        d->sampled = true;
+        if (fd_table_get_id(d->fd) != d->id) return;  // Closed since.
+        hook_start_ns = get_time_ns();  // Accounted to the socket.
+        sock_ev_tcp_info(d->fd, 0, 0, &entry->info, entry);
+        hook_start_ns = 0;
+}
+
+/* Samples the TCP sockets without TCP_INFO for over period_us, with one
+ * sock_diag dump. Those it misses, such as sockets with an unknown inode, are
+ * sampled with getsockopt(). */
+void sock_ev_sample_due_tcp_info(long period_us) {
+        DueSockets due;
+        collect_due_sockets(period_us, &due);
+        if (!due.count) goto out;
+        uint64_t start = get_time_ns();
+        sock_diag_dump(IPPROTO_TCP, sample_from_sock_diag, &due);
+        overhead_add(OVERHEAD_TCP_INFO, get_time_ns() - start);
+        for (int i = 0; i < due.count; i++)
+                if (!due.socks[i].sampled)
+                        sock_ev_sample_tcp_info(due.socks[i].fd,
+                                                due.socks[i].id);
+out:
+        free(due.socks);
+}
+
+void sock_ev_log_stats(void) {
+        long count = __atomic_load_n(&sampled_out_count, __ATOMIC_RELAXED);
+        if (count) LOG(INFO, "%ld sockets not traced due to sampling.", count);
+        count = __atomic_load_n(&filtered_out_count, __ATOMIC_RELAXED);
+        if (count) LOG(INFO, "%ld sockets not traced due to filter.", count);
+}
+
 void dump_all_sock_events(void) {
         LOG_FUNC_INFO;
         for (long i = 0; i < ra_get_size(); i++) {
                 if (!ra_is_present(i)) continue;
                 Socket *socket = ra_get_and_lock_elem(i);
-                if (socket) dump_events_as_json(socket);
+                if (socket) dump_socket(socket);
                 ra_unlock_elem(i);
         }
+        dump_mux_events();
+        dump_loop_lag();
+}
+
+// Dump and free all sockets, as if they were closed. Used when going dormant.
+void sock_ev_forget_all(void) {
+        LOG_FUNC_INFO;
+        for (long i = 0; i < ra_get_size(); i++)
+                if (ra_is_present(i)) free_and_dump_socket(i);
+}
+
+// Overhead, and -q counters, of the sockets still open, at exit.
+void sock_ev_dump_overhead(void) {
+        for (long i = 0; i < ra_get_size(); i++) {
+                if (!ra_is_present(i)) continue;
+                Socket *sock = ra_get_and_lock_elem(i);
+                if (sock) {
+                        dump_recorder_summary(sock);
+                        dump_socket_overhead(logs_dir_path, sock->id,
+                                             sock->overhead_ns);
+                }
+                ra_unlock_elem(i);
+        }
+}
+
+// The events of the sockets are written from now on, see -q.
+void sock_ev_trigger_all(const char *reason) {
+        if (!is_recorder_on()) return;
+        for (long i = 0; i < ra_get_size(); i++) {
+                if (!ra_is_present(i)) continue;
+                Socket *sock = ra_get_and_lock_elem(i);
+                if (sock && !sock->trigger) trigger_recorder(sock, reason);
+                ra_unlock_elem(i);
+        }
+}
+
+/* The socket is reused in place by the child, on its first access there (see
+ * RESET_ELEM), under the id assigned at fork() time. The parent's buffered
+ * events are its own to dump: they are left behind rather than freed, which
+ * would copy their pages for nothing. */
+void sock_ev_forked_socket(int fd, Socket *sock) {
+        SockInfo sock_info = sock->sock_info;
+        memset(sock, 0, sizeof(Socket));
+        sock->id = forked_ids[fd];
+        sock->fd = fd;
+        sock->sock_info = sock_info;
+
+        SockEvForkedSocket *ev =
+            (SockEvForkedSocket *)alloc_event(SOCK_EV_FORKED_SOCKET, 0, 0, 0);
+        ev->sock_info = sock_info;
+        log_event(INFO, SOCK_EV_FORKED_SOCKET, fd, sock->id);
+        push_event(sock, (SockEvent *)ev);
 }
 
 void sock_ev_free(void) {
         ra_free();
+        free(forked_ids);
+        forked_ids = NULL;
         pthread_mutex_destroy(&connections_count_mutex);
 }
 
+/* Locks are taken in the order they nest in, and held across fork(), so that
+ * the child finds the sockets with no hook or dump in progress. */
+void sock_ev_prepare_fork(void) {
+        mutex_lock(&ghost_mutex);
+        ra_lock_for_fork();
+        mutex_lock(&connections_count_mutex);
+}
+
+void sock_ev_parent_after_fork(void) {
+        mutex_unlock(&connections_count_mutex);
+        ra_unlock_after_fork();
+        mutex_unlock(&ghost_mutex);
+}
+
+/* In the child. Its mutexes cannot be unlocked, they belong to the parent.
+ * Only the new ids are assigned here, through the fd table: the sockets are
+ * reset lazily, so that forking costs no copy of their pages. */
 void sock_ev_reset(void) {
         mutex_init(&connections_count_mutex);
+        mutex_init(&ghost_mutex);
         connections_count = 0;
-        for (long i = 0; i < ra_get_size(); i++) {
-                if (!ra_is_present(i)) continue;
-                Socket *sock = ra_remove_elem(i);
-                sock_ev_forked_socket(i, &sock->sock_info);
-                free_socket(sock);
-        }
+        sampled_out_count = 0;
+        filtered_out_count = 0;
+        ra_reset_after_fork();
+        free(forked_ids);
+        forked_ids = (int *)my_malloc(ra_get_size() * sizeof(int));
+        ra_for_each_index(assign_forked_id);
 }
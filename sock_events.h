@@ -2,13 +2,18 @@
 #define SOCK_EVENTS_H
 
 #include <netinet/tcp.h>
+#ifndef TCPSNITCH_LEAN
 #include <pcap/pcap.h>
+#endif
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <time.h>
+#include "addr_table.h"
+#include "sock_diag.h"
 
 typedef enum SockEventType {
         SOCK_EV_SOCKET,
@@ -70,7 +75,7 @@ typedef enum SockEventType {
 
 typedef struct {
         SockEventType type;
-        unsigned long timestamp_usec;
+        uint64_t timestamp_ns;  // See timestamp.h
         int return_value;
         bool success;
         int err;
@@ -180,14 +185,14 @@ typedef struct {
         SockEvent super;
         size_t bytes;
         int flags;
-        Addr addr;
+        uint16_t addr_id;  // Index in the socket address table.
 } SockEvSendto;
 
 typedef struct {
         SockEvent super;
         size_t bytes;
         int flags;
-        Addr addr;
+        uint16_t addr_id;  // Index in the socket address table.
 } SockEvRecvfrom;
 
 typedef struct {
@@ -195,11 +200,37 @@ typedef struct {
         size_t *iovec_sizes;
 } Iovec;
 
+typedef struct {
+        time_t seconds;
+        long nanoseconds;
+} Timeout;
+
+/* Ancillary data is decoded when the call is intercepted, the msg_control
+ * buffer itself is never copied. Fields are 0/false when the matching control
+ * message is absent. */
+typedef struct {
+        int cmsg_count;   // All control messages, including unknown ones.
+        int rights_fds;   // SCM_RIGHTS: number of file descriptors passed.
+        int udp_segment;  // UDP_SEGMENT: GSO segment size.
+        int udp_gro;      // UDP_GRO: GRO segment size.
+        bool timestamping;
+        Timeout ts_software;  // SO_TIMESTAMPING
+        Timeout ts_hardware;
+        int pktinfo_family;  // AF_INET for IP_PKTINFO, AF_INET6 for IPV6_.
+        int pktinfo_ifindex;
+        unsigned char pktinfo_addr[16];
+        bool zerocopy;  // SO_EE_ORIGIN_ZEROCOPY completion notification.
+        bool zerocopy_copied;
+        uint32_t zerocopy_lo;
+        uint32_t zerocopy_hi;
+} CmsgSummary;
+
 typedef struct {
         Iovec iovec;
         struct sockaddr_storage addr;
         int flags;
-        struct msghdr *msghdr;
+        size_t control_data_len;
+        CmsgSummary cmsg;
 } Msghdr;
 
 typedef struct {
@@ -216,11 +247,6 @@ typedef struct {
         Msghdr msghdr;
 } SockEvRecvmsg;
 
-typedef struct {
-        time_t seconds;
-        long nanoseconds;
-} Timeout;
-
 #if !defined(__ANDROID__) || __ANDROID_API__ >= 21
 typedef struct {
         Msghdr msghdr;
@@ -247,12 +273,12 @@ typedef struct {
 
 typedef struct {
         SockEvent super;
-        Addr addr;
+        uint16_t addr_id;  // Index in the socket address table.
 } SockEvGetsockname;
 
 typedef struct {
         SockEvent super;
-        Addr addr;
+        uint16_t addr_id;  // Index in the socket address table.
 } SockEvGetpeername;
 
 typedef struct { SockEvent super; } SockEvSockatmark;
@@ -318,50 +344,6 @@ typedef struct {
         size_t bytes;
 } SockEvSendfile;
 
-typedef struct {
-        bool pollin;
-        bool pollpri;
-        bool pollout;
-        bool pollrdhup;
-        bool pollerr;
-        bool pollhup;
-        bool pollnval;
-} PollEvents;
-
-typedef struct {
-        SockEvent super;
-        Timeout timeout;
-        PollEvents requested_events;
-        PollEvents returned_events;
-} SockEvPoll;
-
-typedef struct {
-        SockEvent super;
-        Timeout timeout;
-        PollEvents requested_events;
-        PollEvents returned_events;
-} SockEvPpoll;
-
-typedef struct {
-        bool read;
-        bool write;
-        bool except;
-} SelectEvents;
-
-typedef struct {
-        SockEvent super;
-        Timeout timeout;
-        SelectEvents requested_events;
-        SelectEvents returned_events;
-} SockEvSelect;
-
-typedef struct {
-        SockEvent super;
-        Timeout timeout;
-        SelectEvents requested_events;
-        SelectEvents returned_events;
-} SockEvPselect;
-
 typedef struct {
         SockEvent super;
         SockInfo sock_info;
@@ -395,6 +377,11 @@ typedef struct {
 typedef struct {
         SockEvent super;
         struct tcp_info info;
+        bool from_sock_diag;  // Else from getsockopt(), see sock_diag.h.
+        // Only with from_sock_diag
+        uint32_t rqueue;
+        uint32_t wqueue;
+        struct inet_diag_meminfo meminfo;
 } SockEvTcpInfo;
 
 typedef struct SockEventNode SockEventNode;
@@ -403,32 +390,119 @@ struct SockEventNode {
         SockEventNode *next;
 };
 
+/* Data-path events (send, recv, sendto, recvfrom, write & read) make up the
+ * vast majority of a trace. Rather than a heap allocated SockEvent plus a list
+ * node, they are stored as fixed 32-byte records packed in per-socket blocks.
+ * The full event is only rebuilt when dumping the trace. */
+typedef struct {
+        uint32_t id;          // Event id, to merge with the control events.
+        uint32_t delta_ns;  // Timestamp relative to the block base.
+        int32_t return_value;
+        int32_t err;
+        uint32_t bytes;  // Saturates at UINT32_MAX.
+        int32_t flags;
+        pid_t thread_id;
+        uint16_t peer;  // Index in the socket address table.
+        uint8_t type;   // SockEventType
+        uint8_t unused;
+} DataEvent;
+
+#define DATA_EV_BLOCK_SIZE 128  // 4KB of records per block.
+
+typedef struct DataEvBlock DataEvBlock;
+struct DataEvBlock {
+        DataEvent records[DATA_EV_BLOCK_SIZE];
+        uint64_t base_ns;  // Timestamp of the first record.
+        int first;         // Records before were evicted, see -q.
+        int count;
+        DataEvBlock *next;
+};
+
+#ifdef TCPSNITCH_LEAN
+/* The lean build keeps no events, only these counters. They are written as is
+ * to <id>.bin. Counts are indexed by SockEventType. */
+#define SOCK_COUNTERS_MAGIC 0x434e5354  // "TSNC"
+#define SOCK_COUNTERS_VERSION 1
+
+typedef struct {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t types_count;  // Number of entries in counts & errors.
+        int32_t id;
+        int32_t domain;
+        int32_t type;
+        int32_t protocol;
+        uint64_t bytes_sent;
+        uint64_t bytes_received;
+        uint64_t events_dropped;
+        uint64_t counts[SOCK_EV_TCP_INFO + 1];
+        uint64_t errors[SOCK_EV_TCP_INFO + 1];  // Calls which failed.
+} SockCounters;
+#endif
+
+/* Event recorder, set with -q <n>: a socket only keeps its last <n> events,
+ * which are written once it hits a trigger, along with all its later events.
+ * The triggers are a call which fails, other than with EAGAIN, EINPROGRESS,
+ * EALREADY or EINTR; a call RECORDER_OUTLIER_FACTOR times slower than the
+ * moving average of the socket, and over RECORDER_OUTLIER_MIN_MS; a connect()
+ * over RECORDER_SLOW_CONNECT_MS; and the -j triggers, see sock_filter.h. Calls
+ * which wait for the peer, e.g. recv() or accept(), are never outliers. Each
+ * socket gets a line of counters in recorder.txt, with its trigger if any. */
+#define RECORDER_OUTLIER_FACTOR 8
+#define RECORDER_OUTLIER_MIN_MS 10
+#define RECORDER_OUTLIER_WARMUP 8  // Calls before the average is trusted.
+#define RECORDER_SLOW_CONNECT_MS 1000
+
 typedef struct {
         // To be freed
         SockEventNode *head;  // Head for list of events.
         SockEventNode *tail;  // Tail for list of events.
+        DataEvBlock *data_head;  // Head for list of data-path records.
+        DataEvBlock *data_tail;  // Tail for list of data-path records.
+        AddrTable addrs;         // Peer addresses referenced by events.
         // Others
         int id;
         int fd;
         SockInfo sock_info;
         long events_count;
+        unsigned long events_dropped;  // Over the -e budget.
         unsigned long bytes_sent;      // Total bytes sent.
         unsigned long bytes_received;  // Total bytes received.
-        long last_info_dump_micros;  // Time of last info dump in microseconds.
+        uint64_t overhead_ns;          // Time spent in hooks, see overhead.h.
+        uint64_t last_info_dump_ns;  // Monotonic, of the last info dump.
         long last_info_dump_bytes;   // Total bytes (sent+recv) at last dump.
+        bool tcp_info_requested;     // Queued to the TCP_INFO sampler.
+        ino_t inode;                 // 0 until needed by sock_diag.h.
         bool bound;
         struct sockaddr_storage bound_addr;
+        bool filter_matched;  // Passed the -m filter.
         int rtt;
-        bool *capture_switch;
+        uint32_t total_retrans;  // At the last TCP_INFO sample.
+        long events_retained;         // In the lists, bounded by -q.
+        unsigned long errors_count;   // Failed calls, see -q.
+        const char *trigger;          // Of the -q recorder, NULL if none.
+        long trigger_event;           // Id of the event which triggered.
+        uint64_t latency_avg_ns;      // Moving average of the call latency.
+        unsigned int latency_samples;
+        uint64_t connect_start_ns;  // Of a pending non-blocking connect().
+        struct CaptureFlow *capture;  // See packet_sniffer.h.
+        bool capture_by_peer;  // Started before connect(), without a port.
+#ifdef TCPSNITCH_LEAN
+        SockCounters counters;
+#endif
 } Socket;
 
 const char *string_from_sock_event_type(SockEventType type);
 
 void free_socket(Socket *con);
+void free_and_dump_socket(int fd);
+void sock_ev_forked_socket(int fd, Socket *sock);
 
+#ifndef TCPSNITCH_LEAN
 // Packet capture
 
 void sock_start_capture(int fd, const struct sockaddr *connect_addr);
+#endif
 
 // Events hooks
 
@@ -518,20 +592,6 @@ void sock_ev_ioctl(int fd, int ret, int err, unsigned long int request);
 void sock_ev_sendfile(int fd, int ret, int err, int in_fd, off_t *offset,
                       size_t bytes);
 
-void sock_ev_poll(int fd, int ret, int err, short requested_events,
-                  short returned_event, int timeout);
-
-void sock_ev_ppoll(int fd, int ret, int err, short requested_events,
-                   short returned_event, const struct timespec *timeout);
-
-void sock_ev_select(int fd, int ret, int err, bool req_read, bool req_write,
-                    bool req_except, bool ret_read, bool ret_write,
-                    bool ret_except, struct timeval *timeout);
-
-void sock_ev_pselect(int fd, int ret, int err, bool req_read, bool req_write,
-                     bool req_except, bool ret_read, bool ret_write,
-                     bool ret_except, const struct timespec *timeout);
-
 void sock_ev_fcntl(int fd, int ret, int err, int cmd, ...);
 
 void sock_ev_epoll_ctl(int fd, int ret, int err, int op,
@@ -545,12 +605,25 @@ void sock_ev_epoll_pwait(int fd, int ret, int err, int timeout,
 
 void sock_ev_fdopen(int fd, FILE *ret, int err, const char *mode);
 
-void sock_ev_tcp_info(int fd, int ret, int err, struct tcp_info *info);
+void sock_ev_tcp_info(int fd, int ret, int err, const struct tcp_info *info,
+                      const SockDiagEntry *diag);
+
+int sock_ev_socket_id(int fd);
+typedef struct SweptFd SweptFd;
+void sock_ev_ghost_sockets(const SweptFd *fds, int count);
+void sock_ev_sample_tcp_info(int fd, int id);
+void sock_ev_sample_due_tcp_info(long period_us);
 
 void dump_all_sock_events(void);
+void sock_ev_log_stats(void);
+void sock_ev_forget_all(void);
+void sock_ev_dump_overhead(void);
+void sock_ev_trigger_all(const char *reason);
 
 void sock_ev_free(void);  // Free state.
-// Free state and restore to default state (called after fork()).
+// See pthread_atfork(), sock_ev_reset() is run by the child.
+void sock_ev_prepare_fork(void);
+void sock_ev_parent_after_fork(void);
 void sock_ev_reset(void);
 
 #endif
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+#include "sock_filter.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "constants.h"
+#include "lib.h"
+#include "logger.h"
+
+typedef enum {
+        TERM_PORT,
+        TERM_HOST,
+        TERM_TCP,
+        TERM_UDP,
+        TERM_IPV4,
+        TERM_IPV6
+} TermKind;
+
+typedef struct {
+        TermKind kind;
+        int port;
+        int family;  // Of the host network.
+        unsigned char addr[16];
+        int prefix_len;
+} Term;
+
+typedef struct {
+        Term terms[FILTER_MAX_TERMS];  // All must match.
+        int count;
+} Clause;
+
+// The filters may be replaced at runtime through the control socket.
+static pthread_rwlock_t clauses_lock = PTHREAD_RWLOCK_INITIALIZER;
+static Clause clauses[FILTER_MAX_CLAUSES];  // Any may match.
+static int clauses_count = 0;
+
+static uint64_t allowed_events = UINT64_MAX;
+
+typedef struct {
+        int type;         // SockEventType, -1 for any.
+        int err;          // Of a failed call, 0 for any call.
+        uint64_t min_ns;  // Latency over which the call matches.
+} Trigger;
+
+static pthread_rwlock_t triggers_lock = PTHREAD_RWLOCK_INITIALIZER;
+static Trigger triggers[FILTER_MAX_TRIGGERS];  // Any may match.
+static int triggers_count = 0;
+
+/* Private functions */
+
+static bool parse_host(Term *term, char *str) {
+        char *prefix = strchr(str, '/');
+        if (prefix) *prefix++ = '\0';
+
+        if (inet_pton(AF_INET, str, term->addr) == 1)
+                term->family = AF_INET;
+        else if (inet_pton(AF_INET6, str, term->addr) == 1)
+                term->family = AF_INET6;
+        else
+                return false;
+
+        int max_len = (term->family == AF_INET) ? 32 : 128;
+        term->prefix_len = prefix ? parse_long(prefix) : max_len;
+        return term->prefix_len >= 0 && term->prefix_len <= max_len;
+}
+
+static bool parse_term(Term *term, const char *token, char **saveptr) {
+        char *arg;
+        if (!strcmp(token, "tcp"))
+                term->kind = TERM_TCP;
+        else if (!strcmp(token, "udp"))
+                term->kind = TERM_UDP;
+        else if (!strcmp(token, "ipv4"))
+                term->kind = TERM_IPV4;
+        else if (!strcmp(token, "ipv6"))
+                term->kind = TERM_IPV6;
+        else if (!strcmp(token, "port")) {
+                if (!(arg = strtok_r(NULL, " ", saveptr))) return false;
+                term->kind = TERM_PORT;
+                term->port = parse_long(arg);
+                return term->port >= 0 && term->port <= 65535;
+        } else if (!strcmp(token, "host")) {
+                if (!(arg = strtok_r(NULL, " ", saveptr))) return false;
+                term->kind = TERM_HOST;
+                return parse_host(term, arg);
+        } else
+                return false;
+        return true;
+}
+
+static bool is_in_network(const unsigned char *addr,
+                          const unsigned char *network, int prefix_len) {
+        int bytes = prefix_len / 8, bits = prefix_len % 8;
+        if (memcmp(addr, network, bytes)) return false;
+        if (!bits) return true;
+        unsigned char mask = 0xff << (8 - bits);
+        return (addr[bytes] & mask) == (network[bytes] & mask);
+}
+
+static bool host_match(const Term *term, const struct sockaddr *addr) {
+        if (!addr) return false;
+        const unsigned char *bytes;
+        if (addr->sa_family == AF_INET && term->family == AF_INET) {
+                const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+                bytes = (const unsigned char *)&in->sin_addr;
+        } else if (addr->sa_family == AF_INET6) {
+                const struct sockaddr_in6 *in6 =
+                    (const struct sockaddr_in6 *)addr;
+                bytes = (const unsigned char *)&in6->sin6_addr;
+                // IPv4-mapped address matched against an IPv4 network.
+                if (term->family == AF_INET) {
+                        if (!IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+                                return false;
+                        bytes += 12;
+                }
+        } else
+                return false;
+        return is_in_network(bytes, term->addr, term->prefix_len);
+}
+
+static bool port_match(const Term *term, const struct sockaddr *addr) {
+        if (!addr) return false;
+        if (addr->sa_family == AF_INET)
+                return ntohs(((const struct sockaddr_in *)addr)->sin_port) ==
+                       term->port;
+        if (addr->sa_family == AF_INET6)
+                return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port) ==
+                       term->port;
+        return false;
+}
+
+static bool term_match(const Term *term, const SockInfo *sock_info,
+                       const struct sockaddr *local,
+                       const struct sockaddr *remote) {
+        switch (term->kind) {
+                case TERM_PORT:
+                        return port_match(term, local) ||
+                               port_match(term, remote);
+                case TERM_HOST:
+                        return host_match(term, local) ||
+                               host_match(term, remote);
+                case TERM_TCP:
+                        return sock_info->type == SOCK_STREAM;
+                case TERM_UDP:
+                        return sock_info->type == SOCK_DGRAM;
+                case TERM_IPV4:
+                        return sock_info->domain == AF_INET;
+                case TERM_IPV6:
+                        return sock_info->domain == AF_INET6;
+        }
+        return false;
+}
+
+// -1 if unknown.
+static int event_type_from_str(const char *str) {
+        for (int type = 0; type <= SOCK_EV_TCP_INFO; type++)
+                if (!strcmp(str, string_from_sock_event_type(type)))
+                        return type;
+        return -1;
+}
+
+static bool parse_trigger(Trigger *trigger, char *str) {
+        trigger->type = -1;
+        trigger->err = 0;
+        trigger->min_ns = 0;
+        if ((trigger->err = errno_from_str(str))) return true;
+
+        char *ms = strchr(str, '>');
+        if (ms) {
+                *ms++ = '\0';
+                long l = parse_long(ms);
+                if (l < 0) return false;
+                trigger->min_ns = (uint64_t)l * 1000000;
+        }
+        if (!strcmp(str, "*")) return ms != NULL;  // Any call, if slow.
+        return (trigger->type = event_type_from_str(str)) >= 0;
+}
+
+static bool trigger_match(const Trigger *trigger, SockEventType type,
+                          bool success, int err, uint64_t latency_ns) {
+        if (trigger->type >= 0 && trigger->type != (int)type) return false;
+        if (trigger->err) return !success && err == trigger->err;
+        return latency_ns >= trigger->min_ns;
+}
+
+/* Public functions */
+
+bool filter_compile(const char *expr) {
+        Clause new_clauses[FILTER_MAX_CLAUSES];
+        int count = 0;
+        char *str = NULL, *token = NULL;
+        if (!expr) goto set;
+
+        str = strdup(expr);
+        char *saveptr;
+        token = strtok_r(str, " ", &saveptr);
+        Clause *clause = &new_clauses[0];
+        clause->count = 0;
+        bool expect_term = true;
+        while (token) {
+                if (expect_term) {
+                        if (clause->count == FILTER_MAX_TERMS) goto error;
+                        if (!parse_term(&clause->terms[clause->count], token,
+                                        &saveptr))
+                                goto error;
+                        clause->count++;
+                        expect_term = false;
+                } else if (!strcmp(token, "and")) {
+                        expect_term = true;
+                } else if (!strcmp(token, "or")) {
+                        if (count + 1 == FILTER_MAX_CLAUSES) goto error;
+                        clause = &new_clauses[++count];
+                        clause->count = 0;
+                        expect_term = true;
+                } else
+                        goto error;
+                token = strtok_r(NULL, " ", &saveptr);
+        }
+        if (expect_term) goto error;
+        count++;
+        free(str);
+set:
+        pthread_rwlock_wrlock(&clauses_lock);
+        memcpy(clauses, new_clauses, sizeof(Clause) * count);
+        __atomic_store_n(&clauses_count, count, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&clauses_lock);
+        return true;
+error:
+        LOG(ERROR, "Invalid filter '%s' near '%s'. Filter unchanged.", expr,
+            token ? token : "end");
+        free(str);
+        return false;
+}
+
+bool is_filter_set(void) {
+        return __atomic_load_n(&clauses_count, __ATOMIC_ACQUIRE) > 0;
+}
+
+bool filter_match(const SockInfo *sock_info, const struct sockaddr *local,
+                  const struct sockaddr *remote) {
+        bool match = false;
+        pthread_rwlock_rdlock(&clauses_lock);
+        for (int i = 0; i < clauses_count && !match; i++) {
+                const Clause *clause = &clauses[i];
+                int j;
+                for (j = 0; j < clause->count; j++)
+                        if (!term_match(&clause->terms[j], sock_info, local,
+                                        remote))
+                                break;
+                match = (j == clause->count);
+        }
+        pthread_rwlock_unlock(&clauses_lock);
+        return match;
+}
+
+bool filter_events_compile(const char *list) {
+        uint64_t mask = 0;
+        char *str = NULL, *token = NULL;
+        if (!list) {
+                mask = UINT64_MAX;
+                goto set;
+        }
+
+        str = strdup(list);
+        char *saveptr;
+        for (token = strtok_r(str, ",", &saveptr); token;
+             token = strtok_r(NULL, ",", &saveptr)) {
+                int type = event_type_from_str(token);
+                if (type < 0) goto error;
+                mask |= (uint64_t)1 << type;
+        }
+        free(str);
+set:
+        __atomic_store_n(&allowed_events, mask, __ATOMIC_RELAXED);
+        return true;
+error:
+        LOG(ERROR, "Unknown event '%s' in allowlist. Allowlist unchanged.",
+            token);
+        free(str);
+        return false;
+}
+
+bool filter_allows_event(SockEventType type) {
+        uint64_t mask = __atomic_load_n(&allowed_events, __ATOMIC_RELAXED);
+        return mask & ((uint64_t)1 << type);
+}
+
+bool filter_triggers_compile(const char *list) {
+        Trigger new_triggers[FILTER_MAX_TRIGGERS];
+        int count = 0;
+        char *str = NULL, *token = NULL;
+        if (!list) goto set;
+
+        str = strdup(list);
+        char *saveptr;
+        for (token = strtok_r(str, ",", &saveptr); token;
+             token = strtok_r(NULL, ",", &saveptr)) {
+                if (count == FILTER_MAX_TRIGGERS) goto error;
+                if (!parse_trigger(&new_triggers[count], token)) goto error;
+                count++;
+        }
+        free(str);
+set:
+        pthread_rwlock_wrlock(&triggers_lock);
+        memcpy(triggers, new_triggers, sizeof(Trigger) * count);
+        __atomic_store_n(&triggers_count, count, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&triggers_lock);
+        return true;
+error:
+        LOG(ERROR, "Invalid trigger '%s'. Triggers unchanged.",
+            token ? token : list);
+        free(str);
+        return false;
+}
+
+bool filter_triggers_match(SockEventType type, bool success, int err,
+                           uint64_t latency_ns) {
+        if (!__atomic_load_n(&triggers_count, __ATOMIC_ACQUIRE)) return false;
+        bool match = false;
+        pthread_rwlock_rdlock(&triggers_lock);
+        for (int i = 0; i < triggers_count && !match; i++)
+                match = trigger_match(&triggers[i], type, success, err,
+                                      latency_ns);
+        pthread_rwlock_unlock(&triggers_lock);
+        return match;
+}
+
+/* Held across fork(), so that the child does not find a filter half-compiled
+ * through the control socket. */
+void filter_prepare_fork(void) {
+        pthread_rwlock_wrlock(&clauses_lock);
+        pthread_rwlock_wrlock(&triggers_lock);
+}
+
+void filter_parent_after_fork(void) {
+        pthread_rwlock_unlock(&triggers_lock);
+        pthread_rwlock_unlock(&clauses_lock);
+}
+
+// In the child, the locks are the parent's.
+void filter_reset(void) {
+        pthread_rwlock_init(&clauses_lock, NULL);
+        pthread_rwlock_init(&triggers_lock, NULL);
+}
@@ -0,0 +1,52 @@
+#ifndef SOCK_FILTER_H
+#define SOCK_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "sock_events.h"
+
+/* Socket filter, set with -m. The expression is a disjunction of conjunctions
+ * of the following terms, e.g. "tcp and port 443 or host 10.0.0.0/8":
+ *  - port <n>: local or remote port is <n>.
+ *  - host <ip>[/<prefix>]: local or remote address is in the given network.
+ *  - tcp, udp: socket type is SOCK_STREAM or SOCK_DGRAM.
+ *  - ipv4, ipv6: socket domain is AF_INET or AF_INET6.
+ * It is compiled at init, and again when changed through the control socket.
+ * An invalid expression leaves the current filter in place. Sockets are matched
+ * at connect(), listen() and accept() time. */
+
+#define FILTER_MAX_CLAUSES 16
+#define FILTER_MAX_TERMS 8
+
+bool filter_compile(const char *expr);
+bool is_filter_set(void);
+bool filter_match(const SockInfo *sock_info, const struct sockaddr *local,
+                  const struct sockaddr *remote);
+
+/* Event allowlist, set with -w. Comma separated list of event names, e.g.
+ * "connect,send,recv". Structural events (socket, connect, close, ...) are
+ * always recorded. */
+
+bool filter_events_compile(const char *list);
+bool filter_allows_event(SockEventType type);
+
+/* Event recorder triggers, set with -j, see -q in sock_events.h. Comma
+ * separated list of the following terms, e.g. "ECONNREFUSED,connect>200":
+ *  - <event>: any call of this event, e.g. "shutdown".
+ *  - <errno>: a call which failed with this errno, e.g. "ECONNREFUSED".
+ *  - <event>><ms>: a call of this event which took at least <ms>.
+ *  - *><ms>: any call which took at least <ms>. */
+
+#define FILTER_MAX_TRIGGERS 16
+
+bool filter_triggers_compile(const char *list);
+bool filter_triggers_match(SockEventType type, bool success, int err,
+                           uint64_t latency_ns);
+
+// See pthread_atfork(), filter_reset() is run by the child.
+void filter_prepare_fork(void);
+void filter_parent_after_fork(void);
+void filter_reset(void);
+
+#endif
@@ -202,6 +202,10 @@ char *alloc_json_path_str(Socket *con) {
         return alloc_file_name(con->id, ".json");
 }
 
+char *alloc_counters_path_str(Socket *con) {
+        return alloc_file_name(con->id, ".bin");
+}
+
 char *alloc_pcap_path_str(Socket *con) {
         return alloc_file_name(con->id, ".pcap");
 }
@@ -217,12 +221,12 @@ char *alloc_cmdline_str(void) {
         int rc = fread(cmdline, 1, cmd_line_length, fp);
         if (!rc) goto error3;
 
-        fclose(fp);
+        my_fclose(fp);
         return cmdline;
 error3:
         LOG(ERROR, "fread() failed. %s.", strerror(errno));
         free(cmdline);
-        fclose(fp);
+        my_fclose(fp);
         goto error_out;
 error1:
         LOG(ERROR, "fopen() failed. %s.", strerror(errno));
@@ -296,6 +300,23 @@ error:
 #endif
 }
 
+/* Same as alloc_str_opt(), for options which are not always set. Returns NULL
+ * without complaining if the option is unset or empty. */
+char *alloc_optional_str_opt(const char *opt) {
+#ifdef __ANDROID__
+        char prop[PROP_VALUE_MAX + 1];
+        if (!__system_property_get(opt, prop)) return NULL;
+        const char *val = prop;
+#else
+        const char *val = get_str_env(opt);
+        if (!val || !*val) return NULL;
+#endif
+        int n = strlen(val) + 1;
+        char *opt_str = (char *)my_malloc(n * sizeof(char));
+        strncpy(opt_str, val, n);
+        return opt_str;
+}
+
 char *alloc_iface_name(int fd, int iface_index) {
         struct ifreq ifr;
         ifr.ifr_ifindex = iface_index;
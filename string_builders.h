@@ -15,6 +15,7 @@ char *alloc_append_int_to_path(const char *path1, int i);
 char *alloc_android_opt_d(void);
 char *alloc_pcap_path_str(Socket *con);
 char *alloc_json_path_str(Socket *con);
+char *alloc_counters_path_str(Socket *con);
 
 char *alloc_cmdline_str(void);
 char *alloc_app_name(void);
@@ -28,6 +29,7 @@ char *alloc_property(const char *property);
 #endif
 
 char *alloc_str_opt(const char *opt);
+char *alloc_optional_str_opt(const char *opt);
 
 char *alloc_iface_name(int fd, int iface_index);
 #endif
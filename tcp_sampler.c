@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+
+#include "tcp_sampler.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "init.h"
+#include "lib.h"
+#include "logger.h"
+#include "sock_diag.h"
+#include "sock_events.h"
+#include "timestamp.h"
+
+typedef struct {
+        int fd;
+        int id;  // The fd may be reused before the request is served.
+} TcpInfoRequest;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond;
+static TcpInfoRequest queue[TCP_SAMPLER_QUEUE_SIZE];
+static int queue_count = 0;
+static bool sampler_started = false;
+static bool sampler_ready = false;  // queue_cond is initialized.
+
+/* Private functions */
+
+static void init_cond(void) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        // The deadlines are taken from CLOCK_MONOTONIC.
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        if (pthread_cond_init(&queue_cond, &attr)) goto error;
+        pthread_condattr_destroy(&attr);
+        return;
+error:
+        LOG(ERROR, "pthread_cond_init() failed.");
+        LOG_FUNC_ERROR;
+}
+
+static void wait_requests(long wait_us) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += wait_us / 1000000;
+        deadline.tv_nsec += (wait_us % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+        }
+        while (!queue_count)
+                if (pthread_cond_timedwait(&queue_cond, &queue_mutex,
+                                           &deadline) == ETIMEDOUT)
+                        return;
+}
+
+/* opt_u may be changed at runtime through the control socket, it is thus read
+ * at each round. Requests are served outside the lock, so that hooks enqueuing
+ * are never held by a TCP_INFO call. */
+static void *sampler_thread(void *arg) {
+        UNUSED(arg);
+        LOG_FUNC_INFO;
+        TcpInfoRequest requests[TCP_SAMPLER_QUEUE_SIZE];
+        uint64_t last_sweep_ns = 0;
+        while (true) {
+                long period_us = __atomic_load_n(&conf_opt_u, __ATOMIC_RELAXED);
+                mutex_lock(&queue_mutex);
+                wait_requests(period_us > 0 ? period_us
+                                            : TCP_SAMPLER_IDLE_MS * 1000);
+                int count = queue_count;
+                memcpy(requests, queue, count * sizeof(TcpInfoRequest));
+                queue_count = 0;
+                mutex_unlock(&queue_mutex);
+
+                for (int i = 0; i < count; i++)
+                        sock_ev_sample_tcp_info(requests[i].fd,
+                                                requests[i].id);
+                uint64_t now = get_time_ns();
+                if (period_us > 0 &&
+                    now - last_sweep_ns >= (uint64_t)period_us * 1000) {
+                        sock_ev_sample_due_tcp_info(period_us);
+                        last_sweep_ns = now;
+                }
+        }
+        // Unreachable
+        return NULL;
+}
+
+/* Public functions */
+
+void start_tcp_sampler_thread(void) {
+        if (__atomic_exchange_n(&sampler_started, true, __ATOMIC_ACQ_REL))
+                return;  // Already running.
+        init_cond();
+        __atomic_store_n(&sampler_ready, true, __ATOMIC_RELEASE);
+        pthread_t thread;
+        my_pthread_create(&thread, NULL, sampler_thread, NULL);
+}
+
+// Returns false when the request could not be queued.
+bool tcp_sampler_request(int fd, int id) {
+        if (!__atomic_load_n(&sampler_ready, __ATOMIC_ACQUIRE)) return false;
+        bool queued = false;
+        mutex_lock(&queue_mutex);
+        if (queue_count < TCP_SAMPLER_QUEUE_SIZE) {
+                queue[queue_count].fd = fd;
+                queue[queue_count].id = id;
+                queue_count++;
+                queued = true;
+                pthread_cond_signal(&queue_cond);
+        }
+        mutex_unlock(&queue_mutex);
+        return queued;
+}
+
+// Held across fork(), so that the child does not find the queue mid-update.
+void tcp_sampler_prepare_fork(void) { mutex_lock(&queue_mutex); }
+
+void tcp_sampler_parent_after_fork(void) { mutex_unlock(&queue_mutex); }
+
+void reset_tcp_sampler(void) {
+        sampler_started = false;  // Threads do not survive fork().
+        sampler_ready = false;
+        mutex_init(&queue_mutex);
+        queue_count = 0;
+        reset_sock_diag();
+}
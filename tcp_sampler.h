@@ -0,0 +1,21 @@
+#ifndef TCP_SAMPLER_H
+#define TCP_SAMPLER_H
+
+#include <stdbool.h>
+
+/* TCP_INFO sampling, off the application threads. A background thread samples
+ * the TCP sockets which are due: every -u <usec>, and as soon as a socket has
+ * sent+received over -b <bytes> since its last sample. The hooks only check the
+ * byte counters and enqueue a request. Requests are served with getsockopt(),
+ * the -u sweeps with a single sock_diag dump, see sock_diag.h. */
+
+#define TCP_SAMPLER_QUEUE_SIZE 256  // Requests over it are retried later.
+#define TCP_SAMPLER_IDLE_MS 1000    // Wait between checks of -u when 0.
+
+void start_tcp_sampler_thread(void);
+bool tcp_sampler_request(int fd, int id);
+void tcp_sampler_prepare_fork(void);
+void tcp_sampler_parent_after_fork(void);
+void reset_tcp_sampler(void);
+
+#endif
@@ -0,0 +1,67 @@
+/* Cost of the libc overrides while tcpsnitch is dormant. Run it with and
+ * without tcpsnitch -i 0 (see the bench_dormant rake task): the per call
+ * times should be within noise of each other. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS 9
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double bench_getsockopt(int sock, long iters) {
+  int optval;
+  socklen_t optlen = sizeof(optval);
+  long long start = now_ns();
+  for (long i = 0; i < iters; i++)
+    getsockopt(sock, SOL_SOCKET, SO_TYPE, &optval, &optlen);
+  return (double)(now_ns() - start) / iters;
+}
+
+static double bench_fcntl(int sock, long iters) {
+  long long start = now_ns();
+  for (long i = 0; i < iters; i++)
+    fcntl(sock, F_GETFL);
+  return (double)(now_ns() - start) / iters;
+}
+
+static void report(const char *name, double (*bench)(int, long), int sock,
+                   long iters) {
+  double ns[ROUNDS];
+  for (int i = 0; i < ROUNDS; i++)
+    ns[i] = bench(sock, iters);
+  qsort(ns, ROUNDS, sizeof(double), cmp);
+  printf("%-12s median %7.1f ns/call (min %7.1f, max %7.1f)\n", name,
+         ns[ROUNDS / 2], ns[0], ns[ROUNDS - 1]);
+}
+
+int main(int argc, char **argv) {
+  long iters = (argc > 1) ? atol(argv[1]) : 1000000;
+  int sock;
+  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    fprintf(stderr, "socket() failed: %s\n.", strerror(errno));
+    return(EXIT_FAILURE);
+  }
+
+  report("getsockopt()", bench_getsockopt, sock, iters);
+  report("fcntl()", bench_fcntl, sock, iters);
+
+  close(sock);
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,76 @@
+/* Cost of fork() for a prefork server: the parent holds many listening
+ * sockets, each child exits right away. Run it with and without tcpsnitch
+ * (see the bench_fork rake task): the difference is the child-startup cost of
+ * tcpsnitch, which should grow with the number of live sockets only. */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS 9
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static int open_listener(void) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(sock, 16)) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Round trip of fork() & waitpid(), the child exits without cleanup.
+static double bench_fork(long forks) {
+  long long start = now_ns();
+  for (long i = 0; i < forks; i++) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) _exit(EXIT_SUCCESS);
+    int status;
+    waitpid(pid, &status, 0);
+  }
+  return (double)(now_ns() - start) / forks / 1000;
+}
+
+int main(int argc, char **argv) {
+  long listeners = (argc > 1) ? atol(argv[1]) : 500;
+  long forks = (argc > 2) ? atol(argv[2]) : 100;
+  for (long i = 0; i < listeners; i++) {
+    if (open_listener() < 0) {
+      fprintf(stderr, "socket() failed: %s\n.", strerror(errno));
+      return(EXIT_FAILURE);
+    }
+  }
+
+  double us[ROUNDS];
+  for (int i = 0; i < ROUNDS; i++)
+    us[i] = bench_fork(forks);
+  qsort(us, ROUNDS, sizeof(double), cmp);
+  printf("fork() with %ld listeners: median %7.1f us/child (min %7.1f, "
+         "max %7.1f)\n", listeners, us[ROUNDS / 2], us[0], us[ROUNDS - 1]);
+  return(EXIT_SUCCESS);
+}
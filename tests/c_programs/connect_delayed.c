@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int listener, sock;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(listener, (struct sockaddr *)&addr, len) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  for (int i = 0; i < 2; i++) {
+    if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, len) < 0)
+      return(EXIT_FAILURE);
+  }
+  pid_t pid = fork();
+  if (pid < 0) return(EXIT_FAILURE);
+  if (pid == 0) { // Child
+    usleep(500000);
+    for (int i = 0; i < 3; i++)
+      accept(listener, NULL, NULL);
+    return(EXIT_SUCCESS);
+  }
+  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+      connect(sock, (struct sockaddr *)&addr, len) < 0) {
+    fprintf(stderr, "connect() failed: %s\n.", strerror(errno));
+    return(EXIT_FAILURE);
+  }
+  if (send(sock, "x", 1, 0) < 0)
+    return(EXIT_FAILURE);
+  int status;
+  waitpid(pid, &status, 0);
+  close(sock);
+
+  return(EXIT_SUCCESS);
+}
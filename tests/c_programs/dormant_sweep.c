@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int sock;
+  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+    fprintf(stderr, "socket() failed: %s\n.", strerror(errno));
+    return(EXIT_FAILURE);
+  }
+
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(8000);
+  inet_aton("127.0.0.1", &addr.sin_addr);
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "connect() failed: %s\n.", strerror(errno));
+    return(EXIT_FAILURE);
+  }
+
+  int udp, fds[2];
+  if ((udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (pipe(fds) < 0)
+    return(EXIT_FAILURE);
+  if (raise(SIGUSR1))
+    return(EXIT_FAILURE);
+  if (write(fds[1], "x", 1) < 0)
+    return(EXIT_FAILURE);
+  if (send(sock, "x", 1, 0) < 0)
+    return(EXIT_FAILURE);
+
+  return(EXIT_SUCCESS);
+}
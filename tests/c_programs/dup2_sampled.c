@@ -0,0 +1,38 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int sock1, sock2;
+  if ((sock1 = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if ((sock2 = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(8000);
+  inet_aton("127.0.0.1", &addr.sin_addr);
+
+  if (dup2(sock2, sock2 + 10) < 0)
+    return(EXIT_FAILURE);
+  if (sendto(sock2 + 10, "x", 1, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return(EXIT_FAILURE);
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,54 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int sock, dup_sock, efd;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char buf[16];
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(sock, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if ((dup_sock = dup(sock)) < 0)
+    return(EXIT_FAILURE);
+  if ((efd = epoll_create1(0)) < 0)
+    return(EXIT_FAILURE);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) < 0)
+    return(EXIT_FAILURE);
+  for (int i = 0; i < 2; i++) {
+    if (sendto(sock, "x", 1, 0, (struct sockaddr *)&addr, len) < 0)
+      return(EXIT_FAILURE);
+    if (epoll_wait(efd, &ev, 1, 1000) != 1)
+      return(EXIT_FAILURE);
+    if (i == 1 && recv(dup_sock, buf, sizeof(buf), 0) < 0)
+      return(EXIT_FAILURE);
+    recv(sock, buf, sizeof(buf), 0);
+  }
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,38 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int sock;
+  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+    fprintf(stderr, "socket() failed: %s\n.", strerror(errno));
+    return(EXIT_FAILURE);
+  }
+
+  FILE *stream;
+  if ((stream = fdopen(sock, "w")) == NULL)
+    return(EXIT_FAILURE);
+  if (fclose(stream) == EOF)
+    return(EXIT_FAILURE);
+  if (open("/dev/null", O_WRONLY) != sock)
+    return(EXIT_FAILURE);
+  if (write(sock, "x", 1) != 1)
+    return(EXIT_FAILURE);
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,51 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int listener, sock, peer;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char buf[16];
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(listener, (struct sockaddr *)&addr, len) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+      connect(sock, (struct sockaddr *)&addr, len) < 0 ||
+      (peer = accept(listener, NULL, NULL)) < 0)
+    return(EXIT_FAILURE);
+  sleep(2);
+  if (send(sock, "x", 1, 0) < 0 || recv(peer, buf, sizeof(buf), 0) < 0)
+    return(EXIT_FAILURE);
+  struct linger linger = {1, 0};
+  if (setsockopt(peer, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) < 0)
+    return(EXIT_FAILURE);
+  close(peer);
+  usleep(10000);
+  if (recv(sock, buf, sizeof(buf), 0) != -1 || errno != ECONNRESET)
+    return(EXIT_FAILURE);
+  close(sock);
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,45 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int sock, fd = FD_SETSIZE + 8;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(sock, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if (dup2(sock, fd) != fd)
+    return(EXIT_FAILURE);
+  if (sendto(fd, "x", 1, 0, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  unsigned long *set = calloc(2, sizeof(fd_set));
+  if (!set)
+    return(EXIT_FAILURE);
+  set[fd / (8 * sizeof(long))] |= 1UL << (fd % (8 * sizeof(long)));
+  if (select(fd+1, (fd_set *)set, NULL, NULL, NULL) != 1)
+    return(EXIT_FAILURE);
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,32 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  for (int i = 0; i < 64; i++) {
+    int sock, copy;
+    if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+      return(EXIT_FAILURE);
+    if ((copy = dup(sock)) < 0)
+      return(EXIT_FAILURE);
+    close(copy);
+    close(sock);
+  }
+
+  return(EXIT_SUCCESS);
+}
@@ -5,6 +5,7 @@ TEST_DIR="/tmp/netspy"
 # LOGS
 PROCESS_DIR_REGEX="*.out*"
 LOG_FILE="logs.txt"
+MUX_FILE="mux.txt"
 LOG_LABEL_ERROR="ERROR"
 LOG_LABEL_WARN="WARN"
 LOG_LABEL_INFO="INFO"
@@ -102,10 +103,6 @@ SOCKET_SYSCALLS = [
   SOCK_EV_READV,
   SOCK_EV_IOCTL,
   SOCK_EV_SENDFILE,
-  SOCK_EV_POLL,
-  SOCK_EV_PPOLL,
-  SOCK_EV_SELECT,
-  SOCK_EV_PSELECT,
   SOCK_EV_FCNTL,
   SOCK_EV_EPOLL_CTL,
   SOCK_EV_EPOLL_WAIT,
@@ -113,4 +110,10 @@ SOCKET_SYSCALLS = [
   SOCK_EV_ISFDTYPE
 ]
 
-
+# Recorded once per call in mux.txt, rather than in the socket traces.
+MUX_SYSCALLS = [
+  SOCK_EV_POLL,
+  SOCK_EV_PPOLL,
+  SOCK_EV_SELECT,
+  SOCK_EV_PSELECT
+]
@@ -76,6 +76,10 @@ def read_json_as_array(con_id=0)
   wrap_as_array(read_json_trace(con_id))
 end
 
+def read_mux_as_array
+  wrap_as_array(File.read(dir_str+"/"+MUX_FILE))
+end
+
 ##################
 # Others helpers #
 ##################
@@ -82,6 +82,46 @@ CONNECT_FAIL = CProg.new(<<-EOT, 'connect_fail')
     return(EXIT_FAILURE);
 EOT
 
+# The accept queue of the listener is full: the SYN of the blocking connect()
+# is dropped, and retransmitted a second later, once a child has accepted.
+CONNECT_DELAYED = CProg.new(<<-EOT, 'connect_delayed')
+  int listener, sock;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(listener, (struct sockaddr *)&addr, len) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  for (int i = 0; i < 2; i++) {
+    if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, len) < 0)
+      return(EXIT_FAILURE);
+  }
+  pid_t pid = fork();
+  if (pid < 0) return(EXIT_FAILURE);
+  if (pid == 0) { // Child
+    usleep(500000);
+    for (int i = 0; i < 3; i++)
+      accept(listener, NULL, NULL);
+    return(EXIT_SUCCESS);
+  }
+  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+      connect(sock, (struct sockaddr *)&addr, len) < 0) {
+    fprintf(stderr, "connect() failed: %s\\n.", strerror(errno));
+    return(EXIT_FAILURE);
+  }
+  if (send(sock, "x", 1, 0) < 0)
+    return(EXIT_FAILURE);
+  int status;
+  waitpid(pid, &status, 0);
+  close(sock);
+EOT
+
 SHUTDOWN = CProg.new(<<-EOT, 'shutdown')
 #{CONNECT}
   if (shutdown(sock, SHUT_WR) < 0) {
@@ -189,6 +229,16 @@ SEND_DGRAM = CProg.new(<<-EOT, 'send_dgram')
   }
 EOT
 
+SEND_SAMPLED = CProg.new(<<-EOT, 'send_sampled')
+#{CONNECT}
+  int data = 42;
+  for (int i = 0; i < 5; i++) {
+    if (send(sock, &data, sizeof(data), 0) < 0)
+      return(EXIT_FAILURE);
+    usleep(50000);
+  }
+EOT
+
 SEND_FAIL = CProg.new(<<-EOT, 'send_fail')
 #{SOCKET}
   int data = 42;
@@ -931,6 +981,32 @@ SELECT_FAIL = CProg.new(<<-EOT, 'select_fail')
     return(EXIT_FAILURE);
 EOT
 
+# The sets of nfds above FD_SETSIZE are allocated by the application.
+SELECT_LARGE = CProg.new(<<-EOT, 'select_large')
+  int sock, fd = FD_SETSIZE + 8;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(sock, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if (dup2(sock, fd) != fd)
+    return(EXIT_FAILURE);
+  if (sendto(fd, "x", 1, 0, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  unsigned long *set = calloc(2, sizeof(fd_set));
+  if (!set)
+    return(EXIT_FAILURE);
+  set[fd / (8 * sizeof(long))] |= 1UL << (fd % (8 * sizeof(long)));
+  if (select(fd+1, (fd_set *)set, NULL, NULL, NULL) != 1)
+    return(EXIT_FAILURE);
+EOT
+
 PSELECT = CProg.new(<<-EOT, 'pselect')
 #{two_sockets('SOCK_STREAM', 'IPPROTO_TCP')}
 #{fdset}
@@ -1074,6 +1150,31 @@ FDOPEN = CProg.new(<<-EOT, 'fdopen')
   }
 EOT
 
+# The fd of the socket is closed by fclose(), then reused by a file.
+FCLOSE_REUSE = CProg.new(<<-EOT, 'fclose_reuse')
+#{SOCKET}
+  FILE *stream;
+  if ((stream = fdopen(sock, "w")) == NULL)
+    return(EXIT_FAILURE);
+  if (fclose(stream) == EOF)
+    return(EXIT_FAILURE);
+  if (open("/dev/null", O_WRONLY) != sock)
+    return(EXIT_FAILURE);
+  if (write(sock, "x", 1) != 1)
+    return(EXIT_FAILURE);
+EOT
+
+# Same with close_range().
+CLOSE_RANGE_REUSE = CProg.new(<<-EOT, 'close_range_reuse')
+#{SOCKET}
+  if (close_range(sock, sock, 0) < 0)
+    return(EXIT_FAILURE);
+  if (open("/dev/null", O_WRONLY) != sock)
+    return(EXIT_FAILURE);
+  if (write(sock, "x", 1) != 1)
+    return(EXIT_FAILURE);
+EOT
+
 FDOPEN_DGRAM = CProg.new(<<-EOT, 'fdopen_dgram')
 #{SOCKET_DGRAM}
   if (fdopen(sock, "w") == NULL) {
@@ -1108,3 +1209,202 @@ CONCURRENT_CONNECTIONS = CProg.new(<<-EOT, 'concurrent_connections')
   close(sock1);
   close(sock2);
 EOT
+
+# The second wakeup is wasted: the datagram is read through a dup first.
+EPOLL_LAG = CProg.new(<<-EOT, 'epoll_lag')
+  int sock, dup_sock, efd;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char buf[16];
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(sock, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if ((dup_sock = dup(sock)) < 0)
+    return(EXIT_FAILURE);
+  if ((efd = epoll_create1(0)) < 0)
+    return(EXIT_FAILURE);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) < 0)
+    return(EXIT_FAILURE);
+  for (int i = 0; i < 2; i++) {
+    if (sendto(sock, "x", 1, 0, (struct sockaddr *)&addr, len) < 0)
+      return(EXIT_FAILURE);
+    if (epoll_wait(efd, &ev, 1, 1000) != 1)
+      return(EXIT_FAILURE);
+    if (i == 1 && recv(dup_sock, buf, sizeof(buf), 0) < 0)
+      return(EXIT_FAILURE);
+    recv(sock, buf, sizeof(buf), 0);
+  }
+EOT
+
+EPOLL_LAG_REUSE = CProg.new(<<-EOT, 'epoll_lag_reuse')
+  int sock, efd;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char buf[16];
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(sock, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if ((efd = epoll_create1(0)) < 0)
+    return(EXIT_FAILURE);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) < 0)
+    return(EXIT_FAILURE);
+  if (sendto(sock, "x", 1, 0, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (epoll_wait(efd, &ev, 1, 1000) != 1)
+    return(EXIT_FAILURE);
+  close(sock);
+  if (socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP) != sock)
+    return(EXIT_FAILURE);
+  if (recv(sock, buf, sizeof(buf), 0) != -1)
+    return(EXIT_FAILURE);
+EOT
+
+# With -s 2, the second socket is sampled out, and so must be its copy.
+DUP2_SAMPLED = CProg.new(<<-EOT, 'dup2_sampled')
+#{two_sockets('SOCK_DGRAM', 'IPPROTO_UDP')}
+#{sockaddr_in(WebServer::PORT)}
+  if (dup2(sock2, sock2 + 10) < 0)
+    return(EXIT_FAILURE);
+  if (sendto(sock2 + 10, "x", 1, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return(EXIT_FAILURE);
+EOT
+
+# The child exits without tracing anything, while the parent's control socket
+# stays up for the test to drive it.
+CONTROL_FORK = CProg.new(<<-EOT, 'control_fork')
+#{SOCKET}
+  pid_t pid = fork();
+  if (pid < 0) return(EXIT_FAILURE);
+  if (pid == 0) // Child
+    return(EXIT_SUCCESS);
+  waitpid(pid, NULL, 0);
+  sleep(2);
+EOT
+
+# Hooked calls for over 2 seconds, mostly in the lib: the governor steps down.
+GOVERNOR_BUSY = CProg.new(<<-EOT, 'governor_busy')
+#{SOCKET}
+  int optval;
+  socklen_t optlen = sizeof(optval);
+  for (int i = 0; i < 15000; i++) {
+    if (getsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, &optlen) < 0)
+      return(EXIT_FAILURE);
+    usleep(100);
+  }
+EOT
+
+# Each socket is copied, so that new sockets only get even ids.
+SOCKETS_DUP = CProg.new(<<-EOT, 'sockets_dup')
+  for (int i = 0; i < 64; i++) {
+    int sock, copy;
+    if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+      return(EXIT_FAILURE);
+    if ((copy = dup(sock)) < 0)
+      return(EXIT_FAILURE);
+    close(copy);
+    close(sock);
+  }
+EOT
+
+# The readiness is reported in the parent, the socket read in the child.
+EPOLL_LAG_FORK = CProg.new(<<-EOT, 'epoll_lag_fork')
+  int sock, efd;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char buf[16];
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(sock, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if ((efd = epoll_create1(0)) < 0)
+    return(EXIT_FAILURE);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) < 0)
+    return(EXIT_FAILURE);
+  if (sendto(sock, "x", 1, 0, (struct sockaddr *)&addr, len) < 0)
+    return(EXIT_FAILURE);
+  if (epoll_wait(efd, &ev, 1, 1000) != 1)
+    return(EXIT_FAILURE);
+  pid_t pid = fork();
+  if (pid < 0) return(EXIT_FAILURE);
+  if (pid == 0) { // Child
+    if (recv(sock, buf, sizeof(buf), 0) < 0)
+      return(EXIT_FAILURE);
+    return(EXIT_SUCCESS);
+  }
+  waitpid(pid, NULL, 0);
+EOT
+
+# Sockets and a pipe opened while dormant, then tracing activated by SIGUSR1.
+DORMANT_SWEEP = CProg.new(<<-EOT, 'dormant_sweep')
+#{CONNECT}
+  int udp, fds[2];
+  if ((udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    return(EXIT_FAILURE);
+  if (pipe(fds) < 0)
+    return(EXIT_FAILURE);
+  if (raise(SIGUSR1))
+    return(EXIT_FAILURE);
+  if (write(fds[1], "x", 1) < 0)
+    return(EXIT_FAILURE);
+  if (send(sock, "x", 1, 0) < 0)
+    return(EXIT_FAILURE);
+EOT
+
+# The peer resets the connection two seconds after the handshake: the recv()
+# fails with ECONNRESET.
+RECV_RESET = CProg.new(<<-EOT, 'recv_reset')
+  int listener, sock, peer;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char buf[16];
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(listener, (struct sockaddr *)&addr, len) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+      connect(sock, (struct sockaddr *)&addr, len) < 0 ||
+      (peer = accept(listener, NULL, NULL)) < 0)
+    return(EXIT_FAILURE);
+  sleep(2);
+  if (send(sock, "x", 1, 0) < 0 || recv(peer, buf, sizeof(buf), 0) < 0)
+    return(EXIT_FAILURE);
+  struct linger linger = {1, 0};
+  if (setsockopt(peer, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) < 0)
+    return(EXIT_FAILURE);
+  close(peer);
+  usleep(10000);
+  if (recv(sock, buf, sizeof(buf), 0) != -1 || errno != ECONNRESET)
+    return(EXIT_FAILURE);
+  close(sock);
+EOT
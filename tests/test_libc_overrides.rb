@@ -57,7 +57,7 @@ describe "libc overrides" do
         end
       end
 
-      unless [SOCK_EV_POLL, SOCK_EV_PPOLL, SOCK_EV_SOCKATMARK].include?(syscall)
+      unless [SOCK_EV_SOCKATMARK].include?(syscall)
         it "#{failing} should not crash" do
           assert run_c_program(failing)
         end
@@ -65,8 +65,8 @@ describe "libc overrides" do
 
       # SOCKET: No log file if no TCP connection.
       # CLOSE: No log file if no TCP connection. How to fail close() with con?
-      unless [SOCK_EV_SOCKET, SOCK_EV_CLOSE, SOCK_EV_POLL,
-              SOCK_EV_PPOLL, SOCK_EV_SOCKATMARK].include?(syscall)
+      unless [SOCK_EV_SOCKET, SOCK_EV_CLOSE,
+              SOCK_EV_SOCKATMARK].include?(syscall)
         it "#{failing} should log no ERROR" do
           run_c_program(failing)
           assert no_error_log
@@ -77,7 +77,7 @@ describe "libc overrides" do
       # LISTEN: How to fail listen() on valid TCP socket?
       # CLOSE: How to fail close() on valid TCP socket?
       unless [SOCK_EV_SOCKET, SOCK_EV_LISTEN, SOCK_EV_CLOSE, SOCK_EV_DUP,
-              SOCK_EV_POLL, SOCK_EV_PPOLL, SOCK_EV_FCNTL, SOCK_EV_EPOLL_WAIT,
+              SOCK_EV_FCNTL, SOCK_EV_EPOLL_WAIT,
               SOCK_EV_EPOLL_PWAIT, SOCK_EV_SOCKATMARK,
               SOCK_EV_ISFDTYPE].include?(syscall)
         it "should be in JSON with #{failing}" do
@@ -88,6 +88,31 @@ describe "libc overrides" do
     end
   end
 
+  MUX_SYSCALLS.each do |syscall|
+    describe "when calling #{syscall}()" do
+      progs = [syscall, "#{syscall}_dgram"]
+      # POLL, PPOLL: no failing program.
+      progs << "#{syscall}_fail" if [SOCK_EV_SELECT,
+                                     SOCK_EV_PSELECT].include?(syscall)
+      progs.each do |prog|
+        it "#{prog} should not crash" do
+          assert run_c_program(prog)
+        end
+
+        it "#{prog} should log no ERROR" do
+          run_c_program(prog)
+          assert no_error_log
+        end
+
+        it "should be in #{MUX_FILE} with #{prog}" do
+          run_c_program(prog)
+          pattern = [{ type: syscall }.ignore_extra_keys!].ignore_extra_values!
+          assert_json_match(pattern, read_mux_as_array)
+        end
+      end
+    end
+  end
+
   describe "when calling fork()" do
     prog = "fork"
 
@@ -137,4 +162,19 @@ describe "libc overrides" do
       end
     end
   end
+
+  ["fclose_reuse", "close_range_reuse"].each do |prog|
+    describe "a socket closed by #{prog.sub('_reuse', '')}()" do
+      it "#{prog} should close the socket" do
+        run_c_program(prog)
+        assert_event_present(SOCK_EV_CLOSE)
+      end
+
+      it "#{prog} should not trace the file which reuses its fd" do
+        run_c_program(prog)
+        pattern = [{ type: SOCK_EV_WRITE }.ignore_extra_keys!].ignore_extra_values!
+        refute_json_match(pattern, read_json_as_array(0))
+      end
+    end
+  end
 end
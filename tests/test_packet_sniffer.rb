@@ -15,6 +15,40 @@ def get_packet(pcap, pkt_id)
   PacketFu::Packet.parse(pcap[pkt_id])
 end
 
+# TCP flags of the packets of a pcap file of raw IPv4 packets.
+def tcp_flags(path)
+  data = File.binread(path)
+  flags = []
+  offset = 24
+  while offset + 16 <= data.size
+    caplen = data[offset + 8, 4].unpack('V').first
+    ip = data[offset + 16, caplen]
+    flags << ip.getbyte((ip.getbyte(0) & 0x0f) * 4 + 13)
+    offset += 16 + caplen
+  end
+  flags
+end
+
+# Timestamps in seconds of the packets of a pcap file.
+def pcap_times(path)
+  data = File.binread(path)
+  times = []
+  offset = 24
+  while offset + 16 <= data.size
+    sec, usec, caplen = data[offset, 12].unpack('VVV')
+    times << sec + usec / 1e6
+    offset += 16 + caplen
+  end
+  times
+end
+
+def assert_handshake(flags)
+  assert flags.size >= 3
+  assert flags.any? { |f| f & 0x12 == 0x02 }  # SYN
+  assert flags.any? { |f| f & 0x12 == 0x12 }  # SYN-ACK
+  assert flags.any? { |f| f & 0x12 == 0x10 }  # ACK
+end
+
 describe "packet_sniffer.c" do
   before do WebServer.start end
   MiniTest::Unit.after_tests { WebServer.stop }
@@ -24,12 +58,55 @@ describe "packet_sniffer.c" do
     assert contains?(dir_str, "0.pcap")
   end
 
-  # Need to capture on a single interface to use packetfu
-  # Otherwises issues with layer 2 header.
+  it "should create a PCAP file for an unconnected UDP socket" do
+    run_c_program("#{SOCK_EV_SENDTO}_dgram", "-c")
+    assert contains?(dir_str, "0.pcap")
+  end
+
+  it "should create a PCAP file for a bound UDP socket" do
+    run_c_program("#{SOCK_EV_BIND}_dgram", "-c")
+    assert contains?(dir_str, "0.pcap")
+  end
+
+  it "should only capture headers with -o 0" do
+    run_c_program(SOCK_EV_CONNECT, "-c -o 0")
+    snaplen = File.binread(pcap_file_str)[16, 4].unpack('V').first
+    assert_equal 120, snaplen
+  end
+
+  it "should not write the flight recorder without a trigger" do
+    run_c_program(SOCK_EV_CONNECT, "-x 100")
+    refute contains?(dir_str, "0.pcap")
+  end
+
+  # The handshake is 2 seconds older than the reset, out of the window.
+  it "should write the flight recorder on a reset by the peer" do
+    run_c_program("recv_reset", "-x 100/1")
+    path = dir_str+"/1.pcap"
+    flags = tcp_flags(path)
+    assert flags.any? { |f| f & 0x04 != 0 }   # RST
+    refute flags.any? { |f| f & 0x02 != 0 }   # SYN
+    times = pcap_times(path)
+    assert times.max - times.min <= 1.2
+  end
+
   it "should capture the 3-way handshake on CONNECT" do
-    skip
     run_c_program(SOCK_EV_CONNECT, "-c")
-    cap = get_pcap
-    assert cap.size >= 3
+    assert_handshake(tcp_flags(pcap_file_str))
+  end
+
+  # On loopback, the data follows the SYN before the thread sets the filter.
+  it "should capture the first data segment on SEND" do
+    run_c_program(SOCK_EV_SEND, "-c")
+    flags = tcp_flags(pcap_file_str)
+    assert_handshake(flags)
+    assert flags.any? { |f| f & 0x08 != 0 }  # PSH
+  end
+
+  # The connect() takes a second: its SYN is long out of the ring when it
+  # returns.
+  it "should capture the 3-way handshake of a slow CONNECT" do
+    run_c_program("connect_delayed", "-c")
+    assert_handshake(tcp_flags(process_dirs.first + "/3.pcap"))
   end
 end
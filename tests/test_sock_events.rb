@@ -51,6 +51,7 @@ describe 'tcp_spy' do
     thread_id: Integer,
     fake_call: Boolean,
     timestamp_usec: Integer,
+    timestamp_ns: Integer,
     type: String
   }
 
@@ -107,34 +108,20 @@ describe 'tcp_spy' do
 
   msghdr = {
     control_data_len: Integer,
-    control_data: Array,
+    control_data: {
+      cmsg_count: Integer
+    }.ignore_extra_keys!,
     iovec: {
       iovec_count: Integer,
       iovec_sizes: [Integer].ignore_extra_values!
     }
   }
 
-  poll_events = {
-    POLLIN: Boolean,
-    POLLPRI: Boolean,
-    POLLOUT: Boolean,
-    POLLRDHUP: Boolean,
-    POLLERR: Boolean,
-    POLLHUP: Boolean,
-    POLLNVAL: Boolean
-  }
-
   timeout = {
     seconds: Integer,
     nanoseconds: Integer
   }
 
-  select_events = {
-    READ: Boolean,
-    WRITE: Boolean,
-    EXCEPT: Boolean
-  }
-
   epoll_events = {
     EPOLLIN: Boolean,
     EPOLLOUT: Boolean,
@@ -177,6 +164,7 @@ describe 'tcp_spy' do
     SOCK_EV_SENDTO => {
       bytes: Integer,
       flags: send_flags,
+      addr_id: Integer,
       addr: addr
     },
     SOCK_EV_RECVFROM => {
@@ -223,9 +211,11 @@ describe 'tcp_spy' do
       bytes: Integer
     },
     SOCK_EV_GETSOCKNAME => {
+      addr_id: Integer,
       addr: addr
     },
     SOCK_EV_GETPEERNAME => {
+      addr_id: Integer,
       addr: addr
     },
     SOCK_EV_SOCKATMARK => {
@@ -262,26 +252,6 @@ describe 'tcp_spy' do
     SOCK_EV_SENDFILE => {
       bytes: Integer
     },
-    SOCK_EV_POLL => {
-      timeout: timeout,
-      requested_events: poll_events,
-      returned_events: poll_events
-    },
-    SOCK_EV_PPOLL => {
-      timeout: timeout,
-      requested_events: poll_events,
-      returned_events: poll_events
-    },
-    SOCK_EV_SELECT => {
-      timeout: timeout,
-      requested_events: select_events,
-      returned_events: select_events
-    },
-    SOCK_EV_PSELECT => {
-      timeout: timeout,
-      requested_events: select_events,
-      returned_events: select_events
-    },
     SOCK_EV_FCNTL => {
       cmd: String
     }.ignore_extra_keys!,
@@ -332,8 +302,9 @@ describe 'tcp_spy' do
       reordering: Integer,
       rcv_rtt: Integer,
       rcv_space: Integer,
-      total_retrans: Integer
-    }
+      total_retrans: Integer,
+      source: String
+    }.ignore_extra_keys!  # Queues & memory with sock_diag only.
   }
 
   SOCKET_SYSCALLS.each do |syscall|
@@ -347,4 +318,47 @@ describe 'tcp_spy' do
       end
     end
   end
+
+  MUX_SYSCALLS.each do |syscall|
+    describe "a #{syscall} record" do
+      it "#{syscall} should list both sockets in a single record" do
+        run_c_program(syscall)
+        pattern = [
+          {
+            type: syscall,
+            timestamp_usec: Integer,
+            timestamp_ns: Integer,
+            return_value: Integer,
+            thread_id: Integer,
+            timeout_ns: Integer,
+            fds: [
+              { fd: Integer, socket: 0, requested: Integer, returned: Integer },
+              { fd: Integer, socket: 1, requested: Integer, returned: Integer }
+            ]
+          }
+        ]
+        assert_json_match(pattern, read_mux_as_array)
+      end
+    end
+  end
+
+  describe "a select record over FD_SETSIZE" do
+    it "should list the sockets above FD_SETSIZE" do
+      skip "needs over FD_SETSIZE fds" if Process.getrlimit(:NOFILE)[1] < 2048
+      Process.setrlimit(:NOFILE, 2048) # FD_SETSIZE is 1024.
+      run_c_program("select_large")
+      pattern = [{
+        type: SOCK_EV_SELECT,
+        fds: [{ fd: 1032, socket: 1 }.ignore_extra_keys!]
+      }.ignore_extra_keys!]
+      assert_json_match(pattern, read_mux_as_array)
+    end
+  end
+
+  describe "a failed dup2 event" do
+    it "should not be followed by the lib's own fd probe" do
+      run_c_program("#{SOCK_EV_DUP2}_fail")
+      refute_match(/"#{SOCK_EV_FCNTL}"/, read_json_trace)
+    end
+  end
  end
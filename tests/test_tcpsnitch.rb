@@ -2,6 +2,7 @@
 require 'minitest/autorun'
 require 'minitest/spec'
 require 'minitest/reporters'
+require 'socket'
 require './lib/lib.rb'
 
 Minitest::Reporters.use! Minitest::Reporters::SpecReporter.new
@@ -25,7 +26,7 @@ describe "tcpsnitch" do
     end
   end
 
-  ["-b", "-f", "-l", "-t", "-u"].each do |opt|
+  ["-b", "-e", "-f", "-g", "-i", "-l", "-s", "-t", "-u"].each do |opt|
     describe "when #{opt} is set" do
       it "should report 'invalid #{opt} argument'" do
         assert_match(/invalid #{opt} argument/, tcpsnitch_output("#{opt} -42", cmd))
@@ -55,6 +56,191 @@ describe "tcpsnitch" do
     # Rest is tested in test_packet_sniffer.rb
   end
 
+  describe "option -r" do
+    it "should not crash with -r" do
+      assert tcpsnitch("-r", cmd)
+    end
+
+    it "should record the clock anchor" do
+      run_c_program(SOCK_EV_SOCKET, "-r")
+      assert contains?(dir_str, "clock.txt")
+    end
+  end
+
+  describe "option -e" do
+    it "should not record events over the budget" do
+      run_c_program(SOCK_EV_SEND, "-e 1")
+      assert_match(/"#{SOCK_EV_CONNECT}"/, read_json_trace)
+      refute_match(/"#{SOCK_EV_SEND}"/, read_json_trace)
+    end
+  end
+
+  describe "option -b" do
+    it "should sample TCP_INFO after each send over the threshold" do
+      run_c_program("send_sampled", "-b 1")
+      assert read_json_trace.scan(/"#{SOCK_EV_TCP_INFO}"/).size > 1
+    end
+
+    it "should keep sampling when the samples are over the budget" do
+      run_c_program("send_sampled", "-b 1 -e 2")
+      over = File.read(log_file_str)[/(\d+) events over budget/, 1]
+      assert over.to_i > 5 # The 5 sends and more than one sample.
+    end
+  end
+
+  describe "option -s" do
+    it "should not trace the copy of a sampled-out socket" do
+      run_c_program("dup2_sampled", "-s 2")
+      assert contains?(dir_str, "0.json")
+      assert !contains?(dir_str, "2.json")
+    end
+
+    it "should trace about 1 socket in n" do
+      run_c_program("sockets_dup", "-s 2")
+      traced = Dir[dir_str+"/*.json"].count do |f|
+        File.read(f).include?("\"#{SOCK_EV_SOCKET}\"")
+      end
+      assert_includes(16..48, traced) # Of 64 sockets.
+    end
+  end
+
+  describe "option -w" do
+    it "should only record the listed events" do
+      run_c_program(SOCK_EV_SEND, "-w #{SOCK_EV_BIND}")
+      assert_match(/"#{SOCK_EV_CONNECT}"/, read_json_trace)
+      refute_match(/"#{SOCK_EV_SEND}"/, read_json_trace)
+    end
+  end
+
+  describe "option -q" do
+    it "should not write the events of a healthy socket" do
+      run_c_program(SOCK_EV_SEND, "-q 10")
+      assert !contains?(dir_str, "0.json")
+      assert contains?(dir_str, "recorder.txt")
+    end
+
+    it "should write the events of a socket with a failed call" do
+      run_c_program("#{SOCK_EV_BIND}_fail", "-q 10")
+      assert_match(/"#{SOCK_EV_BIND}"/, read_json_trace)
+    end
+
+    it "should write the events matching a -j trigger" do
+      run_c_program(SOCK_EV_SEND, "-q 10 -j #{SOCK_EV_SEND}")
+      assert_match(/"#{SOCK_EV_SEND}"/, read_json_trace)
+    end
+  end
+
+  describe "option -m" do
+    it "should trace matching sockets" do
+      run_c_program(SOCK_EV_SEND, "-m tcp")
+      assert_match(/"#{SOCK_EV_SEND}"/, read_json_trace)
+    end
+
+    it "should not trace other sockets" do
+      run_c_program(SOCK_EV_SEND, "-m 'udp or port 1'")
+      assert !contains?(dir_str, "0.json")
+    end
+
+    it "should match bound UDP sockets on their local address" do
+      run_c_program("#{SOCK_EV_BIND}_dgram", "-m 'port 55555'")
+      assert contains?(dir_str, "0.json")
+      run_c_program("#{SOCK_EV_BIND}_dgram", "-m 'port 1'")
+      assert !contains?(dir_str, "0.json")
+    end
+  end
+
+  describe "option -i" do
+    it "should not trace while dormant" do
+      run_c_program(SOCK_EV_SEND, "-i 0")
+      assert !contains?(dir_str, "0.json")
+    end
+
+    it "should find the sockets opened while dormant once activated" do
+      run_c_program("dormant_sweep", "-i #{Signal.list['USR1']} -f 3")
+      [["0.json", "SOCK_STREAM"], ["1.json", "SOCK_DGRAM"]].each do |f, type|
+        assert_match(/^\{"type": "ghost_socket".*"type": "#{type}"/,
+                     File.read(dir_str+"/"+f))
+      end
+      assert !contains?(dir_str, "2.json")
+      others = File.read(log_file_str)[/sockets found open, (\d+) other/, 1]
+      assert others.to_i >= 2 # The pipe.
+    end
+  end
+
+  describe "overhead" do
+    it "should write the overhead summary" do
+      run_c_program(SOCK_EV_SEND)
+      assert_match(/"process".*"hook_ns"/, File.read(dir_str+"/overhead.txt"))
+    end
+  end
+
+  describe "event-loop lag" do
+    it "should count the wasted wakeup" do
+      run_c_program("epoll_lag")
+      assert_match(/"wakeups": 2, "wasted_wakeups": 1/,
+                   File.read(dir_str+"/loop_lag.txt"))
+    end
+
+    it "should forget the readiness of a closed fd" do
+      run_c_program("epoll_lag_reuse")
+      assert !contains?(dir_str, "loop_lag.txt")
+    end
+
+    it "should forget the readiness reported to the parent in a child" do
+      run_c_program("epoll_lag_fork")
+      assert_equal 2, process_dirs.size
+      process_dirs.each { |dir| assert !contains?(dir, "loop_lag.txt") }
+    end
+  end
+
+  describe "option -g" do
+    it "should sample new sockets over the budget" do
+      run_c_program("governor_busy", "-g 1")
+      assert_match(/"from": "full", "to": "sampled"/,
+                   File.read(dir_str+"/governor.txt"))
+    end
+
+    it "should not step down without -g" do
+      run_c_program("governor_busy")
+      assert !contains?(dir_str, "governor.txt")
+    end
+  end
+
+  describe "control socket" do
+    def control(sock, cmd)
+      sock.puts(cmd)
+      sock.gets
+    end
+
+    it "should be driven by commands" do
+      reset_dir(TEST_DIR)
+      pid = spawn("#{EXECUTABLE} -n -d #{TEST_DIR} ./c_programs/control_fork.out",
+                  [:out, :err] => "/dev/null")
+      path = nil
+      20.times do
+        path = Dir[TEST_DIR+"/*/control.sock"].first
+        break if path
+        sleep 0.05
+      end
+      assert path
+      sleep 0.5 # The child has exited, without unlinking it.
+      UNIXSocket.open(path) do |sock|
+        assert_match(/^ok dormant=0 level=full .* e=0 /, control(sock, "get"))
+        assert_match(/^ok/, control(sock, "set e 5"))
+        assert_match(/ e=5 /, control(sock, "get"))
+        assert_match(/^error/, control(sock, "set e foo"))
+        assert_match(/^ok/, control(sock, "dormant"))
+        assert_match(/^ok dormant=1/, control(sock, "get"))
+        assert_match(/^ok/, control(sock, "activate"))
+        assert_match(/^ok/, control(sock, "flush"))
+        assert_match(/^ok/, control(sock, "record"))
+        assert_match(/^error unknown command/, control(sock, "foo"))
+      end
+      Process.wait(pid)
+      assert contains?(File.dirname(path), "0.json")
+    end
+  end
+
   describe "when -d is set" do
     it "should report 'invalid argument' with invalid dir" do
       assert_match(/invalid -d argument/, tcpsnitch_output("-d 1234", cmd))
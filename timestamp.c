@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+
+#include "timestamp.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAS_TSC
+#endif
+#include "lib.h"
+#include "logger.h"
+#include "string_builders.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define TSC_CALIBRATION_NS 20000000  // 20ms
+#define TSC_MULT_SHIFT 32
+
+static uint64_t anchor_wall_ns;
+static uint64_t anchor_mono_ns;
+static bool tsc_enabled = false;
+#ifdef HAS_TSC
+static uint64_t anchor_tsc;
+static uint64_t tsc_mult;  // ns per tick, fixed point (TSC_MULT_SHIFT).
+#endif
+
+/* Private functions */
+
+static uint64_t read_clock_ns(clockid_t clock_id) {
+        struct timespec ts;
+        if (clock_gettime(clock_id, &ts)) goto error;
+        return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+error:
+        LOG(ERROR, "clock_gettime() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        return 0;
+}
+
+#ifdef HAS_TSC
+static bool is_tsc_invariant(void) {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+        return edx & (1 << 8);
+}
+
+/* Count TSC ticks over a short busy wait on CLOCK_MONOTONIC. */
+static bool calibrate_tsc(void) {
+        if (!is_tsc_invariant()) goto error;
+        uint64_t mono_start = read_clock_ns(CLOCK_MONOTONIC);
+        uint64_t tsc_start = __rdtsc();
+        uint64_t mono_end;
+        do {
+                mono_end = read_clock_ns(CLOCK_MONOTONIC);
+        } while (mono_end - mono_start < TSC_CALIBRATION_NS);
+        uint64_t ticks = __rdtsc() - tsc_start;
+        if (!ticks) goto error;
+
+        tsc_mult = ((mono_end - mono_start) << TSC_MULT_SHIFT) / ticks;
+        LOG(INFO, "TSC calibrated at %lu ticks per ms.",
+            (unsigned long)(ticks * 1000000 / (mono_end - mono_start)));
+        return true;
+error:
+        LOG(WARN, "No invariant TSC. Falling back to CLOCK_MONOTONIC.");
+        return false;
+}
+#endif
+
+/* Public functions */
+
+/* The anchors are read back to back, after the calibration, so that the wall
+ * time of an event does not drift by the 20ms of the busy wait. */
+void init_timestamps(bool use_tsc) {
+#ifdef HAS_TSC
+        tsc_enabled = use_tsc && calibrate_tsc();
+#else
+        if (use_tsc) LOG(WARN, "TSC unsupported. Using CLOCK_MONOTONIC.");
+#endif
+        anchor_wall_ns = read_clock_ns(CLOCK_REALTIME);
+        anchor_mono_ns = read_clock_ns(CLOCK_MONOTONIC);
+#ifdef HAS_TSC
+        anchor_tsc = __rdtsc();
+#endif
+}
+
+void dump_clock_anchor(const char *logs_dir) {
+        char *path, buf[256];
+        if (!(path = alloc_concat_path(logs_dir, "clock.txt"))) goto error;
+        snprintf(buf, sizeof(buf),
+                 "{\"source\": \"%s\", \"wall_ns\": %llu, \"monotonic_ns\": "
+                 "%llu}\n",
+                 tsc_enabled ? "tsc" : "monotonic",
+                 (unsigned long long)anchor_wall_ns,
+                 (unsigned long long)anchor_mono_ns);
+        append_string_to_file(buf, path);
+        free(path);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+uint64_t get_time_ns(void) {
+#ifdef HAS_TSC
+        if (tsc_enabled) {
+                uint64_t ticks = __rdtsc() - anchor_tsc;
+                return anchor_mono_ns +
+                       (uint64_t)(((unsigned __int128)ticks * tsc_mult) >>
+                                  TSC_MULT_SHIFT);
+        }
+#endif
+        return read_clock_ns(CLOCK_MONOTONIC);
+}
+
+unsigned long wall_micros_from_ns(uint64_t ns) {
+        return (anchor_wall_ns + (ns - anchor_mono_ns)) / 1000;
+}
@@ -0,0 +1,18 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Event timestamps are taken from CLOCK_MONOTONIC, or from the TSC when
+ * requested and usable, so that NTP steps do not corrupt deltas between
+ * events. A (wall clock, monotonic clock) anchor pair is taken once at init and
+ * written in the trace, which allows to convert timestamps to wall time. */
+
+void init_timestamps(bool use_tsc);
+void dump_clock_anchor(const char *logs_dir);
+
+uint64_t get_time_ns(void);
+unsigned long wall_micros_from_ns(uint64_t ns);
+
+#endif
@@ -170,22 +170,6 @@ static void output_ev_sendfile(const SockEvSendfile *ev) {
         OUTPUT_EV("sendfile()=%d", ev->super.return_value);
 }
 
-static void output_ev_poll(const SockEvPoll *ev) {
-        OUTPUT_EV("poll()=%d", ev->super.return_value);
-}
-
-static void output_ev_ppoll(const SockEvPpoll *ev) {
-        OUTPUT_EV("ppoll()=%d", ev->super.return_value);
-}
-
-static void output_ev_select(const SockEvSelect *ev) {
-        OUTPUT_EV("select()=%d", ev->super.return_value);
-}
-
-static void output_ev_pselect(const SockEvPselect *ev) {
-        OUTPUT_EV("pselect()=%d", ev->super.return_value);
-}
-
 static void output_ev_tcpinfo(const SockEvTcpInfo *ev) {
         OUTPUT_EV("tcp_info=%d", ev->super.return_value);
 }
@@ -318,18 +302,6 @@ void output_event(const SockEvent *ev) {
                 case SOCK_EV_SENDFILE:
                         output_ev_sendfile((const SockEvSendfile *)ev);
                         break;
-                case SOCK_EV_POLL:
-                        output_ev_poll((const SockEvPoll *)ev);
-                        break;
-                case SOCK_EV_PPOLL:
-                        output_ev_ppoll((const SockEvPpoll *)ev);
-                        break;
-                case SOCK_EV_SELECT:
-                        output_ev_select((const SockEvSelect *)ev);
-                        break;
-                case SOCK_EV_PSELECT:
-                        output_ev_pselect((const SockEvPselect *)ev);
-                        break;
                 case SOCK_EV_FCNTL:
                         output_ev_fcntl((const SockEvFcntl *)ev);
                         break;
@@ -348,5 +320,10 @@ void output_event(const SockEvent *ev) {
                 case SOCK_EV_TCP_INFO:
                         output_ev_tcpinfo((const SockEvTcpInfo *)ev);
                         break;
+                case SOCK_EV_POLL:
+                case SOCK_EV_PPOLL:
+                case SOCK_EV_SELECT:
+                case SOCK_EV_PSELECT:
+                        break;  // Recorded per call, see mux_events.h.
         }
 }